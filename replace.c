@@ -5,13 +5,43 @@
    each occurrence of a from-string with the corresponding to-string.
 
    Usage:
-     replace [-s] [-v] from to [from to ...] [--] [files...]
+     replace [-s] [-i] [-w] [-E] [-e] [-v] from to [from to ...] [--] [files...]
+     replace [-s] [-i] [-w] [-e] [-v] -f PAIRS [from to ...] [--] [files...]
 
    Options:
      -s    Silent mode. Suppress non-error messages.
+     -i    Case-insensitive matching (ASCII letters).
+     -E    Treat from-strings as extended regular expressions; \1..\9 in a to-string insert groups.
+     -e    Decode escapes in from/to strings: \t \n \r \0 \\ \xNN. A from-string with a
+           newline, or with -E a regex that can match one, matches across lines.
+     -f FILE  Read pairs from FILE, one 'from<TAB>to' per line.
+     --then   Start another stage: its pairs are applied to the output of the previous ones.
+     --rules=FILE  Rewrite each file with the pairs file of the first matching 'GLOB PAIRS-FILE' line.
+     --cache=DIR   Skip files unchanged since a run with the same pairs found nothing in them.
+     --diff   Print the changes as a unified diff instead of making them.
+     --report=FILE  Write a record per replacement: file, offset, line, column, length, pair, stage.
+     --report-format=FORMAT  Format of --report records: ndjson (default) or binary.
+     --journal=FILE  Record the original bytes of every replacement in rewritten files.
+     --undo=FILE     Restore the files rewritten by the run that wrote journal FILE.
+     --backup[=SUFFIX]  Keep the original of each rewritten file as FILE~ (or FILE + SUFFIX).
+     --memo[=N]  Remember the replacements of the last N distinct lines (default 4096).
+     --stats     Print input, replacement and --memo hit counts to stderr.
+     --from-file=FILE --to-file=FILE  Add a pair whose from/to are the contents of the files.
+     -w    Whole-word matching: a match may not touch word characters on either side.
+     --word-chars=SET  Word characters for -w, e.g. 'a-zA-Z0-9_-' (default: a-zA-Z0-9_).
+     --tokens    Match whole tokens (runs of word characters) only, one hash lookup per token.
      -v    Verbose mode. Output information about processing.
+     -n    Count the replacements each input would get; change nothing.
+     -l    List the files that would change; change nothing.
+     -q    Change and print nothing; only the exit status tells.
      -?    Display help information.
      -V    Display version information.
+     --cpu=NAME  Force scan kernels: auto, generic, sse2, avx2 or avx512.
+     --cpu-info  Show the available scan kernels and which one is selected.
+     --engine=NAME  Force a matcher: auto (default), linear, fdr, hash, rolling or ac.
+     --explain   Print the chosen matcher and why to stderr.
+     --threads=N  Threads for building large matchers (default: one per CPU).
+     --progress  Print each step of building the matchers to stderr.
 
    Author: Danila Vershinin + ChatGPT. Adapted from Monty's original MySQL implementation.
    License: GNU General Public License v2
@@ -21,45 +51,894 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <time.h>
+#include <pthread.h>
 
-/* Structure to hold a single replace pair */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+/* Up to this many distinct first bytes are matched by direct vector compares */
+#define PREFILTER_MAX_BYTES 8
+
+/* Set of bytes that can start a match, in the forms the scan kernels consume */
 typedef struct {
-    char *from;
-    char *to;
+    int nbytes;                               /* Entries in 'bytes', or -1 when the set is larger */
+    unsigned char bytes[PREFILTER_MAX_BYTES];
+    unsigned char case_mask[PREFILTER_MAX_BYTES]; /* 0x20 where 'bytes' is a folded letter */
+    unsigned char member[256];                /* Exact membership for scalar code */
+    unsigned char lo[16];                     /* Bucket bits by low nibble (shuffle lookup) */
+    unsigned char hi[16];                     /* Bucket bits by high nibble (shuffle lookup) */
+    int exact;                                /* The nibble lookup alone decides membership */
+} Prefilter;
+
+/* Hot scanning kernels, built once per instruction set and selected at startup */
+typedef struct {
+    const char *name;
+    const char *(*find_byte)(const char *p, const char *end, unsigned char c);
+    const char *(*find_first)(const char *p, const char *end, const Prefilter *prefilter);
+    const char *(*find_outside)(const char *p, const char *end, const Prefilter *set);
+    void (*copy_span)(char *dst, const char *src, size_t n);
+    size_t (*count_byte)(const char *p, const char *end, unsigned char c);
+} CpuKernels;
+
+/* Structure to hold a single replace pair; strings may contain NUL bytes */
+typedef struct {
+    const char *from;     /* Points into the ReplaceList string pool once compiled */
+    const char *to;
+    size_t from_len;
+    size_t to_len;
+    uint64_t prefix;      /* Up to the first 8 bytes of 'from' packed into a word */
+    uint64_t prefix_mask; /* Mask selecting the bytes present in 'prefix' */
+    unsigned char first;  /* First byte of 'from' */
+    size_t index;         /* Position in the order the pairs were given */
+    int has_refs;         /* 'to' contains group references (regex mode) */
 } ReplacePair;
 
-/* Structure to hold all replace pairs */
+typedef struct Regex Regex;
+typedef struct Fdr Fdr;
+typedef struct PerfectHash PerfectHash;
+typedef struct Rolling Rolling;
+typedef struct AhoCorasick AhoCorasick;
+typedef struct Engine Engine;
+typedef struct Journal Journal;
+typedef struct Memo Memo;
+
+/* --report: one record per replacement, as NDJSON or fixed-width binary */
+#define REPORT_MAGIC "RPLRPT01"
+
+typedef struct {
+    uint64_t offset;      /* Byte offset of the match in the stage's input */
+    uint64_t line;        /* 1-based */
+    uint64_t column;      /* 1-based, in bytes */
+    uint32_t file;        /* Index of the input among the file arguments */
+    uint32_t pair;        /* Index of the pair in the order given */
+    uint32_t stage;       /* 1-based --then stage */
+    uint32_t length;      /* Bytes matched */
+} ReportRecord;
+
+typedef struct {
+    FILE *out;
+    int binary;
+    uint32_t file;        /* Index of the current input among the file arguments */
+    char *name;           /* Current input as a JSON string, quotes included */
+} Report;
+
+/* Where a stage is in its input, so a match offset also gives its line and column */
 typedef struct {
+    uint64_t base;        /* Input offset of the buffer being replaced */
+    size_t counted;       /* Bytes of that buffer already scanned for newlines */
+    uint64_t line;        /* Line at base + counted */
+    uint64_t line_start;  /* Input offset at which that line begins */
+} ReportCursor;
+
+/* Structure to hold all replace pairs */
+typedef struct ReplaceList {
     ReplacePair *pairs;
     size_t count;
     size_t capacity;
+    char *pool;           /* All from/to strings back to back, in match order */
+    size_t pool_size;
+    Prefilter prefilter;  /* First bytes of all non-empty 'from' strings */
+    int ignore_case;      /* 'from' strings are stored folded and matched case-insensitively */
+    int whole_word;       /* Matches must not be adjacent to word characters */
+    unsigned char word_chars[256];
+    int regex_mode;       /* 'from' strings are regular expressions */
+    int tokens;           /* 'from' strings are tokens and only match whole tokens */
+    int escapes;          /* Decode backslash escapes in argument and -f pairs */
+    Regex *regex;         /* Compiled regexes in regex mode, NULL otherwise */
+    Fdr *fdr;             /* Bucketed shift-or tables for the fdr engine, NULL otherwise */
+    PerfectHash *phash;   /* Perfect hash of fixed-length keys for the hash engine, NULL otherwise */
+    Rolling *rolling;     /* Window hashes for the rolling engine, NULL otherwise */
+    AhoCorasick *ac;      /* Automaton for the ac engine, NULL otherwise */
+    const char *sample;   /* Input sample while compiling, for engines that profile it */
+    size_t sample_len;
+    char **sources;       /* File contents unpooled pairs point into (-f, --from-file, --to-file) */
+    size_t source_count;
+    size_t max_from_len;  /* Longest 'from', the lookahead a chunk boundary must keep */
+    int stream;           /* Some 'from' contains a newline: match across lines in chunks */
+    size_t span_lines;    /* With -E -e: most newlines one match can hold, SIZE_MAX for no bound */
+    int hold;             /* More input follows: the regex find may stop where it could change its answer */
+    size_t undecided;     /* Where such a find stopped */
+    const Engine *engine; /* Matcher used by replace_in_string */
+    char engine_reason[384];  /* Why the engine was chosen, for --explain */
+    struct ReplaceList *next; /* Stage after --then that reads this one's output, NULL for the last */
+    uint64_t set_hash;    /* Identity of the pairs and options of the chain for --cache, 0 until needed */
+    Report *report;       /* --report sink, NULL without --report */
+    Journal *journal;     /* --journal sink, NULL without --journal */
+    Memo *memo;           /* --memo cache of replaced lines, created on first use */
+    ReportCursor cursor;  /* Position in the current input, for --report and --journal */
+    unsigned stage;       /* 1-based position in the --then chain */
+    int threads;          /* Threads that may build the matcher */
+    int progress;         /* Print build steps (--progress) */
 } ReplaceList;
 
+/*
+   Large pair sets are parsed, sorted and compiled by several threads, each
+   taking a part of at least BUILD_GRAIN items.
+*/
+#define BUILD_MAX_THREADS 64
+#define BUILD_GRAIN 65536
+
+/* One part of a job split across threads */
+typedef struct {
+    void (*run)(void *arg, size_t part, size_t parts);
+    void *arg;
+    size_t part;
+    size_t parts;
+} Worker;
+
+/* An array sorted in parallel: parts are sorted on their own, then merged pairwise */
+typedef struct {
+    char *src;
+    char *dst;
+    size_t count;
+    size_t size;
+    size_t parts;
+    size_t width;         /* Parts per run being merged */
+    int (*compare)(const void *, const void *);
+} SortJob;
+
+/* A pair as found in a pairs file, before it is added to the list */
+typedef struct {
+    char *from;
+    size_t from_len;
+    char *to;
+    size_t to_len;
+} PairSpan;
+
+/* The lines of a pairs file in [begin, end), parsed by one thread */
+typedef struct {
+    char *data;
+    size_t begin;
+    size_t end;
+    int escapes;
+    int regex_mode;
+    PairSpan *pairs;
+    size_t count;
+    size_t capacity;
+    size_t lines;         /* Lines in the slice, to number those of the next */
+    size_t bad_line;      /* Line in the slice without a tab, 0 if none */
+    int failed;           /* Out of memory */
+} PairsSlice;
+
+/* A match found by an engine: 'from' of the given pair spans [start, start + len) */
+typedef struct {
+    size_t start;
+    size_t len;
+    size_t pair;
+} Match;
+
+/*
+   A matcher: compile runs once after the pairs are pooled, find reports the
+   leftmost-longest match from pos. With 'hold' set the regex find returns -1
+   instead when more input could change the answer, setting 'undecided'.
+*/
+struct Engine {
+    const char *name;
+    int (*compile)(ReplaceList *replace_list);
+    int (*find)(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match);
+};
+
+/* Pattern set statistics the automatic engine choice is based on */
+typedef struct {
+    size_t count;         /* Non-empty from-strings */
+    size_t min_len;
+    size_t max_len;
+    size_t total_len;
+    int distinct_first;   /* Distinct first bytes */
+    double effective_first; /* 1 / sum(p^2) over first bytes: the collision entropy as a byte count */
+    double density;       /* Share of input bytes that may start a match, sampled or estimated */
+    int key_bytes;        /* Distinct bytes occurring in from-strings */
+    double window_density;/* Share of input positions starting a min_len run of key bytes */
+    int sampled;          /* density comes from an input sample */
+} PatternStats;
+
+/* Positions in the engines table */
+enum {
+    ENGINE_LINEAR,
+    ENGINE_FDR,
+    ENGINE_HASH,
+    ENGINE_ROLLING,
+    ENGINE_AC,
+    ENGINE_TOKENS,
+    ENGINE_REGEX
+};
+
+#define ENGINE_SAMPLE_SIZE 65536  /* Input bytes inspected for the engine choice */
+#define ENGINE_FDR_COST 0.8       /* Per-byte cost of fdr, in linear pair checks */
+#define ENGINE_HASH_COST 0.1      /* Per-byte cost of the hash engine's run scan */
+#define ENGINE_HASH_MIN_LEN 4     /* Shorter keys make windows too dense to hash */
+#define ENGINE_ROLLING_MIN_LEN 64 /* From-strings at least this long use rolling hashes */
+#define ENGINE_AC_MIN_PAIRS 3000  /* From this many pairs fdr verification costs more than an automaton */
+
+/* Chunked streaming: bytes read per refill when patterns span lines */
+#define STREAM_CHUNK (1u << 20)
+
+/* Rabin-Karp parameters */
+#define ROLLING_BASE 0x100000001b3ULL
+#define ROLLING_FILTER_WORDS 1024  /* 64K-bit prefilter indexed by the top hash bits */
+
+/* Patterns whose first 'window' bytes share a hash, as a run of member positions */
+typedef struct {
+    uint64_t hash;
+    uint32_t first;
+    uint32_t count;
+} RollingGroup;
+
+/* Temporary record used to group patterns while compiling */
+typedef struct {
+    uint64_t hash;
+    size_t pair;
+} RollingEntry;
+
+/* Rolling hash over windows as long as the shortest pattern */
+struct Rolling {
+    size_t window;
+    uint64_t drop;              /* ROLLING_BASE^(window - 1): weight of the byte leaving the window */
+    unsigned char fold[256];
+    uint64_t filter[ROLLING_FILTER_WORDS];
+    size_t *members;            /* Pair positions grouped by window hash, longest first */
+    RollingGroup *groups;
+    uint32_t *table;            /* Open-addressed group index + 1, 0 when empty */
+    size_t table_mask;
+};
+
+/* Aho-Corasick layout */
+#define AC_NONE UINT32_MAX
+#define AC_DENSE_STATES 256   /* States with full 256-way rows: 256 KiB, about an L2 */
+#define AC_SPARSE_MAX 8       /* States with more edges find them through a bitmap */
+#define AC_LANES 4            /* Segments of one buffer scanned in lockstep */
+#define AC_LANE_MIN 4096      /* Bytes scanned alone first, and the shortest segment worth a lane */
+
+/* A state below the dense ones: its edges are found by a scan or a bitmap rank */
+typedef struct {
+    uint32_t edges;       /* First edge in labels/targets, sorted by label */
+    uint16_t count;
+    uint16_t has_match;   /* The state or one of its suffixes ends a pattern */
+    uint32_t fail;
+    uint32_t bitmap;      /* Row in bitmaps when count > AC_SPARSE_MAX */
+} AcState;
+
+/*
+   Aho-Corasick automaton over the folded from-strings. States are numbered
+   hottest first: by visits while profiling the input sample, or breadth-first
+   without one, so the first AC_DENSE_STATES get complete rows that stay in
+   cache and the long tail is stored as compactly as possible.
+*/
+struct AhoCorasick {
+    uint32_t nstates;
+    uint32_t ndense;
+    uint32_t *dense;      /* ndense x 256 next states, failures already resolved */
+    AcState *states;
+    unsigned char *labels;
+    uint32_t *targets;
+    uint64_t *bitmaps;    /* Four words per bitmap row */
+    uint32_t *out;        /* Pair position of the pattern ending at the state, AC_NONE if none */
+    uint32_t *dict;       /* Nearest proper suffix state with a pattern, AC_NONE if none */
+    uint32_t *depth;
+    unsigned char fold[256];
+    int profiled;         /* Order comes from visits over the input sample */
+};
+
+/* Perfect hash limits */
+#define PHASH_MAX_PILOT (1u << 24)
+#define PHASH_MAX_SEEDS 8
+
+/* Perfect hash of the 'from' strings: bucket pilots displace keys into free slots */
+struct PerfectHash {
+    size_t key_len;       /* Length shared by all keys (hash engine); tokens vary */
+    uint64_t seed;
+    size_t nbuckets;
+    size_t table_size;    /* About 6% more slots than keys keeps the pilot search short */
+    uint32_t *pilots;     /* Per bucket */
+    uint32_t *slots;      /* Pair position + 1, 0 when empty */
+    Prefilter key_bytes;  /* Bytes keys are made of; matches lie inside runs of them */
+};
+
+/* Bucketed shift-or (FDR) limits */
+#define FDR_BUCKETS 8
+#define FDR_DOMAIN 4096
+#define FDR_HASH(prev, c) ((((unsigned)(prev) << 4) ^ (unsigned)(c)) & (FDR_DOMAIN - 1))
+#define FDR_LANE7 0xff00000000000000ULL
+
+/* Patterns sharing a bucket and a prefix, as a run of member positions */
+typedef struct {
+    uint64_t key;
+    int bucket;
+    uint32_t first;
+    uint32_t count;
+} FdrGroup;
+
+/* Temporary record used to group patterns while compiling */
+typedef struct {
+    uint64_t key;
+    int bucket;
+    size_t pair;
+} FdrEntry;
+
+/*
+   Eight buckets of patterns scanned together: bit lane * 8 + bucket of the state
+   is set while the text cannot be at that lane of a prefix of the bucket.
+*/
+struct Fdr {
+    uint64_t single[256];       /* Mismatch bits for the first lane of each bucket */
+    uint64_t pair[FDR_DOMAIN];  /* Mismatch bits for later lanes, keyed on a byte and its predecessor */
+    uint64_t init;              /* Lanes in use; the rest never mismatch */
+    int prefix_len[FDR_BUCKETS];/* Bytes of each pattern the bucket filters on (1..8) */
+    unsigned char fold[256];    /* Text byte mapping, case folding with -i */
+    size_t *members;            /* Pair positions grouped by bucket and prefix, longest first */
+    FdrGroup *groups;
+    uint32_t *table;            /* Open-addressed group index + 1, 0 when empty */
+    size_t table_mask;
+};
+
+/* Regex limits */
+#define REGEX_MAX_INSTS 100000
+#define REGEX_MAX_DEPTH 1000
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_MAX_PREFIX 64
+#define REGEX_MAX_SPAN 100000         /* Newlines a match may hold before streaming stops counting lines */
+#define REGEX_MAX_HOLD (128u << 20)   /* Undecided input a stream stage may hold for a regex without such a bound */
+#define REGEX_DFA_MEMORY (8u << 20)   /* Cached DFA states are flushed beyond this */
+#define REGEX_DFA_TABLE 65536         /* State lookup table slots; power of two */
+#define REGEX_UNSET ((size_t)-1)
+#define REGEX_AT_BOL 1
+#define REGEX_AT_EOL 2
+#define DFA_UNKNOWN (-1)
+#define DFA_DEAD (-2)
+
+/*
+   DFA states hold groups of NFA instructions, each ended by REGEX_MARK and
+   ordered by where their threads started. A trailing REGEX_SEED starts a new
+   group after every byte, so one forward pass searches without an anchor.
+   Once a group accepts, the groups after it and the seed are dropped: the
+   accepting group only moves left, and the last position a state accepts at
+   ends the leftmost-longest match. The group started at the current position
+   ends with REGEX_FRESH instead, since matches are never empty.
+*/
+#define REGEX_MARK (-1)
+#define REGEX_SEED (-2)
+#define REGEX_FRESH (-3)
+#define REGEX_CONTEXT_MID 0       /* Forward start after an ordinary byte */
+#define REGEX_CONTEXT_BOL 1       /* Forward start at the start of a line */
+#define REGEX_CONTEXT_WORD 2      /* Forward start after a word character with -w: nothing starts here */
+#define REGEX_REVERSE_START 3     /* Reverse start away from the end of a line; the one at it follows */
+
+/* Regex program operations (Thompson NFA) */
+enum {
+    RX_CHAR,      /* Consume one byte in class 'arg' */
+    RX_MATCH,     /* Accept for pair 'arg' */
+    RX_SPLIT,     /* Continue at 'x' (preferred) and at 'y' */
+    RX_JMP,       /* Continue at 'x' */
+    RX_SAVE,      /* Record the position in capture slot 'arg' */
+    RX_BOL,       /* Assert start of line */
+    RX_EOL        /* Assert end of line */
+};
+
+typedef struct {
+    int op;
+    int arg;
+    int x;        /* Next instruction */
+    int y;        /* Alternative for RX_SPLIT */
+} RegexInst;
+
+/* Regex syntax tree node types */
+enum {
+    RN_EMPTY,
+    RN_CHAR,
+    RN_CAT,
+    RN_ALT,
+    RN_REPEAT,
+    RN_GROUP,
+    RN_BOL,
+    RN_EOL
+};
+
+typedef struct {
+    int type;
+    int arg;      /* Class index for RN_CHAR, group number for RN_GROUP */
+    int min;      /* RN_REPEAT bounds; max is -1 when unbounded */
+    int max;
+    int left;
+    int right;
+} RegexNode;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    RegexNode *nodes;
+    int nnodes;
+    int nodes_cap;
+    Regex *rx;
+    int ngroups;
+    int depth;
+    int ignore_case;
+    const char *error;
+} RegexParser;
+
+/* Lazily built DFA state: groups of NFA instructions and what they accept */
+typedef struct {
+    size_t set;           /* Offset of the instruction set in the set pool */
+    int set_len;
+    int match_pair;       /* Pair accepted when more text follows, -1 for none */
+    int eol_match_pair;   /* Pair accepted at the end of a line, -1 for none */
+} DfaState;
+
+/* Pike VM thread list used to recover capture groups */
+typedef struct {
+    int *pc;
+    size_t *caps;
+    int count;
+} PikeList;
+
+typedef struct {
+    int pc;
+    int slot;             /* >= 0: restore caps[slot] to 'value' instead of visiting 'pc' */
+    size_t value;
+} PikeStackEntry;
+
+/* All pairs' regexes compiled into one program, with a lazily built DFA over it */
+struct Regex {
+    RegexInst *prog;
+    int prog_len;
+    int prog_cap;
+    unsigned char (*classes)[32];
+    int nclasses;
+    int classes_cap;
+    int *entries;         /* Program entry per pair */
+    int *reverse_entries; /* Entry per pair of its reversed program, used to find where a match starts */
+    size_t npairs;
+    const ReplacePair *pairs;
+    int ngroups;
+    size_t nslots;
+    unsigned char byte_class[256];
+    unsigned char class_byte[256];  /* A representative byte of each class */
+    int whole_word;
+    const unsigned char *word_chars;
+    int nbyte_classes;
+    char prefix[REGEX_MAX_PREFIX];  /* Literal every match starts with */
+    size_t prefix_len;
+
+    /* DFA cache, bounded by REGEX_DFA_MEMORY */
+    DfaState *states;
+    int nstates;
+    int states_cap;
+    int *trans;           /* nstates x nbyte_classes, DFA_UNKNOWN until followed */
+    size_t trans_cap;
+    int *set_pool;
+    size_t set_pool_len;
+    size_t set_pool_cap;
+    int *table;
+    int table_size;
+    int start[5];         /* Start state per REGEX_CONTEXT_*, then the reverse ones */
+    size_t memory;
+    unsigned flushes;
+
+    /* Scratch */
+    unsigned *mark;
+    unsigned generation;
+    int *stack;
+    int *work;
+    int *eol_work;
+    unsigned char *claimed;  /* Instructions held by an earlier group of the state being built */
+    PikeStackEntry *pike_stack;
+    PikeList pike_lists[2];
+    size_t *caps;
+};
+
+/* Block reader handing out lines straight from its buffer */
+typedef struct {
+    int fd;
+    char *data;
+    size_t start;
+    size_t end;
+    size_t capacity;
+    int eof;
+} LineReader;
+
+/* Growable output buffer reused across lines to avoid per-line allocations */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} OutputBuffer;
+
+/* --diff: whole old lines [old_start, old_end) become text_len bytes at text_start of the new text */
+#define DIFF_CONTEXT 3
+
+typedef struct {
+    size_t old_start;
+    size_t old_end;
+    size_t text_start;
+    size_t text_len;
+} DiffEdit;
+
+typedef struct {
+    DiffEdit *edits;
+    size_t count;
+    size_t capacity;
+    OutputBuffer text;    /* New lines of every edit, back to back */
+} DiffEdits;
+
+/* Buffers of one stage in a chunked pass: bytes not yet replaced and the stage's output */
+typedef struct {
+    OutputBuffer in;
+    OutputBuffer out;
+    int prev_byte;        /* Byte before in.data, -1 at the start of the stream */
+    size_t held;          /* Bytes an unbounded regex stage kept undecided last time */
+} StageBuffer;
+
+/* A check of a chunked pass: its output compared with its input as both arrive */
+typedef struct {
+    OutputBuffer ahead;   /* Bytes of the side that is ahead, not compared yet */
+    int output_ahead;     /* Which side 'ahead' holds */
+    int differs;          /* Some byte differs, or one side is longer */
+    int stop;             /* -l and -q: read no further once something differs */
+} ChangeCheck;
+
+/* --cache: what each file looked like when a pair set last left it unchanged */
+#define CACHE_FILE "replace.cache"
+#define CACHE_MAGIC "RPLCACH1"
+#define CACHE_RACY_NS 2000000000ULL  /* Files modified this close to the run may change within one mtime tick */
+#define CACHE_FORGET UINT64_MAX      /* 'replaced' of an update that drops the file's record */
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+} CacheHeader;
+
+/* One file, keyed by (dev, ino); 'replaced' is the count the set made in exactly this state */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t ctime_ns;
+    uint64_t set_hash;
+    uint64_t replaced;
+} CacheEntry;
+
+typedef struct {
+    const char *dir;
+    void *map;            /* Cache file as of startup, mapped read-only and sorted by key */
+    size_t map_size;
+    const CacheEntry *entries;
+    size_t count;
+    CacheEntry *updates;  /* Records made by this run, merged into the file at exit */
+    size_t update_count;
+    size_t update_capacity;
+    uint64_t started_ns;
+} Cache;
+
+/*
+   --journal: for every rewritten file, the original bytes of each
+   replacement, so --undo can restore it by copying the unchanged spans.
+   After JOURNAL_MAGIC each file is a JournalFile, its name, then 'edits'
+   JournalEdit records, each followed by its old_len original bytes.
+*/
+#define JOURNAL_MAGIC "RPLJRNL1"
+
+typedef struct {
+    uint64_t size;        /* The rewritten file as left by the run, checked before undoing */
+    uint64_t mtime_ns;
+    uint64_t orig_mtime_ns;  /* Modification time restored by --undo */
+    uint64_t edits;
+    uint32_t name_len;
+    uint32_t stages;      /* Length of the --then chain */
+} JournalFile;
+
+typedef struct {
+    uint64_t offset;      /* Byte offset of the match in the stage's input */
+    uint64_t old_len;
+    uint64_t new_len;     /* Bytes the replacement put in the stage's output */
+    uint32_t stage;
+    uint32_t pad;
+} JournalEdit;
+
+struct Journal {
+    FILE *out;
+    OutputBuffer edits;   /* Records of the file being rewritten, written once it is in place */
+    uint64_t count;
+};
+
+/*
+   --memo: a bounded LRU of lines already replaced, keyed by a hash of the
+   line, so a line seen again costs a lookup and a copy instead of a scan.
+   Line mode only; a line's replacement never depends on its neighbours there.
+*/
+#define MEMO_DEFAULT_ENTRIES 4096
+#define MEMO_MAX_ENTRIES (1u << 24)
+#define MEMO_MAX_LINE 4096    /* Longer lines are always scanned */
+#define MEMO_NONE UINT32_MAX
+
+typedef struct {
+    uint64_t hash;
+    char *data;           /* The line, then its replacement */
+    size_t key_len;
+    size_t out_len;
+    size_t replaced;
+    uint32_t bucket_next; /* Next entry in the same bucket */
+    uint32_t lru_prev;    /* Neighbours in recency order, most recent first */
+    uint32_t lru_next;
+} MemoEntry;
+
+struct Memo {
+    MemoEntry *entries;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t *buckets;    /* First entry of each hash bucket */
+    uint32_t mask;
+    uint32_t head;        /* Most recently used */
+    uint32_t tail;        /* Least recently used, evicted first */
+    uint64_t hash;        /* Hash of the line last looked up, for the store after a miss */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t bypassed;    /* Lines too long to memoize */
+};
+
+/*
+   Rewrites of large files start from a clone (FICLONE) of the original that
+   shares its extents; only the blocks whose bytes change are written.
+*/
+#define CLONE_MIN_SIZE (1u << 20)
+#define CLONE_BLOCK 4096
+
+typedef struct {
+    int fd;               /* The temporary file, a clone of the original */
+    const char *orig;     /* The original, mapped, to tell which blocks change */
+    size_t orig_len;
+    uint64_t pos;         /* Output bytes so far */
+} CloneWriter;
+
 /* Structure to hold program options */
 typedef struct {
     int silent;
     int verbose;
+    int ignore_case;
+    int whole_word;
+    int regex_mode;
+    int tokens;
+    int escapes;
+    const char *word_chars; /* Word character set for -w, NULL for ASCII identifiers */
+    const char *cpu;      /* Kernel variant requested with --cpu, NULL for auto */
+    int cpu_info;
+    const char *engine;   /* Matcher requested with --engine, NULL for auto */
+    const char *pairs_file; /* -f FILE with tab-separated pairs */
+    const char **from_files;  /* --from-file arguments, in order */
+    const char **to_files;    /* --to-file arguments, in order */
+    int from_count;
+    int to_count;
+    int explain;
+    int threads;          /* --threads, 0 for one per CPU */
+    int progress;         /* --progress */
+    const char *rules_file; /* --rules FILE mapping globs to pairs files */
+    int check;            /* CHECK_COUNT, CHECK_LIST or CHECK_QUIET: report instead of writing */
+    int matched;          /* Some input would change, for the exit status of a check */
+    int diff;             /* --diff: print unified hunks instead of writing */
+    const char *report_file;  /* --report FILE */
+    int report_binary;    /* --report-format=binary rather than NDJSON */
+    Report *report;       /* Open report while files are processed, NULL without --report */
+    const char *journal_file; /* --journal FILE */
+    Journal *journal;     /* Open journal while files are processed, NULL without --journal */
+    const char *undo_file;  /* --undo JOURNAL */
+    const char *backup_suffix;  /* --backup: keep the original as name + suffix, NULL for none */
+    size_t memo_entries;  /* --memo: lines remembered per pair set, 0 for none */
+    int stats;            /* --stats: print counters to stderr at exit */
+    size_t inputs;        /* Inputs processed, for --stats */
+    size_t changed;       /* Inputs with replacements */
+    size_t replaced;      /* Replacements over all inputs */
+    const char *cache_dir;  /* --cache DIR */
+    Cache *cache;         /* Open cache while files are processed, NULL without --cache */
 } ProgramOptions;
 
+/* Check-only modes: -n counts, -l lists, -q only sets the exit status */
+enum {
+    CHECK_NONE,
+    CHECK_COUNT,
+    CHECK_LIST,
+    CHECK_QUIET
+};
+
+/* One line of a --rules file: files matching glob are rewritten with sets[set] */
+typedef struct {
+    char *glob;
+    size_t set;
+} Rule;
+
+/* Rules from --rules and the pair sets they name, each parsed and compiled once */
+typedef struct {
+    Rule *rules;
+    size_t count;
+    ReplaceList *sets;
+    char **set_files;
+    size_t set_count;
+} RuleTable;
+
+/* Long-only option identifiers */
+enum {
+    OPT_CPU = 256,
+    OPT_CPU_INFO,
+    OPT_WORD_CHARS,
+    OPT_ENGINE,
+    OPT_EXPLAIN,
+    OPT_TOKENS,
+    OPT_FROM_FILE,
+    OPT_TO_FILE,
+    OPT_RULES,
+    OPT_CACHE,
+    OPT_DIFF,
+    OPT_REPORT,
+    OPT_REPORT_FORMAT,
+    OPT_JOURNAL,
+    OPT_UNDO,
+    OPT_BACKUP,
+    OPT_MEMO,
+    OPT_STATS,
+    OPT_THREADS,
+    OPT_PROGRESS
+};
+
+/* Selected scan kernels */
+static const CpuKernels *kernels;
+
 /* Function Prototypes */
 static void print_help(const char *progname);
 static void print_version(const char *progname);
 static int parse_options(int argc, char **argv, ProgramOptions *options, int *replace_start);
 static int parse_replace_strings(int argc, char **argv, ReplaceList *replace_list);
+static int parse_pairs_file(const char *filename, ReplaceList *replace_list);
+static void parse_pairs_slice(void *arg, size_t part, size_t parts);
+static size_t build_parts(const ReplaceList *replace_list, size_t items);
+static void run_parts(void (*run)(void *arg, size_t part, size_t parts), void *arg, size_t parts);
+static void sort_parallel(void *base, size_t count, size_t size, int (*compare)(const void *, const void *), size_t parts);
+static void progress(const ReplaceList *replace_list, const char *format, ...);
+static char *read_source_file(const char *filename, const char *what, ReplaceList *replace_list, size_t *len);
+static int parse_block_files(const ProgramOptions *options, ReplaceList *replace_list);
+static int load_rules(const char *filename, RuleTable *table);
+static const Rule *match_rule(const RuleTable *table, const char *filename);
+static int run_rules(ProgramOptions *options, char **files, int num_files);
+static void free_rules(RuleTable *table);
+static int add_replace_pair(ReplaceList *replace_list, const char *from, size_t from_len, const char *to, size_t to_len);
+static size_t decode_escapes(char *str, size_t len, int keep_refs);
+static int hex_value(char c);
+static int compile_replace_list(ReplaceList *replace_list, const char *engine, const char *sample, size_t sample_len);
 static void free_replace_list(ReplaceList *replace_list);
-static char* replace_in_string(const char *str, ReplaceList *replace_list, int *updated);
-static int process_stream(FILE *in, FILE *out, ReplaceList *replace_list, ProgramOptions *options);
+static void build_prefilter(Prefilter *prefilter, const unsigned char member[256]);
+static inline unsigned char fold_byte(unsigned char c);
+static inline uint64_t fold_word(uint64_t word);
+static int bytes_equal(const char *text, const char *pattern, size_t n, int ignore_case);
+static int select_cpu_kernels(const char *name);
+static void print_cpu_info(void);
+static void output_reserve(OutputBuffer *out, size_t extra);
+static int read_line(LineReader *reader, const char **line, size_t *len);
+static int set_word_chars(ReplaceList *replace_list, const char *spec);
+static int init_stage(ReplaceList *replace_list, const ProgramOptions *options);
+static int find_literal(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match);
+static int compile_regexes(ReplaceList *replace_list);
+static void free_regex(Regex *rx);
+static int find_regex(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match);
+static int compile_fdr(ReplaceList *replace_list);
+static int find_fdr(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match);
+static void free_fdr(Fdr *fdr);
+static int compile_phash(ReplaceList *replace_list);
+static int find_phash(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match);
+static void free_phash(PerfectHash *ph);
+static int compile_tokens(ReplaceList *replace_list);
+static int find_tokens(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match);
+static int compile_rolling(ReplaceList *replace_list);
+static int find_rolling(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match);
+static void free_rolling(Rolling *rk);
+static int compile_ac(ReplaceList *replace_list);
+static int find_ac(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match);
+static int find_ac_serial(ReplaceList *replace_list, const char *str, size_t len, size_t pos, size_t stop, int prev_byte, Match *match, size_t *resume);
+static size_t ac_first_hit(const AhoCorasick *ac, const unsigned char *text, size_t from, size_t to, uint32_t state, size_t warmup);
+static void free_ac(AhoCorasick *ac);
+static void build_literal_prefilter(ReplaceList *replace_list);
+static int select_engine(ReplaceList *replace_list, const char *name, const char *sample, size_t sample_len);
+static size_t read_input_sample(char **files, int num_files, char *sample, size_t size);
+static const size_t *regex_captures(Regex *rx, const Match *match, const char *str, size_t len, int prev_byte);
+static void append_replacement(ReplaceList *replace_list, const Match *match, const char *str, size_t len, int prev_byte, OutputBuffer *out);
+static size_t replace_in_string(const char *str, size_t len, size_t horizon, int prev_byte, ReplaceList *replace_list, OutputBuffer *out, size_t *replaced);
+static size_t count_in_string(const char *str, size_t len, size_t horizon, int prev_byte, ReplaceList *replace_list, size_t *count, OutputBuffer *text);
+static int process_stream(FILE *in, FILE *out, ReplaceList *replace_list, ProgramOptions *options, size_t *replaced);
+static int process_chunks(int fd, FILE *out, ReplaceList *replace_list, size_t *replaced, ChangeCheck *check);
+static void change_feed(ChangeCheck *check, const char *data, size_t len, int output);
+static int stage_push(ReplaceList *stage, StageBuffer *buf, const char *data, size_t len, int eof, FILE *out, size_t *replaced);
+static size_t regex_horizon(const ReplaceList *stage, const OutputBuffer *in);
+static int check_input(int fd, const char *filename, ReplaceList *replace_list, ProgramOptions *options, size_t *count, int *changed);
+static int report_open(Report *report, const char *filename, int binary);
+static int report_close(Report *report);
+static void track_begin(ReplaceList *replace_list, const char *filename);
+static void report_match(ReplaceList *replace_list, const char *str, const Match *match);
+static void track_advance(ReplaceList *replace_list, const char *str, size_t consumed);
+static int journal_open(Journal *journal, const char *filename);
+static int journal_close(Journal *journal);
+static void journal_match(ReplaceList *replace_list, const char *str, const Match *match, size_t new_len);
+static int journal_commit(Journal *journal, const char *filename, const struct stat *orig, uint32_t stages);
+static int undo_journal(const char *path, const ProgramOptions *options);
+static int undo_file(const char *entry, const ProgramOptions *options);
+static int undo_stage(int src, int dst, const char *edits, uint64_t count, uint32_t stage);
+static int copy_range(int src, off_t *offset, int dst, uint64_t len);
+static void report_check(const char *filename, size_t count, int changed, ProgramOptions *options);
+static int diff_input(int fd, const char *label, ReplaceList *replace_list, size_t *replaced);
+static void diff_collect_matches(ReplaceList *replace_list, const char *data, size_t len, DiffEdits *edits, size_t *replaced);
+static void diff_collect_lines(ReplaceList *replace_list, const char *data, size_t len, DiffEdits *edits, size_t *replaced);
+static int diff_collect_chain(ReplaceList *replace_list, const char *data, size_t len, DiffEdits *edits, size_t *replaced);
+static void diff_print(const char *label, const char *data, size_t len, const DiffEdits *edits);
 static int process_file(const char *filename, ReplaceList *replace_list, ProgramOptions *options);
+static int make_temp(const char *filename, char **path);
+static void count_input(ProgramOptions *options, size_t replaced);
+static void print_stats(const ProgramOptions *options, const ReplaceList *lists, size_t count);
+static Memo *memo_create(size_t capacity);
+static void free_memo(Memo *memo);
+static uint64_t memo_hash(const char *p, size_t len);
+static const MemoEntry *memo_lookup(Memo *memo, const char *line, size_t len);
+static void memo_store(Memo *memo, const char *line, size_t len, const char *out, size_t out_len, size_t replaced);
+static int backup_file(const char *filename, const struct stat *st, const char *suffix);
+static int keeps_length(const ReplaceList *replace_list);
+static int clone_open(int orig_fd, int temp_fd, size_t size, FILE **out);
+static ssize_t clone_write(void *cookie, const char *buf, size_t size);
+static int clone_close(void *cookie);
+static int write_at(int fd, const char *buf, size_t len, uint64_t offset);
+static uint64_t hash_replace_list(const ReplaceList *replace_list);
+static int cache_open(Cache *cache, const char *dir);
+static int cache_map(const char *path, void **map, size_t *map_size, const CacheEntry **entries, size_t *count);
+static const CacheEntry *cache_lookup(const Cache *cache, const struct stat *st, uint64_t set_hash);
+static void cache_record(Cache *cache, const struct stat *st, uint64_t set_hash, uint64_t replaced);
+static int cache_close(Cache *cache);
+
+/* Available matchers; regex and tokens are implied by -E and --tokens, auto picks among the rest */
+static const Engine engines[] = {
+    [ENGINE_LINEAR] = {"linear", NULL, find_literal},
+    [ENGINE_FDR] = {"fdr", compile_fdr, find_fdr},
+    [ENGINE_HASH] = {"hash", compile_phash, find_phash},
+    [ENGINE_ROLLING] = {"rolling", compile_rolling, find_rolling},
+    [ENGINE_AC] = {"ac", compile_ac, find_ac},
+    [ENGINE_TOKENS] = {"tokens", compile_tokens, find_tokens},
+    [ENGINE_REGEX] = {"regex", compile_regexes, find_regex},
+};
 
 /* Main Function */
 int main(int argc, char *argv[]) {
-    ProgramOptions options = {0, 0};
-    ReplaceList replace_list = {NULL, 0, 0};
+    ProgramOptions options = {0};
+    ReplaceList replace_list = {0};
     int error = 0;
     int replace_start = 0;
 
@@ -68,6 +947,27 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    /* Pick the scan kernels before anything is matched */
+    if (select_cpu_kernels(options.cpu)) {
+        return 1;
+    }
+    if (options.cpu_info) {
+        print_cpu_info();
+        return 0;
+    }
+
+    /* --undo restores the files of a journal and takes no pairs or files */
+    if (options.undo_file) {
+        if (replace_start < argc) {
+            fprintf(stderr, "Error: --undo takes no replace pairs or files.\n");
+            return 1;
+        }
+        error = undo_journal(options.undo_file, &options);
+        free(options.from_files);
+        free(options.to_files);
+        return error ? 2 : 0;
+    }
+
     /* Find '--' in remaining arguments to separate replace pairs from files */
     int delimiter = -1;
     for (int i = replace_start; i < argc; i++) {
@@ -77,28 +977,73 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    /* Determine the number of replace pairs */
-    int replace_args = (delimiter != -1) ? (delimiter - replace_start) : (argc - replace_start);
+    /* With --rules the pairs come from the sets it names and every argument is a file */
+    if (options.rules_file) {
+        int pairs_given = options.pairs_file || options.from_count > 0 || options.to_count > 0;
+        if (pairs_given || (delimiter != -1 && delimiter > replace_start)) {
+            fprintf(stderr, "Error: --rules cannot be combined with other replace pairs.\n");
+            return 1;
+        }
+        int file_start = (delimiter != -1) ? (delimiter + 1) : replace_start;
+        error = run_rules(&options, argv + file_start, argc - file_start);
+        free(options.from_files);
+        free(options.to_files);
+        return error;
+    }
 
-    /* Ensure even number of replace_args */
-    if (replace_args < 2 || (replace_args % 2) != 0) {
-        fprintf(stderr, "Error: Replace strings must be in from/to pairs.\n");
-        print_help("replace");
-        return 1;
+    /* Determine the number of replace pairs; with pairs from files and no '--' every argument is a file */
+    int pairs_from_files = options.pairs_file || options.from_count > 0 || options.to_count > 0;
+    int replace_args = (delimiter != -1) ? (delimiter - replace_start) : (argc - replace_start);
+    if (pairs_from_files && delimiter == -1) {
+        replace_args = 0;
     }
 
-    /* Parse from/to replacement strings */
-    if (parse_replace_strings(replace_args, argv + replace_start, &replace_list)) {
+    /* Parse from/to strings stage by stage; '--then' starts a stage that rewrites the previous one's output */
+    ReplaceList *stage = &replace_list;
+    int stage_count = 0;
+    int arg = replace_start;
+    int replace_end = replace_start + replace_args;
+    for (;;) {
+        int stage_end = arg;
+        while (stage_end < replace_end && strcmp(argv[stage_end], "--then") != 0) {
+            stage_end++;
+        }
+        int stage_args = stage_end - arg;
+
+        /* Ensure even number of from/to strings; only the first stage may take all its pairs from files */
+        if ((stage_args < 2 && !(pairs_from_files && stage_count == 0)) || (stage_args % 2) != 0) {
+            fprintf(stderr, "Error: Replace strings must be in from/to pairs.\n");
+            print_help("replace");
+            free_replace_list(&replace_list);
+            return 1;
+        }
+        if (stage_count > 0) {
+            stage->next = calloc(1, sizeof(ReplaceList));
+            if (!stage->next) {
+                fprintf(stderr, "Memory allocation failed for replace stage.\n");
+                free_replace_list(&replace_list);
+                return 1;
+            }
+            stage = stage->next;
+        }
+        if (init_stage(stage, &options) || parse_replace_strings(stage_args, argv + arg, stage)) {
+            free_replace_list(&replace_list);
+            return 1;
+        }
+        stage_count++;
+        stage->stage = (unsigned)stage_count;
+        if (stage_end == replace_end) {
+            break;
+        }
+        arg = stage_end + 1;
+    }
+    if (options.pairs_file && parse_pairs_file(options.pairs_file, &replace_list)) {
         free_replace_list(&replace_list);
         return 1;
     }
-
-    /* Verbose: print replace pairs */
-    if (options.verbose) {
-        printf("Replacement pairs:\n");
-        for (size_t i = 0; i < replace_list.count; i++) {
-            printf("  '%s' -> '%s'\n", replace_list.pairs[i].from, replace_list.pairs[i].to);
-        }
+    if (parse_block_files(&options, &replace_list)) {
+        free_replace_list(&replace_list);
+        return 1;
     }
 
     /* Determine files after '--' */
@@ -106,20 +1051,109 @@ int main(int argc, char *argv[]) {
     int num_files = argc - file_start;
     char **files = (num_files > 0) ? (argv + file_start) : NULL;
 
+    /* Compile for the engine best suited to the pairs and a peek at the input */
+    char *sample = malloc(ENGINE_SAMPLE_SIZE);
+    size_t sample_len = sample ? read_input_sample(files, num_files, sample, ENGINE_SAMPLE_SIZE) : 0;
+    int compile_error = 0;
+    for (stage = &replace_list; stage && !compile_error; stage = stage->next) {
+        compile_error = compile_replace_list(stage, options.engine, sample, sample_len);
+    }
+    free(sample);
+    if (compile_error) {
+        free_replace_list(&replace_list);
+        return 1;
+    }
+    int stage_number = 1;
+    for (stage = &replace_list; stage; stage = stage->next, stage_number++) {
+        if (options.explain) {
+            if (stage_count > 1) fprintf(stderr, "stage %d ", stage_number);
+            fprintf(stderr, "engine: %s (%s)\n", stage->engine->name, stage->engine_reason);
+        }
+
+        /* Verbose: print replace pairs */
+        if (options.verbose) {
+            if (stage_count > 1) {
+                printf("Replacement pairs, stage %d:\n", stage_number);
+            } else {
+                printf("Replacement pairs:\n");
+            }
+            for (size_t i = 0; i < stage->count; i++) {
+                const ReplacePair *pair = &stage->pairs[i];
+                printf("  '%.*s' -> '%.*s'\n", (int)pair->from_len, pair->from, (int)pair->to_len, pair->to);
+            }
+        }
+    }
+
     /* Process input sources */
+    Report report = {0};
+    if (options.report_file) {
+        if (report_open(&report, options.report_file, options.report_binary)) {
+            free_replace_list(&replace_list);
+            return 1;
+        }
+        options.report = &report;
+        for (stage = &replace_list; stage; stage = stage->next) {
+            stage->report = &report;
+        }
+    }
+    Journal journal = {0};
+    if (options.journal_file) {
+        if (num_files == 0) {
+            fprintf(stderr, "Error: --journal records file rewrites; give the files to rewrite.\n");
+            free_replace_list(&replace_list);
+            return 1;
+        }
+        if (journal_open(&journal, options.journal_file)) {
+            free_replace_list(&replace_list);
+            return 1;
+        }
+        options.journal = &journal;
+        for (stage = &replace_list; stage; stage = stage->next) {
+            stage->journal = &journal;
+        }
+    }
+    Cache cache = {0};
+    if (options.cache_dir && num_files > 0) {
+        if (cache_open(&cache, options.cache_dir)) {
+            free_replace_list(&replace_list);
+            return 1;
+        }
+        options.cache = &cache;
+    }
     if (num_files == 0) {
         /* No files provided; read from stdin and write to stdout */
-        error = process_stream(stdin, stdout, &replace_list, &options);
+        size_t replaced = 0;
+        track_begin(&replace_list, "-");
+        error = process_stream(stdin, stdout, &replace_list, &options, &replaced);
+        count_input(&options, replaced);
     } else {
-        /* Process each file provided */
-        for (int i = 0; i < num_files; i++) {
+        /* Process each file provided; -q is answered by the first file that would change */
+        for (int i = 0; i < num_files && !(options.check == CHECK_QUIET && options.matched); i++) {
+            report.file = (uint32_t)i;
             error |= process_file(files[i], &replace_list, &options);
         }
     }
+    if (options.cache) {
+        error |= cache_close(&cache);
+    }
+    if (options.report) {
+        error |= report_close(&report);
+    }
+    if (options.journal) {
+        error |= journal_close(&journal);
+    }
+    if (options.stats) {
+        print_stats(&options, &replace_list, 1);
+    }
 
     /* Cleanup */
     free_replace_list(&replace_list);
-    return error ? 2 : 0;
+    free(options.from_files);
+    free(options.to_files);
+    if (error) {
+        return 2;
+    }
+    return (options.check && !options.matched) ? 1 : 0;
 }
 
 /* Function Implementations */
@@ -127,12 +1161,42 @@ int main(int argc, char *argv[]) {
 /* Print help information */
 static void print_help(const char *progname) {
     printf("%s - Replace strings in files or from stdin to stdout.\n", progname);
-    printf("Usage: %s [-s] [-v] from to [from to ...] [--] [files...]\n", progname);
+    printf("Usage: %s [-s] [-i] [-w] [-E] [-e] [-v] from to [from to ...] [--] [files...]\n", progname);
+    printf("       %s [-s] [-i] [-w] [-e] [-v] -f PAIRS [from to ...] [--] [files...]\n", progname);
     printf("Options:\n");
     printf("  -s    Silent mode. Suppress non-error messages.\n");
+    printf("  -i    Case-insensitive matching (ASCII letters).\n");
+    printf("  -E    Treat from-strings as extended regular expressions; \\1..\\9 in a to-string insert groups.\n");
+    printf("  -e    Decode escapes in from/to strings: \\t \\n \\r \\0 \\\\ \\xNN. A from-string with a\n");
+    printf("        newline, or with -E a regex that can match one, matches across lines.\n");
+    printf("  -f FILE  Read pairs from FILE, one 'from<TAB>to' per line.\n");
+    printf("  --then   Start another stage: its pairs are applied to the output of the previous ones.\n");
+    printf("  --rules=FILE  Rewrite each file with the pairs file of the first matching 'GLOB PAIRS-FILE' line.\n");
+    printf("  --cache=DIR   Skip files unchanged since a run with the same pairs found nothing in them.\n");
+    printf("  --diff   Print the changes as a unified diff instead of making them.\n");
+    printf("  --report=FILE  Write a record per replacement: file, offset, line, column, length, pair, stage.\n");
+    printf("  --report-format=FORMAT  Format of --report records: ndjson (default) or binary.\n");
+    printf("  --journal=FILE  Record the original bytes of every replacement in rewritten files.\n");
+    printf("  --undo=FILE     Restore the files rewritten by the run that wrote journal FILE.\n");
+    printf("  --backup[=SUFFIX]  Keep the original of each rewritten file as FILE~ (or FILE + SUFFIX).\n");
+    printf("  --memo[=N]  Remember the replacements of the last N distinct lines (default 4096).\n");
+    printf("  --stats     Print input, replacement and --memo hit counts to stderr.\n");
+    printf("  --from-file=FILE --to-file=FILE  Add a pair whose from/to are the contents of the files.\n");
+    printf("  -w    Whole-word matching: a match may not touch word characters on either side.\n");
     printf("  -v    Verbose mode. Output information about processing.\n");
+    printf("  -n    Count the replacements each input would get; change nothing.\n");
+    printf("  -l    List the files that would change; change nothing.\n");
+    printf("  -q    Change and print nothing; only the exit status tells.\n");
     printf("  -?    Display this help information.\n");
     printf("  -V    Display version information.\n");
+    printf("  --word-chars=SET  Word characters for -w, e.g. 'a-zA-Z0-9_-' (default: a-zA-Z0-9_).\n");
+    printf("  --tokens    Match whole tokens (runs of word characters) only, one hash lookup per token.\n");
+    printf("  --cpu=NAME  Force scan kernels: auto, generic, sse2, avx2 or avx512.\n");
+    printf("  --cpu-info  Show the available scan kernels and which one is selected.\n");
+    printf("  --engine=NAME  Force a matcher: auto (default), linear, fdr, hash, rolling or ac.\n");
+    printf("  --explain   Print the chosen matcher and why to stderr.\n");
+    printf("  --threads=N  Threads for building large matchers (default: one per CPU).\n");
+    printf("  --progress  Print each step of building the matchers to stderr.\n");
 }
 
 /* Print version information */
@@ -142,12 +1206,66 @@ static void print_version(const char *progname) {
 
 /* Parse command-line options using getopt */
 static int parse_options(int argc, char **argv, ProgramOptions *options, int *replace_start) {
+    static const struct option long_options[] = {
+        {"cpu", required_argument, NULL, OPT_CPU},
+        {"cpu-info", no_argument, NULL, OPT_CPU_INFO},
+        {"word-chars", required_argument, NULL, OPT_WORD_CHARS},
+        {"engine", required_argument, NULL, OPT_ENGINE},
+        {"explain", no_argument, NULL, OPT_EXPLAIN},
+        {"tokens", no_argument, NULL, OPT_TOKENS},
+        {"from-file", required_argument, NULL, OPT_FROM_FILE},
+        {"to-file", required_argument, NULL, OPT_TO_FILE},
+        {"rules", required_argument, NULL, OPT_RULES},
+        {"cache", required_argument, NULL, OPT_CACHE},
+        {"diff", no_argument, NULL, OPT_DIFF},
+        {"report", required_argument, NULL, OPT_REPORT},
+        {"report-format", required_argument, NULL, OPT_REPORT_FORMAT},
+        {"journal", required_argument, NULL, OPT_JOURNAL},
+        {"undo", required_argument, NULL, OPT_UNDO},
+        {"backup", optional_argument, NULL, OPT_BACKUP},
+        {"memo", optional_argument, NULL, OPT_MEMO},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"threads", required_argument, NULL, OPT_THREADS},
+        {"progress", no_argument, NULL, OPT_PROGRESS},
+        {NULL, 0, NULL, 0}
+    };
     int opt;
-    while ((opt = getopt(argc, argv, "sv?V")) != -1) {
+    options->from_files = calloc((size_t)argc, sizeof(const char *));
+    options->to_files = calloc((size_t)argc, sizeof(const char *));
+    if (!options->from_files || !options->to_files) {
+        fprintf(stderr, "Memory allocation failed for options.\n");
+        return 1;
+    }
+    /* '+' stops at the first from-string so a later '--' stays visible to main */
+    while ((opt = getopt_long(argc, argv, "+siwEef:nlqv?V", long_options, NULL)) != -1) {
         switch (opt) {
             case 's':
                 options->silent = 1;
                 break;
+            case 'i':
+                options->ignore_case = 1;
+                break;
+            case 'w':
+                options->whole_word = 1;
+                break;
+            case 'E':
+                options->regex_mode = 1;
+                break;
+            case 'e':
+                options->escapes = 1;
+                break;
+            case 'f':
+                options->pairs_file = optarg;
+                break;
+            case 'n':
+                options->check = CHECK_COUNT;
+                break;
+            case 'l':
+                options->check = CHECK_LIST;
+                break;
+            case 'q':
+                options->check = CHECK_QUIET;
+                break;
             case 'v':
                 options->verbose = 1;
                 break;
@@ -157,235 +1275,6316 @@ static int parse_options(int argc, char **argv, ProgramOptions *options, int *re
             case 'V':
                 print_version(argv[0]);
                 exit(0);
+            case OPT_CPU:
+                options->cpu = optarg;
+                break;
+            case OPT_CPU_INFO:
+                options->cpu_info = 1;
+                break;
+            case OPT_WORD_CHARS:
+                options->word_chars = optarg;
+                break;
+            case OPT_ENGINE:
+                options->engine = optarg;
+                break;
+            case OPT_EXPLAIN:
+                options->explain = 1;
+                break;
+            case OPT_TOKENS:
+                options->tokens = 1;
+                break;
+            case OPT_FROM_FILE:
+                options->from_files[options->from_count++] = optarg;
+                break;
+            case OPT_TO_FILE:
+                options->to_files[options->to_count++] = optarg;
+                break;
+            case OPT_RULES:
+                options->rules_file = optarg;
+                break;
+            case OPT_CACHE:
+                options->cache_dir = optarg;
+                break;
+            case OPT_DIFF:
+                options->diff = 1;
+                break;
+            case OPT_REPORT:
+                options->report_file = optarg;
+                break;
+            case OPT_JOURNAL:
+                options->journal_file = optarg;
+                break;
+            case OPT_UNDO:
+                options->undo_file = optarg;
+                break;
+            case OPT_MEMO: {
+                char *end = NULL;
+                unsigned long entries = optarg ? strtoul(optarg, &end, 10) : MEMO_DEFAULT_ENTRIES;
+                if ((optarg && (*end || end == optarg)) || entries == 0 || entries > MEMO_MAX_ENTRIES) {
+                    fprintf(stderr, "Error: --memo takes a number of lines from 1 to %u.\n", MEMO_MAX_ENTRIES);
+                    return 1;
+                }
+                options->memo_entries = entries;
+                break;
+            }
+            case OPT_STATS:
+                options->stats = 1;
+                break;
+            case OPT_THREADS: {
+                char *end = NULL;
+                long threads = strtol(optarg, &end, 10);
+                if (*end || end == optarg || threads < 1 || threads > BUILD_MAX_THREADS) {
+                    fprintf(stderr, "Error: --threads takes a number from 1 to %d.\n", BUILD_MAX_THREADS);
+                    return 1;
+                }
+                options->threads = (int)threads;
+                break;
+            }
+            case OPT_PROGRESS:
+                options->progress = 1;
+                break;
+            case OPT_BACKUP:
+                options->backup_suffix = optarg ? optarg : "~";
+                if (!*options->backup_suffix) {
+                    fprintf(stderr, "Error: --backup needs a non-empty suffix.\n");
+                    return 1;
+                }
+                break;
+            case OPT_REPORT_FORMAT:
+                if (strcmp(optarg, "binary") == 0) {
+                    options->report_binary = 1;
+                } else if (strcmp(optarg, "ndjson") == 0) {
+                    options->report_binary = 0;
+                } else {
+                    fprintf(stderr, "Error: Unknown report format '%s' (ndjson or binary).\n", optarg);
+                    return 1;
+                }
+                break;
             default:
                 print_help(argv[0]);
                 return 1;
         }
     }
+    if (options->diff && options->check) {
+        fprintf(stderr, "Error: --diff cannot be combined with -n, -l or -q.\n");
+        return 1;
+    }
+    if (options->report_file && (options->diff || options->check == CHECK_LIST || options->check == CHECK_QUIET)) {
+        fprintf(stderr, "Error: --report needs every match; it cannot be combined with --diff, -l or -q.\n");
+        return 1;
+    }
+    if (options->journal_file && (options->diff || options->check || options->undo_file)) {
+        fprintf(stderr, "Error: --journal records rewrites; it cannot be combined with --diff, -n, -l, -q or --undo.\n");
+        return 1;
+    }
+    if (options->memo_entries && (options->report_file || options->journal_file)) {
+        fprintf(stderr, "Error: --memo skips scanning repeated lines; it cannot be combined with --report or --journal.\n");
+        return 1;
+    }
+    if (options->backup_suffix && (options->diff || options->check || options->undo_file)) {
+        fprintf(stderr, "Error: --backup keeps the originals of rewrites; it cannot be combined with --diff, -n, -l, -q or --undo.\n");
+        return 1;
+    }
     *replace_start = optind;
     return 0;
 }
 
 /* Parse from/to replacement strings */
 static int parse_replace_strings(int argc, char **argv, ReplaceList *replace_list) {
-    /* Initialize ReplaceList */
-    replace_list->capacity = argc / 2;
-    replace_list->count = 0;
-    replace_list->pairs = malloc(replace_list->capacity * sizeof(ReplacePair));
-    if (!replace_list->pairs) {
-        fprintf(stderr, "Memory allocation failed for replace pairs.\n");
+    /* Parse from/to pairs; argv outlives compilation, so the strings are not copied here */
+    if (!replace_list->escapes) {
+        for (int i = 0; i < argc; i += 2) {
+            if (add_replace_pair(replace_list, argv[i], strlen(argv[i]), argv[i + 1], strlen(argv[i + 1]))) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    /* With -e the strings are decoded into one copy, which the list keeps */
+    size_t total = 1;
+    for (int i = 0; i < argc; i++) {
+        total += strlen(argv[i]);
+    }
+    char *copy = malloc(total);
+    char **sources = copy ? realloc(replace_list->sources, (replace_list->source_count + 1) * sizeof(char *)) : NULL;
+    if (!sources) {
+        free(copy);
+        fprintf(stderr, "Memory allocation failed for replace strings.\n");
         return 1;
     }
+    replace_list->sources = sources;
+    replace_list->sources[replace_list->source_count++] = copy;
 
-    /* Parse from/to pairs */
+    char *cursor = copy;
     for (int i = 0; i < argc; i += 2) {
-        replace_list->pairs[replace_list->count].from = strdup(argv[i]);
-        replace_list->pairs[replace_list->count].to = strdup(argv[i + 1]);
-        if (!replace_list->pairs[replace_list->count].from || !replace_list->pairs[replace_list->count].to) {
-            fprintf(stderr, "Memory allocation failed for replace strings.\n");
+        size_t from_len = strlen(argv[i]);
+        size_t to_len = strlen(argv[i + 1]);
+        char *from = cursor;
+        memcpy(from, argv[i], from_len);
+        if (!replace_list->regex_mode) {
+            from_len = decode_escapes(from, from_len, 0);
+        }
+        char *to = from + from_len;
+        memcpy(to, argv[i + 1], to_len);
+        to_len = decode_escapes(to, to_len, replace_list->regex_mode);
+        cursor = to + to_len;
+        if (add_replace_pair(replace_list, from, from_len, to, to_len)) {
             return 1;
         }
-        replace_list->count += 1;
     }
+    return 0;
+}
 
-    /* Sort replace pairs by descending length of 'from' strings to prioritize longer matches */
-    for (size_t i = 0; i < replace_list->count - 1; i++) {
-        for (size_t j = i + 1; j < replace_list->count; j++) {
-            size_t len_i = strlen(replace_list->pairs[i].from);
-            size_t len_j = strlen(replace_list->pairs[j].from);
-            if (len_j > len_i) {
-                /* Swap */
-                ReplacePair temp = replace_list->pairs[i];
-                replace_list->pairs[i] = replace_list->pairs[j];
-                replace_list->pairs[j] = temp;
+/*
+   Decode \t \n \r \0 \\ and \xNN in place and return the new length; other
+   escapes are kept as written. With -E the regex parser reads from-strings
+   itself, so they are not decoded, and keep_refs leaves \0-\9 and \\ of to-strings for group expansion.
+*/
+static size_t decode_escapes(char *str, size_t len, int keep_refs) {
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = str[i];
+        if (c != '\\' || i + 1 == len) {
+            str[out++] = c;
+            continue;
+        }
+        char next = str[i + 1];
+        if (keep_refs && (next == '\\' || (next >= '0' && next <= '9'))) {
+            str[out++] = c;
+            str[out++] = next;
+            i++;
+            continue;
+        }
+        switch (next) {
+            case 't': str[out++] = '\t'; i++; break;
+            case 'n': str[out++] = '\n'; i++; break;
+            case 'r': str[out++] = '\r'; i++; break;
+            case '0': str[out++] = '\0'; i++; break;
+            case '\\': str[out++] = '\\'; i++; break;
+            case 'x':
+                if (i + 3 < len && hex_value(str[i + 2]) >= 0 && hex_value(str[i + 3]) >= 0) {
+                    str[out++] = (char)(hex_value(str[i + 2]) * 16 + hex_value(str[i + 3]));
+                    i += 3;
+                    break;
+                }
+                str[out++] = c;
+                break;
+            default:
+                str[out++] = c;
+                break;
+        }
+    }
+    return out;
+}
+
+/*
+   Read pairs from a file, one per line as 'from<TAB>to'; a trailing CR is dropped
+   and empty lines are skipped. The pairs point into the file contents, which
+   the list keeps until it is freed. A large file is cut at line ends into
+   slices parsed by separate threads; the pairs are added in file order.
+*/
+static int parse_pairs_file(const char *filename, ReplaceList *replace_list) {
+    size_t len;
+    char *data = read_source_file(filename, "pairs file", replace_list, &len);
+    if (!data) {
+        return 1;
+    }
+
+    /* Pairs are rarely shorter than 16 bytes a line */
+    size_t parts = build_parts(replace_list, len / 16);
+    PairsSlice slices[BUILD_MAX_THREADS];
+    size_t begin = 0;
+    for (size_t i = 0; i < parts; i++) {
+        size_t end = len;
+        if (i + 1 < parts) {
+            size_t cut = len / parts * (i + 1);
+            const char *newline = (cut >= begin) ? memchr(data + cut, '\n', len - cut) : NULL;
+            end = newline ? (size_t)(newline - data) + 1 : (cut < begin) ? begin : len;
+        }
+        memset(&slices[i], 0, sizeof(PairsSlice));
+        slices[i].data = data;
+        slices[i].begin = begin;
+        slices[i].end = end;
+        slices[i].escapes = replace_list->escapes;
+        slices[i].regex_mode = replace_list->regex_mode;
+        begin = end;
+    }
+    run_parts(parse_pairs_slice, slices, parts);
+
+    int error = 0;
+    size_t line_base = 0;
+    for (size_t i = 0; i < parts; i++) {
+        const PairsSlice *slice = &slices[i];
+        if (!error && slice->failed) {
+            fprintf(stderr, "Memory allocation failed for replace pairs.\n");
+            error = 1;
+        }
+        for (size_t k = 0; k < slice->count && !error; k++) {
+            const PairSpan *pair = &slice->pairs[k];
+            error = add_replace_pair(replace_list, pair->from, pair->from_len, pair->to, pair->to_len);
+        }
+        if (!error && slice->bad_line) {
+            fprintf(stderr, "Error: %s:%zu: expected 'from<TAB>to'.\n", filename, line_base + slice->bad_line);
+            error = 1;
+        }
+        line_base += slice->lines;
+        free(slice->pairs);
+    }
+    if (!error) {
+        progress(replace_list, "read %zu pairs from %s", replace_list->count, filename);
+    }
+    return error;
+}
+
+/* Parse the lines of one slice, stopping at the first one without a tab */
+static void parse_pairs_slice(void *arg, size_t part, size_t parts) {
+    PairsSlice *slice = &((PairsSlice *)arg)[part];
+    char *data = slice->data;
+    (void)parts;
+
+    for (size_t pos = slice->begin; pos < slice->end;) {
+        char *line = data + pos;
+        const char *newline = memchr(line, '\n', slice->end - pos);
+        size_t line_len = newline ? (size_t)(newline - line) : slice->end - pos;
+        pos += line_len + 1;
+        slice->lines++;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        if (line_len == 0) continue;
+        char *tab = memchr(line, '\t', line_len);
+        if (!tab) {
+            slice->bad_line = slice->lines;
+            return;
+        }
+        size_t from_len = (size_t)(tab - line);
+        size_t to_len = line_len - from_len - 1;
+        if (slice->escapes) {
+            /* Decoding only shrinks, so it happens in place in the file contents */
+            if (!slice->regex_mode) {
+                from_len = decode_escapes(line, from_len, 0);
+            }
+            to_len = decode_escapes(tab + 1, to_len, slice->regex_mode);
+        }
+        if (slice->count == slice->capacity) {
+            size_t capacity = slice->capacity ? slice->capacity * 2 : 1024;
+            PairSpan *pairs = realloc(slice->pairs, capacity * sizeof(PairSpan));
+            if (!pairs) {
+                slice->failed = 1;
+                return;
             }
+            slice->pairs = pairs;
+            slice->capacity = capacity;
         }
+        PairSpan *pair = &slice->pairs[slice->count++];
+        pair->from = line;
+        pair->from_len = from_len;
+        pair->to = tab + 1;
+        pair->to_len = to_len;
     }
+}
 
-    return 0;
+/* Read a whole file that pairs will point into; the list owns the contents until it is freed */
+static char *read_source_file(const char *filename, const char *what, ReplaceList *replace_list, size_t *len) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s %s: %s\n", what, filename, strerror(errno));
+        return NULL;
+    }
+    size_t capacity = 65536;
+    size_t used = 0;
+    char *data = malloc(capacity);
+    while (data) {
+        used += fread(data + used, 1, capacity - used, file);
+        if (used < capacity) break;
+        char *data_new = realloc(data, capacity * 2);
+        if (!data_new) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        data = data_new;
+        capacity *= 2;
+    }
+    int read_error = ferror(file);
+    fclose(file);
+    char **sources = data ? realloc(replace_list->sources, (replace_list->source_count + 1) * sizeof(char *)) : NULL;
+    if (!sources) {
+        free(data);
+        fprintf(stderr, "Memory allocation failed for %s.\n", what);
+        return NULL;
+    }
+    replace_list->sources = sources;
+    replace_list->sources[replace_list->source_count++] = data;
+    if (read_error) {
+        fprintf(stderr, "Error reading %s %s\n", what, filename);
+        return NULL;
+    }
+    *len = used;
+    return data;
 }
 
-/* Free memory allocated for ReplaceList */
-static void free_replace_list(ReplaceList *replace_list) {
-    if (replace_list->pairs) {
-        for (size_t i = 0; i < replace_list->count; i++) {
-            free(replace_list->pairs[i].from);
-            free(replace_list->pairs[i].to);
+/* Pair up --from-file and --to-file arguments in the order they were given */
+static int parse_block_files(const ProgramOptions *options, ReplaceList *replace_list) {
+    if (options->from_count != options->to_count) {
+        fprintf(stderr, "Error: Each --from-file needs a matching --to-file.\n");
+        return 1;
+    }
+    for (int i = 0; i < options->from_count; i++) {
+        size_t from_len, to_len;
+        const char *from = read_source_file(options->from_files[i], "from-file", replace_list, &from_len);
+        if (!from) {
+            return 1;
+        }
+        const char *to = read_source_file(options->to_files[i], "to-file", replace_list, &to_len);
+        if (!to) {
+            return 1;
+        }
+        if (add_replace_pair(replace_list, from, from_len, to, to_len)) {
+            return 1;
         }
-        free(replace_list->pairs);
-        replace_list->pairs = NULL;
     }
-    replace_list->count = 0;
-    replace_list->capacity = 0;
+    return 0;
 }
 
-/* Replace occurrences in a single string based on ReplaceList */
-static char* replace_in_string(const char *str, ReplaceList *replace_list, int *updated) {
-    *updated = 0;
-    size_t len = strlen(str);
-    /* Allocate a buffer with initial size */
-    size_t buffer_size = len + 1;
-    char *result = malloc(buffer_size);
-    if (!result) {
-        fprintf(stderr, "Memory allocation failed for replacement.\n");
-        exit(1);
+/*
+   Read a --rules file: one 'GLOB PAIRS-FILE' per line, '#' starts a comment.
+   A glob without '/' matches the base name, otherwise the whole path; pairs
+   files are relative to the rules file. Each distinct pairs file becomes one
+   set, however many rules name it.
+*/
+static int load_rules(const char *filename, RuleTable *table) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open rules file %s: %s\n", filename, strerror(errno));
+        return 1;
     }
-    char *res_ptr = result;
+    const char *slash = strrchr(filename, '/');
+    size_t dir_len = slash ? (size_t)(slash - filename) + 1 : 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t line_number = 0;
+    ssize_t line_len;
+    int error = 0;
 
-    const char *current = str;
-    while (*current) {
-        size_t match_len = 0;
-        size_t replace_idx = replace_list->count; /* Initialize to invalid index */
-        /* Find the longest matching 'from' string */
-        for (size_t i = 0; i < replace_list->count; i++) {
-            size_t from_len = strlen(replace_list->pairs[i].from);
-            if (from_len == 0) continue; /* Avoid empty from-string */
-            if (strncmp(current, replace_list->pairs[i].from, from_len) == 0) {
-                if (from_len > match_len) { /* Prefer longer matches */
-                    match_len = from_len;
-                    replace_idx = i;
-                }
-            }
+    while (!error && (line_len = getline(&line, &line_capacity, file)) != -1) {
+        line_number++;
+        while (line_len > 0 && isspace((unsigned char)line[line_len - 1])) {
+            line[--line_len] = '\0';
+        }
+        char *glob = line;
+        while (isspace((unsigned char)*glob)) glob++;
+        if (*glob == '\0' || *glob == '#') continue;
+        char *path = glob;
+        while (*path && !isspace((unsigned char)*path)) path++;
+        if (*path) *path++ = '\0';
+        while (isspace((unsigned char)*path)) path++;
+        if (*path == '\0') {
+            fprintf(stderr, "Error: %s:%zu: expected 'GLOB PAIRS-FILE'.\n", filename, line_number);
+            error = 1;
+            break;
         }
 
-        if (replace_idx < replace_list->count) {
-            /* Match found; perform replacement */
-            size_t to_len = strlen(replace_list->pairs[replace_idx].to);
-            size_t current_len = res_ptr - result;
-            size_t new_len = current_len + to_len + 1;
-            if (new_len > buffer_size) {
-                buffer_size = new_len * 2;
-                char *temp = realloc(result, buffer_size);
-                if (!temp) {
-                    fprintf(stderr, "Memory allocation failed during replacement.\n");
-                    free(result);
-                    exit(1);
-                }
-                res_ptr = temp + (res_ptr - result);
-                result = temp;
-            }
-            memcpy(res_ptr, replace_list->pairs[replace_idx].to, to_len);
-            res_ptr += to_len;
-            *res_ptr = '\0';
-            current += match_len;
-            *updated = 1;
+        /* Resolve the pairs file next to the rules file and find or add its set */
+        size_t prefix = (*path == '/') ? 0 : dir_len;
+        char *set_file = malloc(prefix + strlen(path) + 1);
+        Rule *rules = realloc(table->rules, (table->count + 1) * sizeof(Rule));
+        if (rules) table->rules = rules;
+        char **set_files = realloc(table->set_files, (table->set_count + 1) * sizeof(char *));
+        if (set_files) table->set_files = set_files;
+        char *rule_glob = strdup(glob);
+        if (!set_file || !rules || !set_files || !rule_glob) {
+            fprintf(stderr, "Memory allocation failed for rules.\n");
+            free(set_file);
+            free(rule_glob);
+            error = 1;
+            break;
+        }
+        memcpy(set_file, filename, prefix);
+        strcpy(set_file + prefix, path);
+        size_t set = 0;
+        while (set < table->set_count && strcmp(table->set_files[set], set_file) != 0) {
+            set++;
+        }
+        if (set == table->set_count) {
+            table->set_files[table->set_count++] = set_file;
         } else {
-            /* No match; copy the current character */
-            if ((res_ptr - result) + 2 > buffer_size) {
-                buffer_size *= 2;
-                char *temp = realloc(result, buffer_size);
-                if (!temp) {
-                    fprintf(stderr, "Memory allocation failed during copying.\n");
-                    free(result);
-                    exit(1);
-                }
-                res_ptr = temp + (res_ptr - result);
-                result = temp;
-            }
-            *res_ptr++ = *current++;
-            *res_ptr = '\0';
+            free(set_file);
         }
+        table->rules[table->count].glob = rule_glob;
+        table->rules[table->count].set = set;
+        table->count++;
+    }
+    free(line);
+    fclose(file);
+    if (!error && table->count == 0) {
+        fprintf(stderr, "Error: rules file %s has no rules.\n", filename);
+        error = 1;
     }
+    return error;
+}
 
-    return result;
+/* First rule whose glob matches the file, NULL if none does */
+static const Rule *match_rule(const RuleTable *table, const char *filename) {
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    while (strncmp(filename, "./", 2) == 0) {
+        filename += 2;
+    }
+    for (size_t i = 0; i < table->count; i++) {
+        const char *glob = table->rules[i].glob;
+        if (fnmatch(glob, strchr(glob, '/') ? filename : base, FNM_PATHNAME) == 0) {
+            return &table->rules[i];
+        }
+    }
+    return NULL;
 }
 
-/* Process a single input stream (stdin or a file) */
-static int process_stream(FILE *in, FILE *out, ReplaceList *replace_list, ProgramOptions *options) {
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
+/*
+   Rewrite files with the set chosen by --rules. Every set is compiled once
+   up front, sampling the first file dispatched to it, and each file is then
+   processed with the set of the first rule it matches.
+*/
+static int run_rules(ProgramOptions *options, char **files, int num_files) {
+    RuleTable table = {0};
     int error = 0;
+    if (num_files == 0) {
+        fprintf(stderr, "Error: --rules needs files to match against.\n");
+        return 1;
+    }
+    if (load_rules(options->rules_file, &table)) {
+        free_rules(&table);
+        return 1;
+    }
+    table.sets = calloc(table.set_count, sizeof(ReplaceList));
+    char *sample = malloc(ENGINE_SAMPLE_SIZE);
+    if (!table.sets || !sample) {
+        fprintf(stderr, "Memory allocation failed for rules.\n");
+        free(sample);
+        free_rules(&table);
+        return 1;
+    }
 
-    while ((read = getline(&line, &len, in)) != -1) {
-        /* Remove newline character for consistent processing */
-        if (read > 0 && line[read - 1] == '\n') {
-            line[read - 1] = '\0';
+    for (size_t set = 0; set < table.set_count && !error; set++) {
+        ReplaceList *list = &table.sets[set];
+        size_t sample_len = 0;
+        for (int i = 0; i < num_files; i++) {
+            const Rule *rule = match_rule(&table, files[i]);
+            if (rule && rule->set == set) {
+                sample_len = read_input_sample(files + i, 1, sample, ENGINE_SAMPLE_SIZE);
+                break;
+            }
+        }
+        list->stage = 1;
+        error = init_stage(list, options) || parse_pairs_file(table.set_files[set], list) ||
+                compile_replace_list(list, options->engine, sample, sample_len);
+        if (error) break;
+        if (options->explain) {
+            fprintf(stderr, "%s engine: %s (%s)\n", table.set_files[set], list->engine->name, list->engine_reason);
+        }
+        if (options->verbose) {
+            printf("Replacement pairs from %s:\n", table.set_files[set]);
+            for (size_t i = 0; i < list->count; i++) {
+                const ReplacePair *pair = &list->pairs[i];
+                printf("  '%.*s' -> '%.*s'\n", (int)pair->from_len, pair->from, (int)pair->to_len, pair->to);
+            }
         }
+    }
+    free(sample);
+    if (error) {
+        free_rules(&table);
+        return 1;
+    }
 
-        int updated = 0;
-        char *replaced = replace_in_string(line, replace_list, &updated);
-        if (!replaced) {
-            fprintf(stderr, "Replacement failed.\n");
-            free(line);
+    Report report = {0};
+    if (options->report_file) {
+        if (report_open(&report, options->report_file, options->report_binary)) {
+            free_rules(&table);
+            return 1;
+        }
+        options->report = &report;
+        for (size_t set = 0; set < table.set_count; set++) {
+            table.sets[set].report = &report;
+        }
+    }
+    Journal journal = {0};
+    if (options->journal_file) {
+        if (journal_open(&journal, options->journal_file)) {
+            if (options->report) report_close(&report);
+            free_rules(&table);
+            return 1;
+        }
+        options->journal = &journal;
+        for (size_t set = 0; set < table.set_count; set++) {
+            table.sets[set].journal = &journal;
+        }
+    }
+    Cache cache = {0};
+    if (options->cache_dir) {
+        if (cache_open(&cache, options->cache_dir)) {
+            if (options->report) report_close(&report);
+            if (options->journal) journal_close(&journal);
+            free_rules(&table);
             return 1;
         }
+        options->cache = &cache;
+    }
+    for (int i = 0; i < num_files && !(options->check == CHECK_QUIET && options->matched); i++) {
+        const Rule *rule = match_rule(&table, files[i]);
+        report.file = (uint32_t)i;
+        if (!rule) {
+            if (options->verbose) {
+                printf("No rule for %s, left unchanged\n", files[i]);
+            }
+            continue;
+        }
+        error |= process_file(files[i], &table.sets[rule->set], options);
+    }
+    if (options->cache) {
+        error |= cache_close(&cache);
+        options->cache = NULL;
+    }
+    if (options->report) {
+        error |= report_close(&report);
+        options->report = NULL;
+    }
+    if (options->journal) {
+        error |= journal_close(&journal);
+        options->journal = NULL;
+    }
+    if (options->stats) {
+        print_stats(options, table.sets, table.set_count);
+    }
+    free_rules(&table);
+    if (error) {
+        return 2;
+    }
+    return (options->check && !options->matched) ? 1 : 0;
+}
 
-        /* Add newline back */
-        strcat(replaced, "\n");
+/* Free the rules and every set they compiled */
+static void free_rules(RuleTable *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        free(table->rules[i].glob);
+    }
+    for (size_t i = 0; i < table->set_count; i++) {
+        if (table->sets) free_replace_list(&table->sets[i]);
+        free(table->set_files[i]);
+    }
+    free(table->rules);
+    free(table->sets);
+    free(table->set_files);
+}
 
-        /* Write to output */
-        if (fputs(replaced, out) == EOF) {
-            fprintf(stderr, "Error writing to output: %s\n", strerror(errno));
-            free(replaced);
-            free(line);
+/* Append a pair; the strings must stay valid until compile_replace_list copies them */
+static int add_replace_pair(ReplaceList *replace_list, const char *from, size_t from_len, const char *to, size_t to_len) {
+    if (replace_list->count == replace_list->capacity) {
+        size_t capacity = replace_list->capacity ? replace_list->capacity * 2 : 16;
+        ReplacePair *pairs = realloc(replace_list->pairs, capacity * sizeof(ReplacePair));
+        if (!pairs) {
+            fprintf(stderr, "Memory allocation failed for replace pairs.\n");
             return 1;
         }
+        replace_list->pairs = pairs;
+        replace_list->capacity = capacity;
+    }
 
-        if (options->verbose && updated) {
-            printf("Replaced in line: %s", replaced);
-        }
+    ReplacePair *pair = &replace_list->pairs[replace_list->count];
+    memset(pair, 0, sizeof(*pair));
+    pair->from = from;
+    pair->to = to;
+    pair->from_len = from_len;
+    pair->to_len = to_len;
+    pair->index = replace_list->count;
+    replace_list->count += 1;
+    return 0;
+}
 
-        free(replaced);
+/* Order pairs by descending 'from' length so the first match is the longest; ties keep input order */
+static int compare_pairs(const void *a, const void *b) {
+    const ReplacePair *pa = a;
+    const ReplacePair *pb = b;
+    if (pa->from_len != pb->from_len) {
+        return (pa->from_len > pb->from_len) ? -1 : 1;
     }
-
-    free(line);
-    return error;
+    return (pa->index > pb->index) - (pa->index < pb->index);
 }
 
-/* Process a single file: read, replace, write to a temporary file, then replace original */
-static int process_file(const char *filename, ReplaceList *replace_list, ProgramOptions *options) {
-    FILE *in = fopen(filename, "r");
-    if (!in) {
-        fprintf(stderr, "Failed to open file %s: %s\n", filename, strerror(errno));
+/* Sort the pairs, move their strings into one pool and precompute match metadata */
+static int compile_replace_list(ReplaceList *replace_list, const char *engine, const char *sample, size_t sample_len) {
+    sort_parallel(replace_list->pairs, replace_list->count, sizeof(ReplacePair), compare_pairs,
+                  build_parts(replace_list, replace_list->count));
+    progress(replace_list, "sorted %zu pairs", replace_list->count);
+
+    /* Each string is NUL-terminated in the pool for convenience; lengths stay authoritative */
+    size_t pool_size = 0;
+    for (size_t i = 0; i < replace_list->count; i++) {
+        pool_size += replace_list->pairs[i].from_len + replace_list->pairs[i].to_len + 2;
+    }
+    char *pool = malloc(pool_size ? pool_size : 1);
+    if (!pool) {
+        fprintf(stderr, "Memory allocation failed for replace strings.\n");
         return 1;
     }
 
-    /* Create a temporary file using mkstemp */
-    char temp_template[] = "replace_tempXXXXXX";
-    int temp_fd = mkstemp(temp_template);
-    if (temp_fd == -1) {
-        fprintf(stderr, "Failed to create temporary file: %s\n", strerror(errno));
-        fclose(in);
-        return 1;
+    /* Lay out each 'from' directly followed by its 'to', in match order */
+    char *cursor = pool;
+    for (size_t i = 0; i < replace_list->count; i++) {
+        ReplacePair *pair = &replace_list->pairs[i];
+        memcpy(cursor, pair->from, pair->from_len);
+        if (replace_list->ignore_case && !replace_list->regex_mode) {
+            for (size_t k = 0; k < pair->from_len; k++) {
+                cursor[k] = (char)fold_byte((unsigned char)cursor[k]);
+            }
+        }
+        cursor[pair->from_len] = '\0';
+        pair->from = cursor;
+        cursor += pair->from_len + 1;
+        memcpy(cursor, pair->to, pair->to_len);
+        cursor[pair->to_len] = '\0';
+        pair->to = cursor;
+        cursor += pair->to_len + 1;
+
+        static const unsigned char ones[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+        size_t prefix_len = pair->from_len < 8 ? pair->from_len : 8;
+        pair->prefix = 0;
+        pair->prefix_mask = 0;
+        memcpy(&pair->prefix, pair->from, prefix_len);
+        memcpy(&pair->prefix_mask, ones, prefix_len);
+        pair->first = pair->from_len ? (unsigned char)pair->from[0] : 0;
+
+        /* Lines are matched one at a time unless a literal pattern spans them */
+        if (pair->from_len > replace_list->max_from_len) {
+            replace_list->max_from_len = pair->from_len;
+        }
+        if (!replace_list->regex_mode && memchr(pair->from, '\n', pair->from_len)) {
+            replace_list->stream = 1;
+        }
     }
 
-    FILE *out = fdopen(temp_fd, "w");
-    if (!out) {
-        fprintf(stderr, "Failed to open temporary file: %s\n", strerror(errno));
-        close(temp_fd);
-        fclose(in);
+    free(replace_list->pool);
+    replace_list->pool = pool;
+    replace_list->pool_size = pool_size;
+
+    if (select_engine(replace_list, engine, sample, sample_len)) {
         return 1;
     }
+    if (replace_list->engine->compile) {
+        replace_list->sample = sample;
+        replace_list->sample_len = sample_len;
+        int error = replace_list->engine->compile(replace_list);
+        replace_list->sample = NULL;
+        replace_list->sample_len = 0;
+        if (!error) {
+            progress(replace_list, "built the %s engine", replace_list->engine->name);
+        }
+        return error;
+    }
+    build_literal_prefilter(replace_list);
+    return 0;
+}
+
+/* Parts to split a build step of 'items' items into: one per thread, none smaller than BUILD_GRAIN */
+static size_t build_parts(const ReplaceList *replace_list, size_t items) {
+    size_t parts = items / BUILD_GRAIN;
+    if (parts > (size_t)replace_list->threads) {
+        parts = (size_t)replace_list->threads;
+    }
+    return parts ? parts : 1;
+}
 
-    /* Process the file */
-    int error = process_stream(in, out, replace_list, options);
-    fclose(in);
-    fclose(out);
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    worker->run(worker->arg, worker->part, worker->parts);
+    return NULL;
+}
 
-    if (error) {
-        /* Remove temporary file on error */
-        remove(temp_template);
-        return 1;
+/* Call run(arg, part, parts) for every part, each on its own thread; part 0 runs on the caller's */
+static void run_parts(void (*run)(void *arg, size_t part, size_t parts), void *arg, size_t parts) {
+    Worker workers[BUILD_MAX_THREADS];
+    pthread_t threads[BUILD_MAX_THREADS];
+    int started[BUILD_MAX_THREADS];
+    if (parts == 0) {
+        return;
+    }
+    for (size_t i = 1; i < parts; i++) {
+        workers[i].run = run;
+        workers[i].arg = arg;
+        workers[i].part = i;
+        workers[i].parts = parts;
+        started[i] = (pthread_create(&threads[i], NULL, worker_main, &workers[i]) == 0);
+        if (!started[i]) {
+            /* No thread to spare: the part is still done, just not in parallel */
+            run(arg, i, parts);
+        }
     }
+    run(arg, 0, parts);
+    for (size_t i = 1; i < parts; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
 
-    /* Replace the original file with the temporary file */
-    if (remove(filename) != 0) {
-        fprintf(stderr, "Failed to remove original file %s: %s\n", filename, strerror(errno));
-        remove(temp_template);
-        return 1;
+static void sort_part(void *arg, size_t part, size_t parts) {
+    const SortJob *job = arg;
+    size_t lo = job->count * part / parts;
+    size_t hi = job->count * (part + 1) / parts;
+    qsort(job->src + lo * job->size, hi - lo, job->size, job->compare);
+}
+
+/* Merge two neighbouring sorted runs of job->width parts each; ties take the left run first */
+static void merge_part(void *arg, size_t part, size_t parts) {
+    const SortJob *job = arg;
+    size_t first = part * 2 * job->width;
+    size_t middle = first + job->width < job->parts ? first + job->width : job->parts;
+    size_t last = first + 2 * job->width < job->parts ? first + 2 * job->width : job->parts;
+    size_t size = job->size;
+    const char *a = job->src + job->count * first / job->parts * size;
+    const char *a_end = job->src + job->count * middle / job->parts * size;
+    const char *b = a_end;
+    const char *b_end = job->src + job->count * last / job->parts * size;
+    char *out = job->dst + job->count * first / job->parts * size;
+    (void)parts;
+
+    while (a < a_end && b < b_end) {
+        if (job->compare(b, a) < 0) {
+            memcpy(out, b, size);
+            b += size;
+        } else {
+            memcpy(out, a, size);
+            a += size;
+        }
+        out += size;
     }
-    if (rename(temp_template, filename) != 0) {
-        fprintf(stderr, "Failed to rename temporary file to %s: %s\n", filename, strerror(errno));
-        remove(temp_template);
-        return 1;
+    memcpy(out, a, (size_t)(a_end - a));
+    out += a_end - a;
+    memcpy(out, b, (size_t)(b_end - b));
+}
+
+/* qsort split across 'parts' threads; falls back to plain qsort without the memory to merge */
+static void sort_parallel(void *base, size_t count, size_t size, int (*compare)(const void *, const void *), size_t parts) {
+    if (count < 2) {
+        return;
+    }
+    char *scratch = (parts > 1) ? malloc(count * size) : NULL;
+    if (!scratch) {
+        qsort(base, count, size, compare);
+        return;
     }
+    SortJob job = {base, scratch, count, size, parts, 1, compare};
+    run_parts(sort_part, &job, parts);
+    for (; job.width < parts; job.width *= 2) {
+        run_parts(merge_part, &job, (parts + 2 * job.width - 1) / (2 * job.width));
+        char *swap = job.src;
+        job.src = job.dst;
+        job.dst = swap;
+    }
+    if (job.src != base) {
+        memcpy(base, job.src, count * size);
+    }
+    free(scratch);
+}
 
-    if (!options->silent) {
-        if (options->verbose) {
-            printf("%s converted\n", filename);
+/*
+   --progress: a line on stderr for each finished build step, with the time
+   it took. A NULL format only starts the clock for the next step.
+*/
+static void progress(const ReplaceList *replace_list, const char *format, ...) {
+    static struct timespec last;
+    if (!replace_list->progress) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (format) {
+        va_list args;
+        va_start(args, format);
+        fprintf(stderr, "replace: ");
+        vfprintf(stderr, format, args);
+        fprintf(stderr, " (%.2fs)\n", (double)(now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9);
+        va_end(args);
+    }
+    last = now;
+}
+
+/* Prefilter on the first bytes of the from-strings; with -i they are folded, so both cases must reach the matcher */
+static void build_literal_prefilter(ReplaceList *replace_list) {
+    unsigned char member[256] = {0};
+    for (size_t i = 0; i < replace_list->count; i++) {
+        const ReplacePair *pair = &replace_list->pairs[i];
+        if (pair->from_len == 0) continue;
+        member[pair->first] = 1;
+        if (replace_list->ignore_case && pair->first >= 'a' && pair->first <= 'z') {
+            member[pair->first - 'a' + 'A'] = 1;
+        }
+    }
+    build_prefilter(&replace_list->prefilter, member);
+}
+
+/* Build the candidate scan for a set of start bytes; both cases of a letter share one masked entry */
+static void build_prefilter(Prefilter *prefilter, const unsigned char member[256]) {
+    memset(prefilter, 0, sizeof(*prefilter));
+    memcpy(prefilter->member, member, sizeof(prefilter->member));
+
+    /* High nibbles get one of eight bucket bits; sharing a bucket only adds false positives */
+    int buckets = 0;
+    for (int c = 0; c < 256; c++) {
+        if (!member[c]) continue;
+        int lower_pair = (c >= 'a' && c <= 'z' && member[c - 'a' + 'A']);
+        int upper_pair = (c >= 'A' && c <= 'Z' && member[c - 'A' + 'a']);
+        if (upper_pair) {
+            /* Covered by the masked entry of its lowercase form */
+        } else if (prefilter->nbytes >= 0 && prefilter->nbytes < PREFILTER_MAX_BYTES) {
+            prefilter->case_mask[prefilter->nbytes] = lower_pair ? 0x20 : 0;
+            prefilter->bytes[prefilter->nbytes++] = (unsigned char)c;
+        } else {
+            prefilter->nbytes = -1;
+        }
+        if (!prefilter->hi[c >> 4]) {
+            prefilter->hi[c >> 4] = (unsigned char)(1u << (buckets++ % 8));
+        }
+        prefilter->lo[c & 15] |= prefilter->hi[c >> 4];
+    }
+
+    /* Shared buckets can admit bytes outside the set; note when they do not */
+    prefilter->exact = 1;
+    for (int c = 0; c < 256; c++) {
+        if (((prefilter->lo[c & 15] & prefilter->hi[c >> 4]) != 0) != (member[c] != 0)) {
+            prefilter->exact = 0;
+            break;
         }
     }
+}
+
+/* Free memory allocated for ReplaceList */
+static void free_replace_list(ReplaceList *replace_list) {
+    free_regex(replace_list->regex);
+    replace_list->regex = NULL;
+    free_fdr(replace_list->fdr);
+    replace_list->fdr = NULL;
+    free_phash(replace_list->phash);
+    replace_list->phash = NULL;
+    free_rolling(replace_list->rolling);
+    replace_list->rolling = NULL;
+    free_ac(replace_list->ac);
+    replace_list->ac = NULL;
+    free_memo(replace_list->memo);
+    replace_list->memo = NULL;
+    for (size_t i = 0; i < replace_list->source_count; i++) {
+        free(replace_list->sources[i]);
+    }
+    free(replace_list->sources);
+    replace_list->sources = NULL;
+    replace_list->source_count = 0;
+    free(replace_list->pairs);
+    free(replace_list->pool);
+    replace_list->pairs = NULL;
+    replace_list->pool = NULL;
+    replace_list->pool_size = 0;
+    replace_list->count = 0;
+    replace_list->capacity = 0;
+    if (replace_list->next) {
+        free_replace_list(replace_list->next);
+        free(replace_list->next);
+        replace_list->next = NULL;
+    }
+}
+
+/* Apply the matching options to one stage of the chain */
+static int init_stage(ReplaceList *replace_list, const ProgramOptions *options) {
+    replace_list->ignore_case = options->ignore_case;
+    replace_list->whole_word = options->whole_word;
+    replace_list->regex_mode = options->regex_mode;
+    replace_list->tokens = options->tokens;
+    replace_list->escapes = options->escapes;
+    replace_list->threads = options->threads;
+    if (replace_list->threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        replace_list->threads = (cpus < 1) ? 1 : (cpus > BUILD_MAX_THREADS) ? BUILD_MAX_THREADS : (int)cpus;
+    }
+    replace_list->progress = options->progress;
+    progress(replace_list, NULL);
+    return set_word_chars(replace_list, options->word_chars ? options->word_chars : "a-zA-Z0-9_");
+}
 
+/* Build the word character table from a set like "a-zA-Z0-9_"; a '-' at either end is literal */
+static int set_word_chars(ReplaceList *replace_list, const char *spec) {
+    const unsigned char *p = (const unsigned char *)spec;
+    memset(replace_list->word_chars, 0, sizeof(replace_list->word_chars));
+    while (*p) {
+        unsigned char low = *p;
+        unsigned char high = low;
+        if (p[1] == '-' && p[2]) {
+            high = p[2];
+            p += 3;
+        } else {
+            p += 1;
+        }
+        if (low > high) {
+            fprintf(stderr, "Error: Invalid range '%c-%c' in word characters.\n", low, high);
+            return 1;
+        }
+        for (unsigned c = low; c <= high; c++) {
+            replace_list->word_chars[c] = 1;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/* ASCII lowercase of a byte */
+static inline unsigned char fold_byte(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c | 0x20) : c;
+}
+
+/* ASCII lowercase of eight bytes at once, leaving non-letters untouched */
+static inline uint64_t fold_word(uint64_t word) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t low7 = word & (0x7f * ones);
+    uint64_t at_least_a = low7 + (0x80 - 'A') * ones;
+    uint64_t above_z = low7 + (0x80 - 'Z' - 1) * ones;
+    uint64_t upper = at_least_a & ~above_z & ~word & (0x80 * ones);
+    return word | (upper >> 2);
+}
+
+/* Compare text against a pattern, which is already folded when ignoring case */
+static int bytes_equal(const char *text, const char *pattern, size_t n, int ignore_case) {
+    if (!ignore_case) {
+        return memcmp(text, pattern, n) == 0;
+    }
+    for (; n >= 8; n -= 8, text += 8, pattern += 8) {
+        uint64_t a, b;
+        memcpy(&a, text, 8);
+        memcpy(&b, pattern, 8);
+        if (fold_word(a) != b) return 0;
+    }
+    while (n--) {
+        if (fold_byte((unsigned char)*text++) != (unsigned char)*pattern++) return 0;
+    }
+    return 1;
+}
+
+/* Make room for at least 'extra' more bytes, growing geometrically */
+static void output_reserve(OutputBuffer *out, size_t extra) {
+    if (out->capacity - out->len >= extra) {
+        return;
+    }
+    size_t capacity = out->capacity ? out->capacity * 2 : 256;
+    while (capacity - out->len < extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(out->data, capacity);
+    if (!data) {
+        fprintf(stderr, "Memory allocation failed for output buffer.\n");
+        exit(1);
+    }
+    out->data = data;
+    out->capacity = capacity;
+}
+
+/* Find the leftmost-longest literal match at or after 'pos'; returns 0 when there is none */
+static int find_literal(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match) {
+    const char *current = str + pos;
+    const char *end = str + len;
+
+    while (current < end) {
+        /* Skip straight to the next byte that can start a match */
+        current = kernels->find_first(current, end, &replace_list->prefilter);
+        if (current == end) break;
+
+        /* In whole-word mode nothing can match right after a word character */
+        if (replace_list->whole_word) {
+            int before = (current > str) ? (unsigned char)current[-1] : prev_byte;
+            if (before >= 0 && replace_list->word_chars[before]) {
+                current++;
+                continue;
+            }
+        }
+
+        size_t remaining = (size_t)(end - current);
+        unsigned char c = (unsigned char)*current;
+        uint64_t word = 0;
+        memcpy(&word, current, remaining < 8 ? remaining : 8);
+        if (replace_list->ignore_case) {
+            /* Fold the text as it is compared; the output still copies the original bytes */
+            c = fold_byte(c);
+            word = fold_word(word);
+        }
+        /* Pairs are sorted by descending length, so the first match is the longest */
+        for (size_t i = 0; i < replace_list->count; i++) {
+            const ReplacePair *pair = &replace_list->pairs[i];
+            if (pair->from_len == 0) break; /* Empty from-strings sort last and never match */
+            if (pair->first != c || pair->from_len > remaining) continue;
+            if ((word & pair->prefix_mask) != pair->prefix) continue;
+            if (pair->from_len > 8 && !bytes_equal(current + 8, pair->from + 8, pair->from_len - 8, replace_list->ignore_case)) continue;
+            if (replace_list->whole_word && pair->from_len < remaining
+                && replace_list->word_chars[(unsigned char)current[pair->from_len]]) continue;
+            match->start = (size_t)(current - str);
+            match->len = pair->from_len;
+            match->pair = i;
+            return 1;
+        }
+        current++;
+    }
+    return 0;
+}
+
+/* Append the 'to' string of a matched pair, expanding group references in regex mode */
+static void append_replacement(ReplaceList *replace_list, const Match *match, const char *str, size_t len, int prev_byte, OutputBuffer *out) {
+    const ReplacePair *pair = &replace_list->pairs[match->pair];
+    size_t remaining = len - (match->start + match->len);
+    if (!pair->has_refs) {
+        /* Keep room for the rest of the input as well, so plain bytes need no checks */
+        output_reserve(out, pair->to_len + remaining + 1);
+        memcpy(out->data + out->len, pair->to, pair->to_len);
+        out->len += pair->to_len;
+        return;
+    }
+
+    const size_t *caps = regex_captures(replace_list->regex, match, str, len, prev_byte);
+    const char *to = pair->to;
+    const char *to_end = pair->to + pair->to_len;
+    while (to < to_end) {
+        const char *piece = to;
+        size_t piece_len = 1;
+        if (*to == '\\' && to + 1 < to_end && to[1] >= '0' && to[1] <= '9') {
+            int group = to[1] - '0';
+            piece_len = 0;
+            if (group < replace_list->regex->ngroups + 1 && caps[2 * group] != REGEX_UNSET && caps[2 * group + 1] != REGEX_UNSET) {
+                piece = str + caps[2 * group];
+                piece_len = caps[2 * group + 1] - caps[2 * group];
+            }
+            to += 2;
+        } else if (*to == '\\' && to + 1 < to_end && to[1] == '\\') {
+            to += 2;
+        } else {
+            to += 1;
+        }
+        output_reserve(out, piece_len + remaining + 1);
+        memcpy(out->data + out->len, piece, piece_len);
+        out->len += piece_len;
+    }
+}
+
+/* Check a pair at 'pos' in full, including the trailing word boundary in -w mode */
+static inline int pair_matches_at(const ReplaceList *replace_list, const ReplacePair *pair, const char *str, size_t len, size_t pos) {
+    if (pair->from_len > len - pos) return 0;
+    if (!bytes_equal(str + pos, pair->from, pair->from_len, replace_list->ignore_case)) return 0;
+    if (replace_list->whole_word && pos + pair->from_len < len
+        && replace_list->word_chars[(unsigned char)str[pos + pair->from_len]]) return 0;
+    return 1;
+}
+
+static inline uint64_t fdr_key_hash(uint64_t key, int bucket) {
+    return (key ^ (uint64_t)bucket) * 0x9E3779B97F4A7C15ULL;
+}
+
+/* Order verification entries by bucket, prefix key, then pair table position */
+static int compare_fdr_entries(const void *a, const void *b) {
+    const FdrEntry *ea = a;
+    const FdrEntry *eb = b;
+    if (ea->bucket != eb->bucket) return (ea->bucket > eb->bucket) - (ea->bucket < eb->bucket);
+    if (ea->key != eb->key) return (ea->key > eb->key) - (ea->key < eb->key);
+    return (ea->pair > eb->pair) - (ea->pair < eb->pair);
+}
+
+/* Build the bucketed shift-or masks and the per-bucket verification table */
+static int compile_fdr(ReplaceList *replace_list) {
+    Fdr *fdr = calloc(1, sizeof(Fdr));
+    if (!fdr) {
+        fprintf(stderr, "Memory allocation failed for fdr engine.\n");
+        return 1;
+    }
+    replace_list->fdr = fdr;
+
+    size_t count = 0;
+    while (count < replace_list->count && replace_list->pairs[count].from_len > 0) {
+        count++;
+    }
+    for (int c = 0; c < 256; c++) {
+        fdr->fold[c] = replace_list->ignore_case ? fold_byte((unsigned char)c) : (unsigned char)c;
+    }
+
+    /* Pairs are sorted longest first; buckets take ascending length ranges so short patterns share */
+    FdrEntry *entries = malloc((count ? count : 1) * sizeof(FdrEntry));
+    if (!entries) {
+        fprintf(stderr, "Memory allocation failed for fdr engine.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t rank = count - 1 - i;
+        int bucket = (int)(rank * FDR_BUCKETS / count);
+        size_t from_len = replace_list->pairs[i].from_len;
+        entries[i].bucket = bucket;
+        entries[i].pair = i;
+        if (fdr->prefix_len[bucket] == 0 || from_len < (size_t)fdr->prefix_len[bucket]) {
+            fdr->prefix_len[bucket] = from_len < 8 ? (int)from_len : 8;
+        }
+    }
+
+    /*
+       Lane j of bucket b is bit j * 8 + b. A bucket with prefix length m uses lanes
+       8 - m .. 7; lanes below are "don't care" and never report a mismatch. The first
+       used lane is keyed on one byte, the others on a hash of the byte and its
+       predecessor. An empty bucket keeps lane 7 mismatching forever.
+    */
+    for (int b = 0; b < FDR_BUCKETS; b++) {
+        int first_lane = fdr->prefix_len[b] ? 8 - fdr->prefix_len[b] : 7;
+        for (int lane = first_lane; lane < 8; lane++) {
+            uint64_t bit = 1ULL << (lane * 8 + b);
+            fdr->init |= bit;
+            if (lane == first_lane) {
+                for (int c = 0; c < 256; c++) fdr->single[c] |= bit;
+            } else {
+                for (int h = 0; h < FDR_DOMAIN; h++) fdr->pair[h] |= bit;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        const ReplacePair *pair = &replace_list->pairs[i];
+        int b = entries[i].bucket;
+        int m = fdr->prefix_len[b];
+        const unsigned char *from = (const unsigned char *)pair->from;
+        fdr->single[from[0]] &= ~(1ULL << ((8 - m) * 8 + b));
+        for (int j = 1; j < m; j++) {
+            fdr->pair[FDR_HASH(from[j - 1], from[j])] &= ~(1ULL << ((8 - m + j) * 8 + b));
+        }
+        uint64_t key = 0;
+        memcpy(&key, from, (size_t)m);
+        entries[i].key = key;
+    }
+
+    /* Group entries sharing a bucket and prefix; the group's first pair is the longest */
+    qsort(entries, count, sizeof(FdrEntry), compare_fdr_entries);
+    fdr->members = malloc((count ? count : 1) * sizeof(size_t));
+    fdr->groups = malloc((count ? count : 1) * sizeof(FdrGroup));
+    size_t table_size = 16;
+    while (table_size < count * 2) table_size *= 2;
+    fdr->table = malloc(table_size * sizeof(uint32_t));
+    if (!fdr->members || !fdr->groups || !fdr->table) {
+        free(entries);
+        fprintf(stderr, "Memory allocation failed for fdr engine.\n");
+        return 1;
+    }
+    memset(fdr->table, 0, table_size * sizeof(uint32_t));
+    fdr->table_mask = table_size - 1;
+    size_t ngroups = 0;
+    for (size_t i = 0; i < count; i++) {
+        fdr->members[i] = entries[i].pair;
+        if (i > 0 && entries[i].bucket == entries[i - 1].bucket && entries[i].key == entries[i - 1].key) {
+            fdr->groups[ngroups - 1].count++;
+            continue;
+        }
+        FdrGroup *group = &fdr->groups[ngroups++];
+        group->key = entries[i].key;
+        group->bucket = entries[i].bucket;
+        group->first = (uint32_t)i;
+        group->count = 1;
+        size_t slot = fdr_key_hash(group->key, group->bucket) & fdr->table_mask;
+        while (fdr->table[slot]) slot = (slot + 1) & fdr->table_mask;
+        fdr->table[slot] = (uint32_t)ngroups;
+    }
+    free(entries);
+    return 0;
+}
+
+/* Longest pair of one bucket matching at 'start', as a pair table position, or -1 */
+static long fdr_verify(const ReplaceList *replace_list, const char *str, size_t len, size_t start, int bucket) {
+    const Fdr *fdr = replace_list->fdr;
+    size_t m = (size_t)fdr->prefix_len[bucket];
+    if (m > len - start) return -1;
+    uint64_t key = 0;
+    memcpy(&key, str + start, m);
+    if (replace_list->ignore_case) key = fold_word(key);
+
+    size_t slot = fdr_key_hash(key, bucket) & fdr->table_mask;
+    for (; fdr->table[slot]; slot = (slot + 1) & fdr->table_mask) {
+        const FdrGroup *group = &fdr->groups[fdr->table[slot] - 1];
+        if (group->key != key || group->bucket != bucket) continue;
+        for (uint32_t k = 0; k < group->count; k++) {
+            size_t index = fdr->members[group->first + k];
+            if (pair_matches_at(replace_list, &replace_list->pairs[index], str, len, start)) {
+                return (long)index;
+            }
+        }
+        break;
+    }
+    return -1;
+}
+
+/* Verify every bucket flagged for a start position; the lowest table position is the longest match */
+static int fdr_resolve(const ReplaceList *replace_list, const char *str, size_t len, size_t start, unsigned buckets, int prev_byte, Match *match) {
+    if (replace_list->whole_word) {
+        int before = (start > 0) ? (unsigned char)str[start - 1] : prev_byte;
+        if (before >= 0 && replace_list->word_chars[before]) return 0;
+    }
+    long best = -1;
+    for (; buckets; buckets &= buckets - 1) {
+        long index = fdr_verify(replace_list, str, len, start, __builtin_ctz(buckets));
+        if (index >= 0 && (best < 0 || index < best)) best = index;
+    }
+    if (best < 0) return 0;
+    match->start = start;
+    match->len = replace_list->pairs[best].from_len;
+    match->pair = (size_t)best;
+    return 1;
+}
+
+/*
+   Bucketed shift-or scan: one pass updates eight buckets x eight lanes in a 64-bit
+   state. Lane 7 of a bucket clearing means the text may hold one of its prefixes,
+   ending here. Candidate starts wait in a small ring until every bucket has had
+   the chance to report them, so they are verified strictly left to right.
+*/
+static int find_fdr(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match) {
+    const Fdr *fdr = replace_list->fdr;
+    const unsigned char *text = (const unsigned char *)str;
+    unsigned char ring[8] = {0};
+    unsigned pending = 0;
+    uint64_t state = fdr->init;
+    unsigned char prev = pos > 0 ? fdr->fold[text[pos - 1]] : 0;
+
+    for (size_t i = pos; i < len; i++) {
+        unsigned char c = fdr->fold[text[i]];
+        state = (state << 8) | fdr->single[c] | fdr->pair[FDR_HASH(prev, c)];
+        prev = c;
+
+        uint64_t hits = ~state & FDR_LANE7;
+        for (; hits; hits &= hits - 1) {
+            int bucket = __builtin_ctzll(hits) - 56;
+            size_t start = i + 1 - (size_t)fdr->prefix_len[bucket];
+            ring[start & 7] |= (unsigned char)(1u << bucket);
+            pending |= 1u << (start & 7);
+        }
+
+        /* Every bucket has reported the start seven bytes back */
+        if (i >= pos + 7 && (pending & (1u << ((i - 7) & 7)))) {
+            size_t start = i - 7;
+            unsigned buckets = ring[start & 7];
+            ring[start & 7] = 0;
+            pending &= ~(1u << (start & 7));
+            if (fdr_resolve(replace_list, str, len, start, buckets, prev_byte, match)) return 1;
+        }
+    }
+
+    /* Drain the starts still waiting at the end of the text, in order */
+    size_t start = (len > pos + 7) ? len - 7 : pos;
+    for (; pending && start < len; start++) {
+        unsigned buckets = ring[start & 7];
+        if (!buckets) continue;
+        ring[start & 7] = 0;
+        pending &= ~(1u << (start & 7));
+        if (fdr_resolve(replace_list, str, len, start, buckets, prev_byte, match)) return 1;
+    }
+    return 0;
+}
+
+static void free_fdr(Fdr *fdr) {
+    if (!fdr) {
+        return;
+    }
+    free(fdr->members);
+    free(fdr->groups);
+    free(fdr->table);
+    free(fdr);
+}
+
+/* Finalizer of a 64-bit hash (MurmurHash3 fmix64) */
+static inline uint64_t phash_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Hash a key a word at a time, folding case with -i so both cases of the text agree */
+static inline uint64_t phash_key(const char *key, size_t len, uint64_t seed, int ignore_case) {
+    uint64_t h = seed ^ (len * 0x9E3779B97F4A7C15ULL);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, key + i, 8);
+        if (ignore_case) word = fold_word(word);
+        h = (h ^ word) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, key + i, len - i);
+        if (ignore_case) word = fold_word(word);
+        h = (h ^ word) * 0x9E3779B97F4A7C15ULL;
+    }
+    return phash_mix(h);
+}
+
+static inline size_t phash_bucket(const PerfectHash *ph, uint64_t h) {
+    return (size_t)((h >> 32) % ph->nbuckets);
+}
+
+static inline size_t phash_slot(const PerfectHash *ph, uint64_t h, uint32_t pilot) {
+    return (size_t)(phash_mix(h ^ (ph->seed + pilot)) % ph->table_size);
+}
+
+/* Order key positions by hash so duplicates become neighbours */
+static const uint64_t *phash_sort_hashes;
+
+static int compare_phash_keys(const void *a, const void *b) {
+    uint64_t ha = phash_sort_hashes[*(const size_t *)a];
+    uint64_t hb = phash_sort_hashes[*(const size_t *)b];
+    if (ha != hb) return (ha > hb) - (ha < hb);
+    return (*(const size_t *)a > *(const size_t *)b) - (*(const size_t *)a < *(const size_t *)b);
+}
+
+/*
+   Hash-and-displace placement (as in PTHash): keys are hashed into buckets of a
+   few keys each, and buckets, largest first, search for a pilot value that
+   sends all their keys to free slots. Returns 0 on success, 1 when the seed
+   needs changing.
+*/
+static int phash_place(PerfectHash *ph, const uint64_t *hashes, const size_t *keys, size_t nkeys) {
+    size_t *bucket_start = calloc(ph->nbuckets + 1, sizeof(size_t));
+    size_t *bucket_keys = malloc(nkeys * sizeof(size_t));
+    size_t *order = malloc(ph->nbuckets * sizeof(size_t));
+    size_t *size_start = NULL;
+    unsigned char *taken = calloc(ph->table_size, 1);
+    int result = 1;
+    if (!bucket_start || !bucket_keys || !order || !taken) goto done;
+
+    /* Counting sort of keys by bucket, then of buckets by size (largest first) */
+    size_t max_size = 0;
+    for (size_t k = 0; k < nkeys; k++) {
+        bucket_start[phash_bucket(ph, hashes[keys[k]]) + 1]++;
+    }
+    for (size_t b = 0; b < ph->nbuckets; b++) {
+        if (bucket_start[b + 1] > max_size) max_size = bucket_start[b + 1];
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    size_t *fill = order;
+    memcpy(fill, bucket_start, ph->nbuckets * sizeof(size_t));
+    for (size_t k = 0; k < nkeys; k++) {
+        bucket_keys[fill[phash_bucket(ph, hashes[keys[k]])]++] = keys[k];
+    }
+    size_start = calloc(max_size + 2, sizeof(size_t));
+    if (!size_start) goto done;
+    for (size_t b = 0; b < ph->nbuckets; b++) {
+        size_start[max_size - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+    }
+    for (size_t s = 0; s <= max_size; s++) {
+        size_start[s + 1] += size_start[s];
+    }
+    for (size_t b = 0; b < ph->nbuckets; b++) {
+        order[size_start[max_size - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+    }
+
+    size_t slots[64];
+    for (size_t i = 0; i < ph->nbuckets; i++) {
+        size_t b = order[i];
+        size_t first = bucket_start[b];
+        size_t size = bucket_start[b + 1] - first;
+        if (size == 0) break;
+        if (size > 64) goto done;
+        uint32_t pilot = 0;
+        for (;; pilot++) {
+            if (pilot >= PHASH_MAX_PILOT) goto done;
+            size_t k = 0;
+            for (; k < size; k++) {
+                slots[k] = phash_slot(ph, hashes[bucket_keys[first + k]], pilot);
+                if (taken[slots[k]]) break;
+                size_t j = 0;
+                while (j < k && slots[j] != slots[k]) j++;
+                if (j < k) break;
+            }
+            if (k == size) break;
+        }
+        ph->pilots[b] = pilot;
+        for (size_t k = 0; k < size; k++) {
+            taken[slots[k]] = 1;
+            ph->slots[slots[k]] = (uint32_t)bucket_keys[first + k] + 1;
+        }
+    }
+    result = 0;
+
+done:
+    free(bucket_start);
+    free(bucket_keys);
+    free(order);
+    free(size_start);
+    free(taken);
+    return result;
+}
+
+/* Build the perfect hash over the first 'count' pairs; 'member' is the byte class matches are made of */
+static int build_phash(ReplaceList *replace_list, size_t count, size_t key_len, const unsigned char member[256]) {
+    PerfectHash *ph = calloc(1, sizeof(PerfectHash));
+    uint64_t *hashes = malloc((count ? count : 1) * sizeof(uint64_t));
+    size_t *keys = malloc((count ? count : 1) * sizeof(size_t));
+    replace_list->phash = ph;
+    if (!ph || !hashes || !keys) {
+        free(hashes);
+        free(keys);
+        fprintf(stderr, "Memory allocation failed for hash engine.\n");
+        return 1;
+    }
+    ph->key_len = key_len;
+    ph->nbuckets = count / 4 + 1;
+    ph->table_size = count + count / 16 + 1;
+    ph->pilots = malloc(ph->nbuckets * sizeof(uint32_t));
+    ph->slots = malloc(ph->table_size * sizeof(uint32_t));
+    if (!ph->pilots || !ph->slots) {
+        free(hashes);
+        free(keys);
+        fprintf(stderr, "Memory allocation failed for hash engine.\n");
+        return 1;
+    }
+    build_prefilter(&ph->key_bytes, member);
+
+    int placed = 0;
+    for (uint64_t attempt = 0; attempt < PHASH_MAX_SEEDS && !placed; attempt++) {
+        ph->seed = phash_mix(attempt + 0x5eed);
+        for (size_t i = 0; i < count; i++) {
+            hashes[i] = phash_key(replace_list->pairs[i].from, replace_list->pairs[i].from_len, ph->seed, 0);
+            keys[i] = i;
+        }
+
+        /* A repeated key keeps its first-given pair; a true collision needs another seed */
+        phash_sort_hashes = hashes;
+        qsort(keys, count, sizeof(size_t), compare_phash_keys);
+        size_t nkeys = 0;
+        int collision = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (nkeys > 0 && hashes[keys[nkeys - 1]] == hashes[keys[i]]) {
+                const ReplacePair *kept = &replace_list->pairs[keys[nkeys - 1]];
+                const ReplacePair *pair = &replace_list->pairs[keys[i]];
+                if (kept->from_len != pair->from_len || memcmp(kept->from, pair->from, pair->from_len) != 0) {
+                    collision = 1;
+                    break;
+                }
+                continue;
+            }
+            keys[nkeys++] = keys[i];
+        }
+        if (collision) continue;
+
+        memset(ph->pilots, 0, ph->nbuckets * sizeof(uint32_t));
+        memset(ph->slots, 0, ph->table_size * sizeof(uint32_t));
+        placed = !phash_place(ph, hashes, keys, nkeys);
+    }
+    free(hashes);
+    free(keys);
+    if (!placed) {
+        fprintf(stderr, "Error: Could not build a perfect hash for the from-strings.\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Perfect hash over equal-length 'from' strings, scanning runs of the bytes they use */
+static int compile_phash(ReplaceList *replace_list) {
+    size_t count = 0;
+    while (count < replace_list->count && replace_list->pairs[count].from_len > 0) {
+        count++;
+    }
+    size_t key_len = count ? replace_list->pairs[0].from_len : 0;
+    if (count == 0 || replace_list->pairs[count - 1].from_len != key_len) {
+        fprintf(stderr, "Error: The hash engine needs from-strings of a single length.\n");
+        return 1;
+    }
+
+    /* Every byte of every key; with -i keys are folded, so admit both cases */
+    unsigned char member[256] = {0};
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *from = (const unsigned char *)replace_list->pairs[i].from;
+        for (size_t k = 0; k < key_len; k++) {
+            member[from[k]] = 1;
+            if (replace_list->ignore_case && from[k] >= 'a' && from[k] <= 'z') {
+                member[from[k] - 'a' + 'A'] = 1;
+            }
+        }
+    }
+    return build_phash(replace_list, count, key_len, member);
+}
+
+/* Perfect hash over token 'from' strings; every from-string must be a single token */
+static int compile_tokens(ReplaceList *replace_list) {
+    size_t count = 0;
+    while (count < replace_list->count && replace_list->pairs[count].from_len > 0) {
+        count++;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const ReplacePair *pair = &replace_list->pairs[i];
+        for (size_t k = 0; k < pair->from_len; k++) {
+            unsigned char c = (unsigned char)pair->from[k];
+            int upper = (replace_list->ignore_case && c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+            if (!replace_list->word_chars[c] && !replace_list->word_chars[upper]) {
+                fprintf(stderr, "Error: --tokens: '%.*s' is not a single token.\n", (int)pair->from_len, pair->from);
+                return 1;
+            }
+        }
+    }
+    return build_phash(replace_list, count, 0, replace_list->word_chars);
+}
+
+/*
+   Every match lies inside a run of key bytes at least key_len long, so the scan
+   jumps from run to run with the vector kernels and looks up each window of a
+   run in the perfect hash; one probe and one compare decide a window.
+*/
+static int find_phash(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match) {
+    const PerfectHash *ph = replace_list->phash;
+    const char *end = str + len;
+    const char *current = str + pos;
+    size_t key_len = ph->key_len;
+
+    while (current < end) {
+        const char *run = kernels->find_first(current, end, &ph->key_bytes);
+        if (run == end) break;
+        const char *run_end = kernels->find_outside(run, end, &ph->key_bytes);
+        for (const char *window = run; window + key_len <= run_end; window++) {
+            uint64_t h = phash_key(window, key_len, ph->seed, replace_list->ignore_case);
+            uint32_t entry = ph->slots[phash_slot(ph, h, ph->pilots[phash_bucket(ph, h)])];
+            if (!entry) continue;
+            size_t start = (size_t)(window - str);
+            if (replace_list->whole_word) {
+                int before = (start > 0) ? (unsigned char)str[start - 1] : prev_byte;
+                if (before >= 0 && replace_list->word_chars[before]) continue;
+            }
+            if (!pair_matches_at(replace_list, &replace_list->pairs[entry - 1], str, len, start)) continue;
+            match->start = start;
+            match->len = key_len;
+            match->pair = entry - 1;
+            return 1;
+        }
+        current = run_end;
+    }
+    return 0;
+}
+
+/*
+   Token mode: tokens are maximal runs of word characters, found with the vector
+   class kernels; each costs one hash probe however many pairs there are.
+*/
+static int find_tokens(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match) {
+    const PerfectHash *ph = replace_list->phash;
+    const char *end = str + len;
+    const char *current = str + pos;
+
+    /* The tail of a token that started before pos is not a token */
+    int before = (pos > 0) ? (unsigned char)str[pos - 1] : prev_byte;
+    if (before >= 0 && replace_list->word_chars[before]) {
+        current = kernels->find_outside(current, end, &ph->key_bytes);
+    }
+
+    while (current < end) {
+        const char *token = kernels->find_first(current, end, &ph->key_bytes);
+        if (token == end) break;
+        const char *token_end = kernels->find_outside(token, end, &ph->key_bytes);
+        size_t token_len = (size_t)(token_end - token);
+        uint64_t h = phash_key(token, token_len, ph->seed, replace_list->ignore_case);
+        uint32_t entry = ph->slots[phash_slot(ph, h, ph->pilots[phash_bucket(ph, h)])];
+        if (entry) {
+            const ReplacePair *pair = &replace_list->pairs[entry - 1];
+            if (pair->from_len == token_len && bytes_equal(token, pair->from, token_len, replace_list->ignore_case)) {
+                match->start = (size_t)(token - str);
+                match->len = token_len;
+                match->pair = entry - 1;
+                return 1;
+            }
+        }
+        current = token_end;
+    }
+    return 0;
+}
+
+static void free_phash(PerfectHash *ph) {
+    if (!ph) {
+        return;
+    }
+    free(ph->pilots);
+    free(ph->slots);
+    free(ph);
+}
+
+/* Order rolling-hash entries by window hash, then pair table position */
+static int compare_rolling_entries(const void *a, const void *b) {
+    const RollingEntry *ea = a;
+    const RollingEntry *eb = b;
+    if (ea->hash != eb->hash) return (ea->hash > eb->hash) - (ea->hash < eb->hash);
+    return (ea->pair > eb->pair) - (ea->pair < eb->pair);
+}
+
+static inline size_t rolling_slot(const Rolling *rk, uint64_t hash) {
+    return (size_t)((hash * 0x9E3779B97F4A7C15ULL) >> 32) & rk->table_mask;
+}
+
+/* Hash the first 'window' bytes of every pattern and group patterns sharing that hash */
+static int compile_rolling(ReplaceList *replace_list) {
+    Rolling *rk = calloc(1, sizeof(Rolling));
+    replace_list->rolling = rk;
+    if (!rk) {
+        fprintf(stderr, "Memory allocation failed for rolling hash engine.\n");
+        return 1;
+    }
+
+    size_t count = 0;
+    while (count < replace_list->count && replace_list->pairs[count].from_len > 0) {
+        count++;
+    }
+    rk->window = count ? replace_list->pairs[count - 1].from_len : 1;
+    rk->drop = 1;
+    for (size_t k = 1; k < rk->window; k++) {
+        rk->drop *= ROLLING_BASE;
+    }
+    for (int c = 0; c < 256; c++) {
+        rk->fold[c] = replace_list->ignore_case ? fold_byte((unsigned char)c) : (unsigned char)c;
+    }
+
+    RollingEntry *entries = malloc((count ? count : 1) * sizeof(RollingEntry));
+    size_t table_size = 16;
+    while (table_size < count * 2) table_size *= 2;
+    rk->members = malloc((count ? count : 1) * sizeof(size_t));
+    rk->groups = malloc((count ? count : 1) * sizeof(RollingGroup));
+    rk->table = calloc(table_size, sizeof(uint32_t));
+    if (!entries || !rk->members || !rk->groups || !rk->table) {
+        free(entries);
+        fprintf(stderr, "Memory allocation failed for rolling hash engine.\n");
+        return 1;
+    }
+    rk->table_mask = table_size - 1;
+
+    /* Patterns are stored folded with -i, so their window hashes need no folding */
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *from = (const unsigned char *)replace_list->pairs[i].from;
+        uint64_t hash = 0;
+        for (size_t k = 0; k < rk->window; k++) {
+            hash = hash * ROLLING_BASE + from[k];
+        }
+        entries[i].hash = hash;
+        entries[i].pair = i;
+        rk->filter[hash >> 54] |= 1ULL << ((hash >> 32) & 63);
+    }
+    qsort(entries, count, sizeof(RollingEntry), compare_rolling_entries);
+
+    size_t ngroups = 0;
+    for (size_t i = 0; i < count; i++) {
+        rk->members[i] = entries[i].pair;
+        if (i > 0 && entries[i].hash == entries[i - 1].hash) {
+            rk->groups[ngroups - 1].count++;
+            continue;
+        }
+        RollingGroup *group = &rk->groups[ngroups++];
+        group->hash = entries[i].hash;
+        group->first = (uint32_t)i;
+        group->count = 1;
+        size_t slot = rolling_slot(rk, group->hash);
+        while (rk->table[slot]) slot = (slot + 1) & rk->table_mask;
+        rk->table[slot] = (uint32_t)ngroups;
+    }
+    free(entries);
+    return 0;
+}
+
+/*
+   Rabin-Karp: a polynomial hash of the window at every position is updated in
+   constant time, however long the patterns are; a bit filter rejects most
+   windows before the table, and full compares run only on hash hits.
+*/
+static int find_rolling(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match) {
+    const Rolling *rk = replace_list->rolling;
+    const unsigned char *text = (const unsigned char *)str;
+    size_t window = rk->window;
+    if (len < window || len - window < pos) {
+        return 0;
+    }
+
+    uint64_t hash = 0;
+    for (size_t k = 0; k < window; k++) {
+        hash = hash * ROLLING_BASE + rk->fold[text[pos + k]];
+    }
+    for (size_t start = pos;; start++) {
+        if (rk->filter[hash >> 54] & (1ULL << ((hash >> 32) & 63))) {
+            for (size_t slot = rolling_slot(rk, hash); rk->table[slot]; slot = (slot + 1) & rk->table_mask) {
+                const RollingGroup *group = &rk->groups[rk->table[slot] - 1];
+                if (group->hash != hash) continue;
+                int before = (start > 0) ? text[start - 1] : prev_byte;
+                if (replace_list->whole_word && before >= 0 && replace_list->word_chars[before]) break;
+                for (uint32_t k = 0; k < group->count; k++) {
+                    size_t index = rk->members[group->first + k];
+                    if (pair_matches_at(replace_list, &replace_list->pairs[index], str, len, start)) {
+                        match->start = start;
+                        match->len = replace_list->pairs[index].from_len;
+                        match->pair = index;
+                        return 1;
+                    }
+                }
+                break;
+            }
+        }
+        if (start + window >= len) break;
+        hash = (hash - rk->fold[text[start]] * rk->drop) * ROLLING_BASE + rk->fold[text[start + window]];
+    }
+    return 0;
+}
+
+static void free_rolling(Rolling *rk) {
+    if (!rk) {
+        return;
+    }
+    free(rk->members);
+    free(rk->groups);
+    free(rk->table);
+    free(rk);
+}
+
+/* Trie node while the keys are inserted: children are kept in label order */
+typedef struct {
+    uint32_t first_child;
+    uint32_t last_child;
+    uint32_t next_sibling;
+    uint32_t out;
+    uint32_t depth;
+    uint32_t count;       /* Children */
+    unsigned char label;
+} AcNode;
+
+/* Pattern reference sorted by bytes, so the trie is built from shared prefixes */
+typedef struct {
+    const char *from;
+    size_t len;
+    uint32_t pair;
+} AcKey;
+
+/* Keys [first, end) sharing no first byte with the others, inserted into nodes from 'base' on by one thread */
+typedef struct {
+    const AcKey *keys;
+    size_t first;
+    size_t end;
+    AcNode *nodes;
+    uint32_t base;
+    uint32_t *path;       /* Node at each depth of the key being inserted */
+    uint32_t top_first;   /* The slice's children of the root, linked in after all slices are done */
+    uint32_t top_last;
+    uint32_t top_count;
+} AcSlice;
+
+/*
+   The trie renumbered breadth-first. The children of a node are then
+   consecutive, so finding one scans a few contiguous labels instead of
+   chasing siblings through memory, and every depth is a contiguous range.
+*/
+typedef struct {
+    uint32_t count;
+    uint32_t *parent;
+    uint32_t *first;      /* First child */
+    uint32_t *children;   /* Number of children */
+    unsigned char *label;
+    uint32_t *out;
+    uint32_t *depth;
+    uint32_t *fail;
+    uint32_t *dict;
+    uint32_t root_child[256];
+} AcTrie;
+
+/* Nodes [lo, hi) of one depth, whose failure links are computed in parallel */
+typedef struct {
+    AcTrie *trie;
+    uint32_t lo;
+    uint32_t hi;
+} AcLevel;
+
+/* Trie nodes in their new order, copied into the automaton in parallel */
+typedef struct {
+    const AcTrie *trie;
+    AhoCorasick *ac;
+    const uint32_t *order;
+    const uint32_t *id;
+} AcLayout;
+
+static int compare_ac_keys(const void *a, const void *b) {
+    const AcKey *ka = a;
+    const AcKey *kb = b;
+    size_t n = ka->len < kb->len ? ka->len : kb->len;
+    int order = memcmp(ka->from, kb->from, n);
+    if (order != 0) return order;
+    if (ka->len != kb->len) return (ka->len > kb->len) - (ka->len < kb->len);
+    return (ka->pair > kb->pair) - (ka->pair < kb->pair);
+}
+
+/* Child of a trie node on a byte, AC_NONE if there is none */
+static inline uint32_t ac_trie_child(const AcTrie *trie, uint32_t node, unsigned char c) {
+    if (node == 0) {
+        return trie->root_child[c];
+    }
+    const unsigned char *labels = trie->label + trie->first[node];
+    uint32_t lo = 0, hi = trie->children[node];
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (labels[mid] < c) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < trie->children[node] && labels[lo] == c) ? trie->first[node] + lo : AC_NONE;
+}
+
+/* Next state on a byte through the sparse rows, following failure links; the root is state 0 */
+static inline uint32_t ac_sparse_next(const AhoCorasick *ac, uint32_t state, unsigned char c) {
+    for (;;) {
+        const AcState *st = &ac->states[state];
+        if (st->count > AC_SPARSE_MAX) {
+            const uint64_t *bits = ac->bitmaps + 4 * (size_t)st->bitmap;
+            uint64_t bit = 1ULL << (c & 63);
+            if (bits[c >> 6] & bit) {
+                uint32_t rank = (uint32_t)__builtin_popcountll(bits[c >> 6] & (bit - 1));
+                for (int w = 0; w < (c >> 6); w++) {
+                    rank += (uint32_t)__builtin_popcountll(bits[w]);
+                }
+                return ac->targets[st->edges + rank];
+            }
+        } else {
+            const unsigned char *labels = ac->labels + st->edges;
+            for (uint32_t k = 0; k < st->count && labels[k] <= c; k++) {
+                if (labels[k] == c) return ac->targets[st->edges + k];
+            }
+        }
+        if (state == 0) {
+            return 0;
+        }
+        state = st->fail;
+        if (state < ac->ndense) {
+            return ac->dense[((size_t)state << 8) | c];
+        }
+    }
+}
+
+static inline uint32_t ac_next(const AhoCorasick *ac, uint32_t state, unsigned char c) {
+    if (state < ac->ndense) {
+        return ac->dense[((size_t)state << 8) | c];
+    }
+    return ac_sparse_next(ac, state, c);
+}
+
+/* Visits per trie node over the input sample, stepping through the build-time trie */
+static void ac_profile(const AcTrie *trie, const unsigned char *fold, const char *sample, size_t sample_len, uint64_t *visits) {
+    uint32_t node = 0;
+    for (size_t i = 0; i < sample_len; i++) {
+        unsigned char c = fold[(unsigned char)sample[i]];
+        uint32_t next;
+        while ((next = ac_trie_child(trie, node, c)) == AC_NONE && node != 0) {
+            node = trie->fail[node];
+        }
+        node = (next == AC_NONE) ? 0 : next;
+        visits[node]++;
+    }
+}
+
+/* Insert one slice of the sorted keys: each shares the path of its common prefix with the previous one */
+static void ac_build_slice(void *arg, size_t part, size_t parts) {
+    AcSlice *slice = &((AcSlice *)arg)[part];
+    const AcKey *keys = slice->keys;
+    AcNode *nodes = slice->nodes;
+    uint32_t next = slice->base;
+    uint32_t *path = slice->path;
+    size_t path_len = 0;
+    (void)parts;
+
+    path[0] = 0;
+    slice->top_first = slice->top_last = AC_NONE;
+    slice->top_count = 0;
+    for (size_t k = slice->first; k < slice->end; k++) {
+        size_t shared = 0;
+        if (k > slice->first) {
+            size_t n = keys[k].len < path_len ? keys[k].len : path_len;
+            while (shared < n && keys[k].from[shared] == keys[k - 1].from[shared]) shared++;
+        }
+        for (size_t d = shared; d < keys[k].len; d++) {
+            uint32_t parent = path[d];
+            AcNode *node = &nodes[next];
+            node->first_child = node->last_child = node->next_sibling = AC_NONE;
+            node->out = AC_NONE;
+            node->depth = (uint32_t)d + 1;
+            node->count = 0;
+            node->label = (unsigned char)keys[k].from[d];
+            if (parent == 0) {
+                /* Other slices add children to the root at the same time */
+                if (slice->top_last == AC_NONE) slice->top_first = next;
+                else nodes[slice->top_last].next_sibling = next;
+                slice->top_last = next;
+                slice->top_count++;
+            } else {
+                if (nodes[parent].last_child == AC_NONE) nodes[parent].first_child = next;
+                else nodes[nodes[parent].last_child].next_sibling = next;
+                nodes[parent].last_child = next;
+                nodes[parent].count++;
+            }
+            path[d + 1] = next++;
+        }
+        path_len = keys[k].len;
+        /* Duplicates sort by pair position, so the first one keeps the state */
+        if (nodes[path[path_len]].out == AC_NONE) {
+            nodes[path[path_len]].out = keys[k].pair;
+        }
+    }
+}
+
+/* Failure and dictionary links of a share of one depth; those of shallower nodes are done */
+static void ac_fail_part(void *arg, size_t part, size_t parts) {
+    const AcLevel *level = arg;
+    AcTrie *trie = level->trie;
+    uint32_t lo = level->lo + (uint32_t)((uint64_t)(level->hi - level->lo) * part / parts);
+    uint32_t hi = level->lo + (uint32_t)((uint64_t)(level->hi - level->lo) * (part + 1) / parts);
+    for (uint32_t v = lo; v < hi; v++) {
+        uint32_t u = trie->parent[v];
+        uint32_t f = 0;
+        if (u != 0) {
+            for (uint32_t w = trie->fail[u];; w = trie->fail[w]) {
+                uint32_t child = ac_trie_child(trie, w, trie->label[v]);
+                if (child != AC_NONE) {
+                    f = child;
+                    break;
+                }
+                if (w == 0) break;
+            }
+        }
+        trie->fail[v] = f;
+        trie->dict[v] = (trie->out[f] != AC_NONE) ? f : trie->dict[f];
+    }
+}
+
+/* Copy a share of the states into the automaton; edge and bitmap positions are already assigned */
+static void ac_layout_part(void *arg, size_t part, size_t parts) {
+    const AcLayout *layout = arg;
+    const AcTrie *trie = layout->trie;
+    AhoCorasick *ac = layout->ac;
+    uint32_t lo = (uint32_t)((uint64_t)trie->count * part / parts);
+    uint32_t hi = (uint32_t)((uint64_t)trie->count * (part + 1) / parts);
+    for (uint32_t i = lo; i < hi; i++) {
+        uint32_t v = layout->order[i];
+        AcState *st = &ac->states[i];
+        st->count = (uint16_t)trie->children[v];
+        st->fail = layout->id[trie->fail[v]];
+        st->has_match = (trie->out[v] != AC_NONE || trie->dict[v] != AC_NONE);
+        for (uint32_t k = 0; k < trie->children[v]; k++) {
+            uint32_t child = trie->first[v] + k;
+            ac->labels[st->edges + k] = trie->label[child];
+            ac->targets[st->edges + k] = layout->id[child];
+            if (st->bitmap != AC_NONE) {
+                ac->bitmaps[4 * (size_t)st->bitmap + (trie->label[child] >> 6)] |= 1ULL << (trie->label[child] & 63);
+            }
+        }
+        ac->out[i] = trie->out[v];
+        ac->dict[i] = (trie->dict[v] == AC_NONE) ? AC_NONE : layout->id[trie->dict[v]];
+        ac->depth[i] = trie->depth[v];
+    }
+}
+
+static void free_ac_trie(AcTrie *trie) {
+    free(trie->parent);
+    free(trie->first);
+    free(trie->children);
+    free(trie->label);
+    free(trie->out);
+    free(trie->depth);
+    free(trie->fail);
+    free(trie->dict);
+}
+
+/*
+   Insert the sorted keys into a trie, in parallel slices that share no
+   first byte; renumber it breadth-first; add failure and dictionary links
+   one depth at a time, each depth in parallel.
+*/
+static int build_ac_trie(ReplaceList *replace_list, AcKey *keys, size_t nkeys, size_t total_len, AcTrie *trie) {
+    AcNode *nodes = malloc((total_len + 1) * sizeof(AcNode));
+    uint32_t *queue = malloc((total_len + 1) * sizeof(uint32_t));
+    uint32_t *levels = malloc((replace_list->max_from_len + 2) * sizeof(uint32_t));
+    size_t parts = build_parts(replace_list, nkeys);
+    uint32_t *paths = malloc(parts * (replace_list->max_from_len + 1) * sizeof(uint32_t));
+    if (!nodes || !queue || !levels || !paths) {
+        fprintf(stderr, "Memory allocation failed for ac engine.\n");
+        free(nodes);
+        free(queue);
+        free(levels);
+        free(paths);
+        return 1;
+    }
+
+    AcSlice slices[BUILD_MAX_THREADS];
+    size_t nslices = 0;
+    uint32_t base = 1;
+    for (size_t k = 0; k < nkeys; nslices++) {
+        size_t end = (nslices + 1 == parts) ? nkeys : nkeys * (nslices + 1) / parts;
+        if (end <= k) end = k + 1;
+        while (end < nkeys && keys[end].from[0] == keys[end - 1].from[0]) end++;
+        AcSlice *slice = &slices[nslices];
+        slice->keys = keys;
+        slice->first = k;
+        slice->end = end;
+        slice->nodes = nodes;
+        slice->base = base;
+        slice->path = paths + nslices * (replace_list->max_from_len + 1);
+        for (; k < end; k++) {
+            base += (uint32_t)keys[k].len;
+        }
+    }
+    run_parts(ac_build_slice, slices, nslices);
+    free(paths);
+
+    AcNode *root = &nodes[0];
+    memset(root, 0, sizeof(AcNode));
+    root->first_child = root->last_child = root->next_sibling = AC_NONE;
+    root->out = AC_NONE;
+    for (size_t s = 0; s < nslices; s++) {
+        if (slices[s].top_count == 0) continue;
+        if (root->last_child == AC_NONE) root->first_child = slices[s].top_first;
+        else nodes[root->last_child].next_sibling = slices[s].top_first;
+        root->last_child = slices[s].top_last;
+        root->count += slices[s].top_count;
+    }
+
+    /* Breadth-first: the children of each node are enqueued together, in label order */
+    trie->parent = malloc((total_len + 1) * sizeof(uint32_t));
+    trie->first = malloc((total_len + 1) * sizeof(uint32_t));
+    if (!trie->parent || !trie->first) {
+        fprintf(stderr, "Memory allocation failed for ac engine.\n");
+        free(nodes);
+        free(queue);
+        free(levels);
+        return 1;
+    }
+    uint32_t head = 0, tail = 0;
+    queue[tail++] = 0;
+    trie->parent[0] = 0;
+    while (head < tail) {
+        trie->first[head] = tail;
+        for (uint32_t child = nodes[queue[head]].first_child; child != AC_NONE; child = nodes[child].next_sibling) {
+            trie->parent[tail] = head;
+            queue[tail++] = child;
+        }
+        head++;
+    }
+    trie->count = tail;
+    trie->children = malloc(tail * sizeof(uint32_t));
+    trie->label = malloc(tail);
+    trie->out = malloc(tail * sizeof(uint32_t));
+    trie->depth = malloc(tail * sizeof(uint32_t));
+    trie->fail = malloc(tail * sizeof(uint32_t));
+    trie->dict = malloc(tail * sizeof(uint32_t));
+    if (!trie->children || !trie->label || !trie->out || !trie->depth || !trie->fail || !trie->dict) {
+        fprintf(stderr, "Memory allocation failed for ac engine.\n");
+        free(nodes);
+        free(queue);
+        free(levels);
+        return 1;
+    }
+    uint32_t max_depth = 0;
+    for (uint32_t i = 0; i < tail; i++) {
+        const AcNode *node = &nodes[queue[i]];
+        trie->children[i] = node->count;
+        trie->label[i] = node->label;
+        trie->out[i] = node->out;
+        trie->depth[i] = node->depth;
+        while (max_depth < node->depth) {
+            levels[++max_depth] = i;
+        }
+    }
+    levels[max_depth + 1] = tail;
+    free(nodes);
+    free(queue);
+    for (int c = 0; c < 256; c++) {
+        trie->root_child[c] = AC_NONE;
+    }
+    for (uint32_t k = 0; k < trie->children[0]; k++) {
+        trie->root_child[trie->label[trie->first[0] + k]] = trie->first[0] + k;
+    }
+    progress(replace_list, "trie of %u states", trie->count);
+
+    trie->fail[0] = 0;
+    trie->dict[0] = AC_NONE;
+    for (uint32_t depth = 1; depth <= max_depth; depth++) {
+        AcLevel level = {trie, levels[depth], levels[depth + 1]};
+        run_parts(ac_fail_part, &level, build_parts(replace_list, level.hi - level.lo));
+    }
+    free(levels);
+    progress(replace_list, "failure links to depth %u", max_depth);
+    return 0;
+}
+
+/*
+   Build the automaton: the trie with its failure and dictionary links, then
+   the states renumbered hottest first and laid out as dense rows, sparse
+   edge lists and bitmap rows. Keys that fold to the same bytes end in one
+   state, which keeps the first pair.
+*/
+static int compile_ac(ReplaceList *replace_list) {
+    size_t nkeys = 0, total_len = 0;
+    for (size_t i = 0; i < replace_list->count; i++) {
+        if (replace_list->pairs[i].from_len > 0) {
+            nkeys++;
+            total_len += replace_list->pairs[i].from_len;
+        }
+    }
+    if (total_len >= AC_NONE - 1) {
+        fprintf(stderr, "Error: from-strings too large for the ac engine.\n");
+        return 1;
+    }
+    AhoCorasick *ac = calloc(1, sizeof(AhoCorasick));
+    AcKey *keys = malloc((nkeys ? nkeys : 1) * sizeof(AcKey));
+    if (!ac || !keys) {
+        fprintf(stderr, "Memory allocation failed for ac engine.\n");
+        free(ac);
+        free(keys);
+        return 1;
+    }
+    replace_list->ac = ac;
+    for (int c = 0; c < 256; c++) {
+        ac->fold[c] = replace_list->ignore_case ? fold_byte((unsigned char)c) : (unsigned char)c;
+    }
+
+    nkeys = 0;
+    for (size_t i = 0; i < replace_list->count; i++) {
+        const ReplacePair *pair = &replace_list->pairs[i];
+        if (pair->from_len == 0) continue;
+        keys[nkeys].from = pair->from;
+        keys[nkeys].len = pair->from_len;
+        keys[nkeys].pair = (uint32_t)i;
+        nkeys++;
+    }
+    sort_parallel(keys, nkeys, sizeof(AcKey), compare_ac_keys, build_parts(replace_list, nkeys));
+    progress(replace_list, "sorted %zu keys", nkeys);
+
+    AcTrie trie;
+    memset(&trie, 0, sizeof(trie));
+    int error = build_ac_trie(replace_list, keys, nkeys, total_len, &trie);
+    free(keys);
+    if (error) {
+        free_ac_trie(&trie);
+        return 1;
+    }
+    uint32_t nnodes = trie.count;
+
+    /*
+       Hottest first: by sample visits with breadth-first order breaking ties,
+       or breadth-first without a sample. Only nodes the sample reached need
+       sorting; the others follow in breadth-first order.
+    */
+    uint32_t *order = malloc(nnodes * sizeof(uint32_t));
+    uint32_t *id = malloc(nnodes * sizeof(uint32_t));
+    uint64_t *visits = replace_list->sample_len ? calloc(nnodes, sizeof(uint64_t)) : NULL;
+    if (!order || !id) {
+        fprintf(stderr, "Memory allocation failed for ac engine.\n");
+        free(order);
+        free(id);
+        free(visits);
+        free_ac_trie(&trie);
+        return 1;
+    }
+    uint32_t hot = 0;
+    if (visits) {
+        ac_profile(&trie, ac->fold, replace_list->sample, replace_list->sample_len, visits);
+        visits[0] = UINT64_MAX;
+        for (uint32_t i = 0; i < nnodes; i++) {
+            if (visits[i]) order[hot++] = i;
+        }
+        uint32_t *scratch = malloc(hot * sizeof(uint32_t));
+        if (scratch) {
+            uint32_t *sorted = scratch;
+            uint32_t *from = order;
+            for (uint32_t width = 1; width < hot; width *= 2) {
+                for (uint32_t lo = 0; lo < hot; lo += 2 * width) {
+                    uint32_t mid = (lo + width < hot) ? lo + width : hot;
+                    uint32_t hi = (mid + width < hot) ? mid + width : hot;
+                    uint32_t a = lo, b = mid, o = lo;
+                    while (a < mid && b < hi) sorted[o++] = (visits[from[b]] > visits[from[a]]) ? from[b++] : from[a++];
+                    while (a < mid) sorted[o++] = from[a++];
+                    while (b < hi) sorted[o++] = from[b++];
+                }
+                uint32_t *swap = from;
+                from = sorted;
+                sorted = swap;
+            }
+            if (from != order) {
+                memcpy(order, from, hot * sizeof(uint32_t));
+            }
+            ac->profiled = 1;
+            free(scratch);
+        }
+        uint32_t next = hot;
+        for (uint32_t i = 0; i < nnodes; i++) {
+            if (!visits[i]) order[next++] = i;
+        }
+        free(visits);
+    } else {
+        for (uint32_t i = 0; i < nnodes; i++) {
+            order[i] = i;
+        }
+    }
+
+    /* Lay out the states in that order; edge lists and bitmap rows are placed first so the copy can be split */
+    ac->nstates = nnodes;
+    ac->states = malloc(nnodes * sizeof(AcState));
+    ac->labels = malloc(nnodes);
+    ac->targets = malloc(nnodes * sizeof(uint32_t));
+    ac->out = malloc(nnodes * sizeof(uint32_t));
+    ac->dict = malloc(nnodes * sizeof(uint32_t));
+    ac->depth = malloc(nnodes * sizeof(uint32_t));
+    size_t nbitmaps = 0;
+    for (uint32_t i = 0; i < nnodes; i++) {
+        nbitmaps += (trie.children[i] > AC_SPARSE_MAX);
+    }
+    ac->bitmaps = calloc(nbitmaps ? 4 * nbitmaps : 1, sizeof(uint64_t));
+    if (!ac->states || !ac->labels || !ac->targets || !ac->out || !ac->dict || !ac->depth || !ac->bitmaps) {
+        fprintf(stderr, "Memory allocation failed for ac engine.\n");
+        free(order);
+        free(id);
+        free_ac_trie(&trie);
+        return 1;
+    }
+    uint32_t edges = 0;
+    nbitmaps = 0;
+    for (uint32_t i = 0; i < nnodes; i++) {
+        id[order[i]] = i;
+        ac->states[i].edges = edges;
+        ac->states[i].bitmap = (trie.children[order[i]] > AC_SPARSE_MAX) ? (uint32_t)nbitmaps++ : AC_NONE;
+        edges += trie.children[order[i]];
+    }
+    AcLayout layout = {&trie, ac, order, id};
+    run_parts(ac_layout_part, &layout, build_parts(replace_list, nnodes));
+    free(order);
+    free(id);
+    free_ac_trie(&trie);
+
+    /* Complete rows for the hottest states, resolved through the sparse ones */
+    uint32_t ndense = nnodes < AC_DENSE_STATES ? nnodes : AC_DENSE_STATES;
+    ac->dense = malloc((size_t)ndense * 256 * sizeof(uint32_t));
+    if (!ac->dense) {
+        fprintf(stderr, "Memory allocation failed for ac engine.\n");
+        return 1;
+    }
+    for (uint32_t state = 0; state < ndense; state++) {
+        for (int c = 0; c < 256; c++) {
+            ac->dense[((size_t)state << 8) | (size_t)c] = ac_sparse_next(ac, state, (unsigned char)c);
+        }
+    }
+    ac->ndense = ndense;
+    progress(replace_list, "laid out %u states, %u hot", nnodes, hot);
+
+    size_t used = strlen(replace_list->engine_reason);
+    snprintf(replace_list->engine_reason + used, sizeof(replace_list->engine_reason) - used,
+             "; automaton of %u states, %u dense rows, %s order", ac->nstates, ac->ndense, ac->profiled ? "profiled" : "breadth-first");
+    build_literal_prefilter(replace_list);
+    return 0;
+}
+
+/*
+   With more states than dense rows every byte can wait on a cache miss, and
+   one scan is a chain of dependent loads. Past a short serial head, a long
+   buffer is cut into segments walked AC_LANES at a time in lockstep, each
+   prefetching its next state while the others work, to find the first
+   position where a pattern ends. No match can start more than max_from_len
+   bytes before it, so the exact search starts from there.
+*/
+static int find_ac(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match) {
+    const AhoCorasick *ac = replace_list->ac;
+    const unsigned char *text = (const unsigned char *)str;
+    size_t warmup = replace_list->max_from_len;
+    int lanes = (ac->nstates > ac->ndense && warmup <= AC_LANE_MIN / (2 * AC_LANES));
+
+    while (lanes && len - pos >= (AC_LANES + 1) * AC_LANE_MIN) {
+        /* Matches are often close: look through the head alone before splitting the rest */
+        size_t head = pos + AC_LANE_MIN;
+        uint32_t state = 0;
+        size_t p = pos;
+        size_t hit = SIZE_MAX;
+        while (p < head) {
+            if (state == 0) {
+                p = (size_t)(kernels->find_first(str + p, str + len, &replace_list->prefilter) - str);
+                if (p >= head) break;
+            }
+            state = ac_next(ac, state, ac->fold[text[p]]);
+            if (ac->states[state].has_match) {
+                hit = p;
+                break;
+            }
+            p++;
+        }
+        if (hit == SIZE_MAX) {
+            if (len - p < AC_LANES * AC_LANE_MIN) {
+                /* Too little left to split; no match starts before the current partial one */
+                pos = p - ac->depth[state];
+                break;
+            }
+            hit = ac_first_hit(ac, text, p, len, state, warmup);
+            if (hit == SIZE_MAX) {
+                return 0;
+            }
+        }
+        size_t from = (hit + 1 - pos > warmup) ? hit + 1 - warmup : pos;
+        if (find_ac_serial(replace_list, str, len, from, hit + 1, prev_byte, match, &pos)) {
+            return 1;
+        }
+    }
+    return find_ac_serial(replace_list, str, len, pos, SIZE_MAX, prev_byte, match, &pos);
+}
+
+/*
+   Position of the first byte in [from, to) at which a pattern ends, or
+   SIZE_MAX. 'state' is the automaton state before 'from'. The range is
+   taken in windows of AC_LANES adjacent segments, doubling in size, so
+   the work spent past a near hit stays small. The first lane carries
+   the state on from the last window. Every other lane starts at the root
+   'warmup' bytes before its segment, which brings it to the exact state
+   by the time the segment starts. A hit in one lane ends the lanes after
+   it; the earlier ones run on, as they may hit first.
+*/
+static size_t ac_first_hit(const AhoCorasick *ac, const unsigned char *text, size_t from, size_t to, uint32_t state, size_t warmup) {
+    size_t segment = AC_LANE_MIN / AC_LANES;
+    while (to - from >= AC_LANES * segment) {
+        size_t at[AC_LANES], begin[AC_LANES], end[AC_LANES];
+        uint32_t cur[AC_LANES];   /* State after the byte before at[] */
+        for (int k = 0; k < AC_LANES; k++) {
+            begin[k] = from + (size_t)k * segment;
+            end[k] = begin[k] + segment;
+            at[k] = k ? begin[k] - warmup : from;
+            cur[k] = k ? 0 : state;
+        }
+
+        int lanes = AC_LANES;
+        size_t hit = SIZE_MAX;
+        for (int live = 1; live;) {
+            live = 0;
+            for (int k = 0; k < lanes; k++) {
+                /* The state was prefetched a round ago; test it for a pattern end before moving on */
+                if (ac->states[cur[k]].has_match && at[k] > begin[k]) {
+                    hit = at[k] - 1;
+                    lanes = k;
+                    break;
+                }
+                if (at[k] == end[k]) continue;
+                live = 1;
+                cur[k] = ac_next(ac, cur[k], ac->fold[text[at[k]]]);
+                at[k]++;
+                __builtin_prefetch(&ac->states[cur[k]]);
+                if (cur[k] < ac->ndense && at[k] < end[k]) {
+                    __builtin_prefetch(&ac->dense[((size_t)cur[k] << 8) | ac->fold[text[at[k]]]]);
+                }
+            }
+        }
+        if (hit != SIZE_MAX) {
+            return hit;
+        }
+        from = end[AC_LANES - 1];
+        state = cur[AC_LANES - 1];
+        if (segment < (to - from) / (2 * AC_LANES)) {
+            segment *= 2;
+        }
+    }
+
+    /* The tail is too short to split */
+    for (; from < to; from++) {
+        state = ac_next(ac, state, ac->fold[text[from]]);
+        if (ac->states[state].has_match) {
+            return from;
+        }
+    }
+    return SIZE_MAX;
+}
+
+/*
+   Leftmost-longest over the automaton: the first pattern end found fixes a
+   candidate start, and the scan goes on only as far as a longer or earlier
+   match could still end. Among the suffixes ending at one position the
+   longest comes first, so the first that passes the word checks is the best
+   there. Away from any partial match the prefilter skips to the next byte
+   that can start one. Once no match can start before 'stop' the scan returns
+   0 with *resume where to go on, so -w rejections do not keep it serial.
+*/
+static int find_ac_serial(ReplaceList *replace_list, const char *str, size_t len, size_t pos, size_t stop, int prev_byte, Match *match, size_t *resume) {
+    const AhoCorasick *ac = replace_list->ac;
+    const unsigned char *text = (const unsigned char *)str;
+    size_t best_start = SIZE_MAX;
+    size_t best_pair = 0;
+    size_t limit = len;
+    uint32_t state = 0;
+
+    *resume = len;
+    for (size_t p = pos; p < limit; p++) {
+        /* Past 'stop' with nothing found: hand back where the current partial match starts */
+        if (p >= stop && best_start == SIZE_MAX && p - ac->depth[state] >= stop) {
+            *resume = p - ac->depth[state];
+            return 0;
+        }
+        if (state == 0) {
+            if (best_start != SIZE_MAX) break;
+            p = (size_t)(kernels->find_first(str + p, str + len, &replace_list->prefilter) - str);
+            if (p == len) break;
+        }
+        state = ac_next(ac, state, ac->fold[text[p]]);
+        if (!ac->states[state].has_match) continue;
+
+        for (uint32_t t = (ac->out[state] != AC_NONE) ? state : ac->dict[state]; t != AC_NONE; t = ac->dict[t]) {
+            size_t start = p + 1 - ac->depth[t];
+            if (start > best_start) break;
+            if (replace_list->whole_word) {
+                int before = (start > 0) ? text[start - 1] : prev_byte;
+                if (before >= 0 && replace_list->word_chars[before]) continue;
+                if (p + 1 < len && replace_list->word_chars[text[p + 1]]) continue;
+            }
+            if (start < best_start || ac->out[t] < best_pair) {
+                best_start = start;
+                best_pair = ac->out[t];
+                size_t end = start + replace_list->max_from_len;
+                limit = (end < len) ? end : len;
+            }
+            break;
+        }
+    }
+    if (best_start == SIZE_MAX) {
+        return 0;
+    }
+    match->start = best_start;
+    match->len = replace_list->pairs[best_pair].from_len;
+    match->pair = best_pair;
+    return 1;
+}
+
+static void free_ac(AhoCorasick *ac) {
+    if (!ac) {
+        return;
+    }
+    free(ac->dense);
+    free(ac->states);
+    free(ac->labels);
+    free(ac->targets);
+    free(ac->bitmaps);
+    free(ac->out);
+    free(ac->dict);
+    free(ac->depth);
+    free(ac);
+}
+
+/* Gather the statistics select_engine decides on; 'from' strings are already folded with -i */
+static void pattern_stats(const ReplaceList *replace_list, const char *sample, size_t sample_len, PatternStats *stats) {
+    size_t first_count[256] = {0};
+    unsigned char member[256] = {0};
+    unsigned char key_bytes[256] = {0};
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < replace_list->count; i++) {
+        const ReplacePair *pair = &replace_list->pairs[i];
+        if (pair->from_len == 0) continue;
+        if (stats->count == 0 || pair->from_len < stats->min_len) stats->min_len = pair->from_len;
+        if (pair->from_len > stats->max_len) stats->max_len = pair->from_len;
+        stats->total_len += pair->from_len;
+        stats->count++;
+        if (first_count[pair->first]++ == 0) stats->distinct_first++;
+        member[pair->first] = 1;
+        for (size_t k = 0; k < pair->from_len; k++) {
+            key_bytes[(unsigned char)pair->from[k]] = 1;
+        }
+    }
+    for (int c = 0; c < 256; c++) {
+        stats->key_bytes += key_bytes[c];
+    }
+
+    double collision = 0;
+    for (int c = 0; c < 256; c++) {
+        double share = stats->count ? (double)first_count[c] / (double)stats->count : 0;
+        collision += share * share;
+    }
+    stats->effective_first = collision > 0 ? 1 / collision : 0;
+
+    /* Without a sample, assume text spread over about 64 common byte values */
+    if (sample_len == 0) {
+        stats->density = stats->distinct_first >= 64 ? 1.0 : stats->distinct_first / 64.0;
+        double run = stats->key_bytes >= 64 ? 1.0 : stats->key_bytes / 64.0;
+        stats->window_density = 1.0;
+        for (size_t k = 0; k < stats->min_len && stats->window_density > 1e-6; k++) {
+            stats->window_density *= run;
+        }
+        return;
+    }
+
+    /* Candidate starts for the linear scan, and windows inside runs of key bytes for the hash */
+    size_t candidates = 0;
+    size_t windows = 0;
+    size_t run = 0;
+    for (size_t i = 0; i < sample_len; i++) {
+        unsigned char c = (unsigned char)sample[i];
+        if (replace_list->ignore_case) c = fold_byte(c);
+        candidates += member[c];
+        run = key_bytes[c] ? run + 1 : 0;
+        windows += (stats->min_len > 0 && run >= stats->min_len);
+    }
+    stats->density = (double)candidates / (double)sample_len;
+    stats->window_density = (double)windows / (double)sample_len;
+    stats->sampled = 1;
+}
+
+/*
+   Resolve --engine, or pick the cheapest by estimated work per input byte: -E
+   always uses the regex engine. The linear matcher costs its candidate density
+   times the pairs sharing a first byte; fdr has a flat per-byte cost; the hash
+   engine, for from-strings of one length, costs a lookup per window inside
+   runs of key bytes.
+*/
+static int select_engine(ReplaceList *replace_list, const char *name, const char *sample, size_t sample_len) {
+    char *reason = replace_list->engine_reason;
+    size_t reason_size = sizeof(replace_list->engine_reason);
+    if (name && strcmp(name, "auto") == 0) {
+        name = NULL;
+    }
+    if (replace_list->regex_mode && replace_list->tokens) {
+        fprintf(stderr, "Error: --tokens cannot be combined with -E.\n");
+        return 1;
+    }
+    if (replace_list->regex_mode) {
+        if (name && strcmp(name, engines[ENGINE_REGEX].name) != 0) {
+            fprintf(stderr, "Error: --engine=%s cannot match regular expressions.\n", name);
+            return 1;
+        }
+        replace_list->engine = &engines[ENGINE_REGEX];
+        snprintf(reason, reason_size, "-E: from-strings are regular expressions");
+        return 0;
+    }
+    if (replace_list->tokens) {
+        if (name && strcmp(name, engines[ENGINE_TOKENS].name) != 0) {
+            fprintf(stderr, "Error: --engine=%s cannot be used with --tokens.\n", name);
+            return 1;
+        }
+        replace_list->engine = &engines[ENGINE_TOKENS];
+        snprintf(reason, reason_size, "--tokens: one hash lookup per token");
+        return 0;
+    }
+    if (name) {
+        for (int e = 0; e < ENGINE_TOKENS; e++) {
+            if (strcmp(name, engines[e].name) == 0) {
+                replace_list->engine = &engines[e];
+                snprintf(reason, reason_size, "forced by --engine");
+                return 0;
+            }
+        }
+        fprintf(stderr, "Error: Unknown engine '%s' (use auto, linear, fdr, hash, rolling or ac).\n", name);
+        return 1;
+    }
+
+    PatternStats stats;
+    pattern_stats(replace_list, sample, sample_len, &stats);
+    const char *source = stats.sampled ? "sampled" : "estimated";
+    if (stats.count <= 2) {
+        replace_list->engine = &engines[ENGINE_LINEAR];
+        snprintf(reason, reason_size, "%zu pair(s): the prefilter and a direct compare are cheapest", stats.count);
+        return 0;
+    }
+
+    if (stats.min_len >= ENGINE_ROLLING_MIN_LEN) {
+        replace_list->engine = &engines[ENGINE_ROLLING];
+        snprintf(reason, reason_size, "%zu pairs of %zu..%zu bytes: long patterns are hashed in rolling windows",
+                 stats.count, stats.min_len, stats.max_len);
+        return 0;
+    }
+
+    double cost = stats.density * (2 + (double)stats.count / stats.effective_first);
+    int choice = ENGINE_LINEAR;
+    if (ENGINE_FDR_COST < cost) {
+        cost = ENGINE_FDR_COST;
+        choice = ENGINE_FDR;
+        if (stats.count >= ENGINE_AC_MIN_PAIRS) {
+            choice = ENGINE_AC;
+        }
+    }
+    double hash_cost = -1;
+    if (stats.min_len == stats.max_len && stats.min_len >= ENGINE_HASH_MIN_LEN) {
+        hash_cost = ENGINE_HASH_COST + stats.window_density * (1 + stats.min_len / 8.0);
+        if (hash_cost < cost) {
+            cost = hash_cost;
+            choice = ENGINE_HASH;
+        }
+    }
+    replace_list->engine = &engines[choice];
+
+    int used = snprintf(reason, reason_size,
+                        "%zu pairs of %zu..%zu bytes (%zu total), %d first bytes (%.1f effective), "
+                        "%s candidate density %.3f",
+                        stats.count, stats.min_len, stats.max_len, stats.total_len, stats.distinct_first,
+                        stats.effective_first, source, stats.density);
+    if (used > 0 && (size_t)used < reason_size && hash_cost >= 0) {
+        used += snprintf(reason + used, reason_size - (size_t)used, ", %d key bytes with window density %.4f",
+                         stats.key_bytes, stats.window_density);
+    }
+    if (used > 0 && (size_t)used < reason_size) {
+        snprintf(reason + used, reason_size - (size_t)used, ": %.2f estimated checks per byte", cost);
+    }
+    return 0;
+}
+
+/*
+   Peek at the start of the input without consuming it: the first file, or stdin
+   when it is a regular file. Pipes yield no sample and the choice falls back to
+   pattern statistics alone.
+*/
+static size_t read_input_sample(char **files, int num_files, char *sample, size_t size) {
+    int fd = 0;
+    off_t offset = 0;
+    if (num_files > 0) {
+        fd = open(files[0], O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+    } else {
+        struct stat st;
+        if (fstat(0, &st) != 0 || !S_ISREG(st.st_mode) || (offset = lseek(0, 0, SEEK_CUR)) < 0) {
+            return 0;
+        }
+    }
+    ssize_t got = pread(fd, sample, size, offset);
+    if (fd != 0) {
+        close(fd);
+    }
+    return got > 0 ? (size_t)got : 0;
+}
+
+/*
+   Replace occurrences in a string of 'len' bytes, appending the result to 'out'.
+   prev_byte is the byte preceding str in the input, or -1 at its start; it is
+   only consulted for the word boundary in front of a match at offset 0.
+   Only matches starting before 'horizon' are taken: past it the input may
+   continue beyond 'len'. Returns the bytes consumed, at least 'horizon' unless
+   a held find stops short of it.
+*/
+static size_t replace_in_string(const char *str, size_t len, size_t horizon, int prev_byte, ReplaceList *replace_list, OutputBuffer *out, size_t *replaced) {
+    size_t pos = 0;
+    Match match;
+
+    /* Room for an unmodified copy plus a trailing newline, so plain bytes need no checks */
+    output_reserve(out, len + 1);
+
+    while (pos < horizon) {
+        int found = replace_list->engine->find(replace_list, str, len, pos, prev_byte, &match);
+        if (found < 0 && replace_list->undecided < horizon) {
+            horizon = replace_list->undecided;
+        }
+        if (found <= 0 || match.start >= horizon) break;
+
+        /* Copy the unmatched span, then the replacement */
+        kernels->copy_span(out->data + out->len, str + pos, match.start - pos);
+        out->len += match.start - pos;
+        pos = match.start + match.len;
+        size_t to_start = out->len;
+        append_replacement(replace_list, &match, str, len, prev_byte, out);
+        (*replaced)++;
+        if (replace_list->report) {
+            report_match(replace_list, str, &match);
+        }
+        if (replace_list->journal) {
+            journal_match(replace_list, str, &match, out->len - to_start);
+        }
+    }
+
+    size_t end = (pos < horizon) ? horizon : pos;
+    kernels->copy_span(out->data + out->len, str + pos, end - pos);
+    out->len += end - pos;
+    return end;
+}
+
+/*
+   Count the matches replace_in_string would replace without building its
+   output. With 'text', a string with a match is also replaced into it (from
+   empty), so the caller can tell whether the replacements change anything.
+   Returns the bytes consumed.
+*/
+static size_t count_in_string(const char *str, size_t len, size_t horizon, int prev_byte, ReplaceList *replace_list, size_t *count, OutputBuffer *text) {
+    size_t pos = 0;
+    Match match;
+
+    while (pos < horizon) {
+        if (!replace_list->engine->find(replace_list, str, len, pos, prev_byte, &match)) break;
+        if (match.start >= horizon) break;
+        if (text) {
+            output_reserve(text, match.start - pos);
+            memcpy(text->data + text->len, str + pos, match.start - pos);
+            text->len += match.start - pos;
+            append_replacement(replace_list, &match, str, len, prev_byte, text);
+        }
+        pos = match.start + match.len;
+        (*count)++;
+        if (replace_list->report) {
+            report_match(replace_list, str, &match);
+        }
+    }
+
+    size_t end = (pos < horizon) ? horizon : pos;
+    if (text && pos > 0) {
+        output_reserve(text, end - pos);
+        memcpy(text->data + text->len, str + pos, end - pos);
+        text->len += end - pos;
+    }
+    return end;
+}
+
+/* Grow an array to hold at least 'need' elements; allocation failure is fatal */
+static void regex_grow(void **data, int *capacity, size_t elem_size, int need) {
+    if (need <= *capacity) {
+        return;
+    }
+    int capacity_new = *capacity ? *capacity : 16;
+    while (capacity_new < need) {
+        capacity_new *= 2;
+    }
+    void *grown = realloc(*data, (size_t)capacity_new * elem_size);
+    if (!grown) {
+        fprintf(stderr, "Memory allocation failed for regex.\n");
+        exit(1);
+    }
+    *data = grown;
+    *capacity = capacity_new;
+}
+
+/* Allocate regex memory; failure is fatal like other allocations on the matching path */
+static void *regex_alloc(size_t size) {
+    void *data = calloc(1, size ? size : 1);
+    if (!data) {
+        fprintf(stderr, "Memory allocation failed for regex.\n");
+        exit(1);
+    }
+    return data;
+}
+
+/* Start a new visit generation for closure marks, clearing them when the counter wraps */
+static void regex_generation(Regex *rx) {
+    if (++rx->generation == 0) {
+        memset(rx->mark, 0, (size_t)rx->prog_len * sizeof(unsigned));
+        rx->generation = 1;
+    }
+}
+
+static int regex_node(RegexParser *ps, int type, int arg, int left, int right) {
+    regex_grow((void **)&ps->nodes, &ps->nodes_cap, sizeof(RegexNode), ps->nnodes + 1);
+    RegexNode *node = &ps->nodes[ps->nnodes];
+    node->type = type;
+    node->arg = arg;
+    node->min = 0;
+    node->max = 0;
+    node->left = left;
+    node->right = right;
+    return ps->nnodes++;
+}
+
+static int regex_class(Regex *rx, const unsigned char *bitmap) {
+    regex_grow((void **)&rx->classes, &rx->classes_cap, sizeof(rx->classes[0]), rx->nclasses + 1);
+    memcpy(rx->classes[rx->nclasses], bitmap, 32);
+    return rx->nclasses++;
+}
+
+static inline int class_has(const unsigned char *bitmap, unsigned char c) {
+    return (bitmap[c >> 3] >> (c & 7)) & 1;
+}
+
+static inline void class_add(unsigned char *bitmap, unsigned char c) {
+    bitmap[c >> 3] |= (unsigned char)(1u << (c & 7));
+}
+
+static void class_add_range(unsigned char *bitmap, int low, int high) {
+    for (int c = low; c <= high; c++) {
+        class_add(bitmap, (unsigned char)c);
+    }
+}
+
+/* Add the shorthand class for \d, \w or \s (lowercase letter), negated for the uppercase form */
+static void class_add_shorthand(unsigned char *bitmap, char letter) {
+    unsigned char set[32] = {0};
+    switch (letter | 0x20) {
+        case 'd':
+            class_add_range(set, '0', '9');
+            break;
+        case 'w':
+            class_add_range(set, 'a', 'z');
+            class_add_range(set, 'A', 'Z');
+            class_add_range(set, '0', '9');
+            class_add(set, '_');
+            break;
+        default:
+            class_add(set, ' ');
+            class_add_range(set, '\t', '\r');
+            break;
+    }
+    int negate = (letter >= 'A' && letter <= 'Z');
+    for (int i = 0; i < 32; i++) {
+        bitmap[i] |= negate ? (unsigned char)~set[i] : set[i];
+    }
+    if (negate) {
+        bitmap['\n' >> 3] &= (unsigned char)~(1u << ('\n' & 7));
+    }
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Parse the escape after a backslash into 'bitmap'; returns the single byte or -1 for a class */
+static int regex_escape(RegexParser *ps, unsigned char *bitmap) {
+    if (ps->p == ps->end) {
+        ps->error = "trailing backslash";
+        return -1;
+    }
+    char c = *ps->p++;
+    int byte;
+    switch (c) {
+        case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+            class_add_shorthand(bitmap, c);
+            return -1;
+        case 't': byte = '\t'; break;
+        case 'n': byte = '\n'; break;
+        case 'r': byte = '\r'; break;
+        case 'f': byte = '\f'; break;
+        case 'v': byte = '\v'; break;
+        case '0': byte = '\0'; break;
+        case 'x':
+            if (ps->end - ps->p < 2 || hex_value(ps->p[0]) < 0 || hex_value(ps->p[1]) < 0) {
+                ps->error = "\\x needs two hex digits";
+                return -1;
+            }
+            byte = hex_value(ps->p[0]) * 16 + hex_value(ps->p[1]);
+            ps->p += 2;
+            break;
+        default:
+            /* Only punctuation stands for itself; \b, \<, \1 and the like would silently mean something else */
+            if (isdigit((unsigned char)c)) {
+                ps->error = "back-references are not supported";
+                return -1;
+            }
+            if (c == 'b' || c == 'B' || c == '<' || c == '>') {
+                ps->error = "word boundaries are not supported; use -w";
+                return -1;
+            }
+            if (isalnum((unsigned char)c)) {
+                ps->error = "unsupported escape";
+                return -1;
+            }
+            byte = (unsigned char)c;
+            break;
+    }
+    class_add(bitmap, (unsigned char)byte);
+    return byte;
+}
+
+/* Named POSIX classes usable inside brackets, e.g. [[:xdigit:]] */
+static int class_add_posix(unsigned char *bitmap, const char *name, size_t len) {
+    static const char *const names[] = {"alpha", "digit", "alnum", "upper", "lower", "space",
+                                        "blank", "punct", "xdigit", "cntrl", "print", "graph"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) != len || strncmp(names[i], name, len) != 0) continue;
+        for (int c = 0; c < 128; c++) {
+            int in;
+            switch (i) {
+                case 0: in = isalpha(c); break;
+                case 1: in = isdigit(c); break;
+                case 2: in = isalnum(c); break;
+                case 3: in = isupper(c); break;
+                case 4: in = islower(c); break;
+                case 5: in = isspace(c); break;
+                case 6: in = (c == ' ' || c == '\t'); break;
+                case 7: in = ispunct(c); break;
+                case 8: in = isxdigit(c); break;
+                case 9: in = iscntrl(c); break;
+                case 10: in = isprint(c); break;
+                default: in = isgraph(c); break;
+            }
+            if (in) class_add(bitmap, (unsigned char)c);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* Give every letter in the class its other case */
+static void class_fold(unsigned char *bitmap) {
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (class_has(bitmap, (unsigned char)c) || class_has(bitmap, (unsigned char)(c - 32))) {
+            class_add(bitmap, (unsigned char)c);
+            class_add(bitmap, (unsigned char)(c - 32));
+        }
+    }
+}
+
+/* Parse a bracket expression; the opening '[' is already consumed */
+static int regex_bracket(RegexParser *ps) {
+    unsigned char bitmap[32] = {0};
+    int negate = 0;
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+    int first = 1;
+    while (ps->p < ps->end && (*ps->p != ']' || first)) {
+        first = 0;
+        int low;
+        if (*ps->p == '[' && ps->end - ps->p > 1 && ps->p[1] == ':') {
+            const char *name = ps->p + 2;
+            const char *close = name;
+            while (close + 1 < ps->end && !(close[0] == ':' && close[1] == ']')) close++;
+            if (close + 1 >= ps->end || class_add_posix(bitmap, name, (size_t)(close - name))) {
+                ps->error = "unknown character class";
+                return -1;
+            }
+            ps->p = close + 2;
+            continue;
+        }
+        if (*ps->p == '\\') {
+            ps->p++;
+            low = regex_escape(ps, bitmap);
+            if (ps->error) return -1;
+            if (low < 0) continue;
+        } else {
+            low = (unsigned char)*ps->p++;
+        }
+        if (ps->end - ps->p > 1 && *ps->p == '-' && ps->p[1] != ']') {
+            int high;
+            ps->p++;
+            if (*ps->p == '\\') {
+                unsigned char ignored[32] = {0};
+                ps->p++;
+                high = regex_escape(ps, ignored);
+                if (ps->error) return -1;
+            } else {
+                high = (unsigned char)*ps->p++;
+            }
+            if (high < low) {
+                ps->error = "invalid range in bracket expression";
+                return -1;
+            }
+            class_add_range(bitmap, low, high);
+        } else {
+            class_add(bitmap, (unsigned char)low);
+        }
+    }
+    if (ps->p == ps->end) {
+        ps->error = "unterminated bracket expression";
+        return -1;
+    }
+    ps->p++;
+
+    if (ps->ignore_case) class_fold(bitmap);
+    if (negate) {
+        for (int i = 0; i < 32; i++) bitmap[i] = (unsigned char)~bitmap[i];
+        bitmap['\n' >> 3] &= (unsigned char)~(1u << ('\n' & 7));
+    }
+    return regex_node(ps, RN_CHAR, regex_class(ps->rx, bitmap), -1, -1);
+}
+
+static int regex_parse_alt(RegexParser *ps);
+
+static int regex_parse_atom(RegexParser *ps) {
+    unsigned char bitmap[32] = {0};
+    char c = *ps->p++;
+    switch (c) {
+        case '(': {
+            int group = 0;
+            if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':') {
+                ps->p += 2;
+            } else {
+                group = ++ps->ngroups;
+            }
+            if (++ps->depth > REGEX_MAX_DEPTH) {
+                ps->error = "nesting too deep";
+                return -1;
+            }
+            int inner = regex_parse_alt(ps);
+            ps->depth--;
+            if (inner < 0) return -1;
+            if (ps->p == ps->end || *ps->p != ')') {
+                ps->error = "missing ')'";
+                return -1;
+            }
+            ps->p++;
+            return group ? regex_node(ps, RN_GROUP, group, inner, -1) : inner;
+        }
+        case '[':
+            return regex_bracket(ps);
+        case '.':
+            memset(bitmap, 0xff, sizeof(bitmap));
+            bitmap['\n' >> 3] &= (unsigned char)~(1u << ('\n' & 7));
+            return regex_node(ps, RN_CHAR, regex_class(ps->rx, bitmap), -1, -1);
+        case '^':
+            return regex_node(ps, RN_BOL, 0, -1, -1);
+        case '$':
+            return regex_node(ps, RN_EOL, 0, -1, -1);
+        case '*': case '+': case '?':
+            ps->error = "nothing to repeat";
+            return -1;
+        case ')':
+            ps->error = "unmatched ')'";
+            return -1;
+        case '\\':
+            regex_escape(ps, bitmap);
+            if (ps->error) return -1;
+            break;
+        default:
+            class_add(bitmap, (unsigned char)c);
+            break;
+    }
+    if (ps->ignore_case) class_fold(bitmap);
+    return regex_node(ps, RN_CHAR, regex_class(ps->rx, bitmap), -1, -1);
+}
+
+/* Parse "{m}", "{m,}" or "{m,n}"; returns 0 without consuming anything if it is not a bound */
+static int regex_bounds(RegexParser *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+    int low = 0, high;
+    if (p == ps->end || !isdigit((unsigned char)*p)) return 0;
+    while (p < ps->end && isdigit((unsigned char)*p) && low <= REGEX_MAX_REPEAT) low = low * 10 + (*p++ - '0');
+    high = low;
+    if (p < ps->end && *p == ',') {
+        p++;
+        high = -1;
+        if (p < ps->end && isdigit((unsigned char)*p)) {
+            high = 0;
+            while (p < ps->end && isdigit((unsigned char)*p) && high <= REGEX_MAX_REPEAT) high = high * 10 + (*p++ - '0');
+        }
+    }
+    if (p == ps->end || *p != '}') return 0;
+    if (low > REGEX_MAX_REPEAT || high > REGEX_MAX_REPEAT || (high >= 0 && high < low)) {
+        ps->error = "invalid repetition count";
+        return -1;
+    }
+    ps->p = p + 1;
+    *min = low;
+    *max = high;
+    return 1;
+}
+
+static int regex_parse_repeat(RegexParser *ps) {
+    int node = regex_parse_atom(ps);
+    while (node >= 0 && ps->p < ps->end) {
+        int min, max;
+        char c = *ps->p;
+        if (c == '*') {
+            min = 0; max = -1; ps->p++;
+        } else if (c == '+') {
+            min = 1; max = -1; ps->p++;
+        } else if (c == '?') {
+            min = 0; max = 1; ps->p++;
+        } else if (c == '{') {
+            int bounds = regex_bounds(ps, &min, &max);
+            if (bounds < 0) return -1;
+            if (bounds == 0) break;
+        } else {
+            break;
+        }
+        if (ps->nodes[node].type == RN_BOL || ps->nodes[node].type == RN_EOL) {
+            ps->error = "nothing to repeat";
+            return -1;
+        }
+        node = regex_node(ps, RN_REPEAT, 0, node, -1);
+        ps->nodes[node].min = min;
+        ps->nodes[node].max = max;
+    }
+    return node;
+}
+
+static int regex_parse_concat(RegexParser *ps) {
+    int node = -1;
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        int atom = regex_parse_repeat(ps);
+        if (atom < 0) return -1;
+        node = (node < 0) ? atom : regex_node(ps, RN_CAT, 0, node, atom);
+    }
+    return (node < 0) ? regex_node(ps, RN_EMPTY, 0, -1, -1) : node;
+}
+
+static int regex_parse_alt(RegexParser *ps) {
+    int node = regex_parse_concat(ps);
+    while (node >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        int right = regex_parse_concat(ps);
+        if (right < 0) return -1;
+        node = regex_node(ps, RN_ALT, 0, node, right);
+    }
+    return node;
+}
+
+static int regex_inst(Regex *rx, int op, int arg) {
+    regex_grow((void **)&rx->prog, &rx->prog_cap, sizeof(RegexInst), rx->prog_len + 1);
+    RegexInst *inst = &rx->prog[rx->prog_len];
+    inst->op = op;
+    inst->arg = arg;
+    inst->x = rx->prog_len + 1;
+    inst->y = -1;
+    return rx->prog_len++;
+}
+
+/* Emit NFA instructions for a syntax tree node, reversed for the backward scan; fails only when the program grows too large */
+static int regex_emit(Regex *rx, const RegexParser *ps, int index, int reverse) {
+    const RegexNode *node = &ps->nodes[index];
+    if (rx->prog_len > REGEX_MAX_INSTS) {
+        return -1;
+    }
+    switch (node->type) {
+        case RN_EMPTY:
+            return 0;
+        case RN_CHAR:
+            regex_inst(rx, RX_CHAR, node->arg);
+            return 0;
+        case RN_BOL:
+            regex_inst(rx, reverse ? RX_EOL : RX_BOL, 0);
+            return 0;
+        case RN_EOL:
+            regex_inst(rx, reverse ? RX_BOL : RX_EOL, 0);
+            return 0;
+        case RN_CAT:
+            if (regex_emit(rx, ps, reverse ? node->right : node->left, reverse)) return -1;
+            return regex_emit(rx, ps, reverse ? node->left : node->right, reverse);
+        case RN_GROUP:
+            if (reverse) {
+                return regex_emit(rx, ps, node->left, reverse);
+            }
+            regex_inst(rx, RX_SAVE, 2 * node->arg);
+            if (regex_emit(rx, ps, node->left, reverse)) return -1;
+            regex_inst(rx, RX_SAVE, 2 * node->arg + 1);
+            return 0;
+        case RN_ALT: {
+            int split = regex_inst(rx, RX_SPLIT, 0);
+            if (regex_emit(rx, ps, node->left, reverse)) return -1;
+            int jump = regex_inst(rx, RX_JMP, 0);
+            rx->prog[split].y = rx->prog_len;
+            if (regex_emit(rx, ps, node->right, reverse)) return -1;
+            rx->prog[jump].x = rx->prog_len;
+            return 0;
+        }
+        default: {
+            int min = node->min;
+            int max = node->max;
+            int child = node->left;
+            for (int i = 0; i < min; i++) {
+                if (regex_emit(rx, ps, child, reverse)) return -1;
+            }
+            if (max < 0) {
+                int split = regex_inst(rx, RX_SPLIT, 0);
+                if (regex_emit(rx, ps, child, reverse)) return -1;
+                int jump = regex_inst(rx, RX_JMP, 0);
+                rx->prog[jump].x = split;
+                rx->prog[split].y = rx->prog_len;
+                return 0;
+            }
+            /* Optional copies; every split skips to the common end */
+            int first_split = rx->prog_len;
+            for (int i = min; i < max; i++) {
+                regex_inst(rx, RX_SPLIT, 0);
+                if (regex_emit(rx, ps, child, reverse)) return -1;
+            }
+            for (int pc = first_split; pc < rx->prog_len; pc++) {
+                if (rx->prog[pc].op == RX_SPLIT && rx->prog[pc].y == -1) {
+                    rx->prog[pc].y = rx->prog_len;
+                }
+            }
+            return 0;
+        }
+    }
+}
+
+/* Add the epsilon closure of 'pc' to 'set'; the caller bumps the generation once per set */
+static void regex_closure(Regex *rx, int pc, int flags, int *set, int *set_len) {
+    int sp = 0;
+    rx->stack[sp++] = pc;
+    while (sp > 0) {
+        pc = rx->stack[--sp];
+        if (rx->mark[pc] == rx->generation) continue;
+        rx->mark[pc] = rx->generation;
+        const RegexInst *inst = &rx->prog[pc];
+        switch (inst->op) {
+            case RX_CHAR:
+            case RX_MATCH:
+                set[(*set_len)++] = pc;
+                break;
+            case RX_EOL:
+                /* Kept in the state so acceptance at the end of the line can be resolved later */
+                if (flags & REGEX_AT_EOL) {
+                    rx->stack[sp++] = inst->x;
+                } else {
+                    set[(*set_len)++] = pc;
+                }
+                break;
+            case RX_BOL:
+                if (flags & REGEX_AT_BOL) rx->stack[sp++] = inst->x;
+                break;
+            case RX_SPLIT:
+                rx->stack[sp++] = inst->y;
+                rx->stack[sp++] = inst->x;
+                break;
+            default:
+                rx->stack[sp++] = inst->x;
+                break;
+        }
+    }
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Pair accepted by a set of instructions: the one given first on the command line */
+static int regex_accepting(const Regex *rx, const int *set, int set_len) {
+    int best = -1;
+    for (int i = 0; i < set_len; i++) {
+        if (set[i] < 0) continue;
+        const RegexInst *inst = &rx->prog[set[i]];
+        if (inst->op == RX_MATCH && (best < 0 || rx->pairs[inst->arg].index < rx->pairs[best].index)) {
+            best = inst->arg;
+        }
+    }
+    return best;
+}
+
+/* Drop every cached DFA state once the cache outgrows its memory budget */
+static void dfa_flush(Regex *rx) {
+    rx->nstates = 0;
+    rx->set_pool_len = 0;
+    rx->memory = 0;
+    rx->flushes++;
+    for (size_t i = 0; i < sizeof(rx->start) / sizeof(rx->start[0]); i++) {
+        rx->start[i] = DFA_UNKNOWN;
+    }
+    memset(rx->table, 0xff, (size_t)rx->table_size * sizeof(int));
+}
+
+static uint64_t hash_ints(const int *set, int set_len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (int i = 0; i < set_len; i++) {
+        hash = (hash ^ (uint64_t)(unsigned)set[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Find or create the DFA state for an instruction set (each group is sorted in place) */
+static int dfa_state(Regex *rx, int *set, int set_len) {
+    if (set_len == 0) {
+        return DFA_DEAD;
+    }
+    for (int i = 0, first = 0; i < set_len; i++) {
+        if (set[i] < 0) {
+            qsort(set + first, (size_t)(i - first), sizeof(int), compare_ints);
+            first = i + 1;
+        }
+    }
+    uint64_t hash = hash_ints(set, set_len);
+    int mask = rx->table_size - 1;
+    int slot = (int)(hash & (uint64_t)mask);
+    for (; rx->table[slot] >= 0; slot = (slot + 1) & mask) {
+        const DfaState *state = &rx->states[rx->table[slot]];
+        if (state->set_len == set_len && memcmp(rx->set_pool + state->set, set, (size_t)set_len * sizeof(int)) == 0) {
+            return rx->table[slot];
+        }
+    }
+
+    size_t cost = sizeof(DfaState) + (size_t)rx->nbyte_classes * sizeof(int) + (size_t)set_len * sizeof(int);
+    if (rx->memory + cost > REGEX_DFA_MEMORY || rx->nstates + 1 > rx->table_size / 2) {
+        dfa_flush(rx);
+        for (slot = (int)(hash & (uint64_t)mask); rx->table[slot] >= 0; slot = (slot + 1) & mask) {
+        }
+    }
+
+    /* A group that has just started accepts nothing yet; it is always the last one */
+    int accept_len = set_len;
+    while (accept_len > 0 && set[accept_len - 1] == REGEX_SEED) accept_len--;
+    if (accept_len > 0 && set[accept_len - 1] == REGEX_FRESH) {
+        do accept_len--; while (accept_len > 0 && set[accept_len - 1] >= 0);
+    }
+
+    /* Acceptance at the end of the line also follows the EOL assertions in the set */
+    int eol_len = 0;
+    regex_generation(rx);
+    for (int i = 0; i < accept_len; i++) {
+        if (set[i] < 0) continue;
+        if (rx->prog[set[i]].op == RX_EOL) {
+            regex_closure(rx, rx->prog[set[i]].x, REGEX_AT_EOL, rx->eol_work, &eol_len);
+        } else if (rx->prog[set[i]].op == RX_MATCH) {
+            rx->eol_work[eol_len++] = set[i];
+        }
+    }
+
+    regex_grow((void **)&rx->states, &rx->states_cap, sizeof(DfaState), rx->nstates + 1);
+    if ((size_t)rx->states_cap * (size_t)rx->nbyte_classes > rx->trans_cap) {
+        rx->trans_cap = (size_t)rx->states_cap * (size_t)rx->nbyte_classes;
+        int *trans = realloc(rx->trans, rx->trans_cap * sizeof(int));
+        if (!trans) {
+            fprintf(stderr, "Memory allocation failed for regex.\n");
+            exit(1);
+        }
+        rx->trans = trans;
+    }
+    if (rx->set_pool_len + (size_t)set_len > rx->set_pool_cap) {
+        size_t capacity = rx->set_pool_cap ? rx->set_pool_cap * 2 : 1024;
+        while (capacity < rx->set_pool_len + (size_t)set_len) capacity *= 2;
+        int *pool = realloc(rx->set_pool, capacity * sizeof(int));
+        if (!pool) {
+            fprintf(stderr, "Memory allocation failed for regex.\n");
+            exit(1);
+        }
+        rx->set_pool = pool;
+        rx->set_pool_cap = capacity;
+    }
+
+    int index = rx->nstates++;
+    DfaState *state = &rx->states[index];
+    state->set = rx->set_pool_len;
+    state->set_len = set_len;
+    state->match_pair = regex_accepting(rx, set, accept_len);
+    state->eol_match_pair = regex_accepting(rx, rx->eol_work, eol_len);
+    memcpy(rx->set_pool + rx->set_pool_len, set, (size_t)set_len * sizeof(int));
+    rx->set_pool_len += (size_t)set_len;
+    for (int i = 0; i < rx->nbyte_classes; i++) {
+        rx->trans[(size_t)index * (size_t)rx->nbyte_classes + (size_t)i] = DFA_UNKNOWN;
+    }
+    rx->table[slot] = index;
+    rx->memory += cost;
+    return index;
+}
+
+/*
+   End the group appended to 'set' from 'first' on, leaving out the instructions
+   an earlier group holds. A new group has no use for the accepting ones.
+*/
+static void regex_end_group(Regex *rx, int *set, int first, int *set_len, int fresh) {
+    int kept = first;
+    for (int i = first; i < *set_len; i++) {
+        int pc = set[i];
+        if (rx->claimed[pc] || (fresh && rx->prog[pc].op == RX_MATCH)) continue;
+        rx->claimed[pc] = 1;
+        set[kept++] = pc;
+    }
+    *set_len = kept;
+    if (kept > first) {
+        set[(*set_len)++] = fresh ? REGEX_FRESH : REGEX_MARK;
+    }
+}
+
+static void regex_unclaim(Regex *rx, const int *set, int set_len) {
+    for (int i = 0; i < set_len; i++) {
+        if (set[i] >= 0) rx->claimed[set[i]] = 0;
+    }
+}
+
+/* Append a group of threads starting at every entry */
+static void regex_new_group(Regex *rx, const int *entries, int flags, int *set, int *set_len) {
+    int first = *set_len;
+    regex_generation(rx);
+    for (size_t i = 0; i < rx->npairs; i++) {
+        regex_closure(rx, entries[i], flags, set, set_len);
+    }
+    regex_end_group(rx, set, first, set_len, 1);
+}
+
+/* Whether a group accepts before a byte, or at the end of a line */
+static int regex_group_accepts(Regex *rx, const int *group, int group_len, int at_eol) {
+    int eol_len = 0;
+    regex_generation(rx);
+    for (int i = 0; i < group_len; i++) {
+        const RegexInst *inst = &rx->prog[group[i]];
+        if (inst->op == RX_MATCH) {
+            return 1;
+        }
+        if (at_eol && inst->op == RX_EOL) {
+            regex_closure(rx, inst->x, REGEX_AT_EOL, rx->eol_work, &eol_len);
+        }
+    }
+    for (int i = 0; i < eol_len; i++) {
+        if (rx->prog[rx->eol_work[i]].op == RX_MATCH) return 1;
+    }
+    return 0;
+}
+
+/* Start state 'index': a forward REGEX_CONTEXT_*, or a reverse one from REGEX_REVERSE_START on */
+static int dfa_start(Regex *rx, int index) {
+    if (rx->start[index] == DFA_UNKNOWN) {
+        int set_len = 0;
+        if (index >= REGEX_REVERSE_START) {
+            regex_new_group(rx, rx->reverse_entries, (index > REGEX_REVERSE_START) ? REGEX_AT_BOL : 0, rx->work, &set_len);
+        } else {
+            if (index != REGEX_CONTEXT_WORD) {
+                regex_new_group(rx, rx->entries, (index == REGEX_CONTEXT_BOL) ? REGEX_AT_BOL : 0, rx->work, &set_len);
+            }
+            rx->work[set_len++] = REGEX_SEED;
+        }
+        regex_unclaim(rx, rx->work, set_len);
+        int state = dfa_state(rx, rx->work, set_len);
+        rx->start[index] = state;
+    }
+    return rx->start[index];
+}
+
+/* Follow (building it on first use) the transition of a state on a byte class */
+static int dfa_next(Regex *rx, int index, int byte_class) {
+    size_t slot = (size_t)index * (size_t)rx->nbyte_classes + (size_t)byte_class;
+    if (rx->trans[slot] != DFA_UNKNOWN) {
+        return rx->trans[slot];
+    }
+
+    const DfaState *state = &rx->states[index];
+    const int *set = rx->set_pool + state->set;
+    unsigned char byte = rx->class_byte[byte_class];
+    int word = rx->whole_word && rx->word_chars[byte];
+    int end = state->set_len;
+    int set_len = 0, seed = 0;
+    unsigned flushes = rx->flushes;
+
+    /* The first group accepting here holds the leftmost match so far: drop what started later */
+    for (int i = 0, first = 0; i < end && !word; i++) {
+        if (set[i] != REGEX_MARK) continue;
+        if (regex_group_accepts(rx, set + first, i - first, byte == '\n')) {
+            end = i + 1;
+        }
+        first = i + 1;
+    }
+    for (int i = 0, first = 0; i < end; i++) {
+        if (set[i] == REGEX_SEED) {
+            seed = 1;
+            continue;
+        }
+        if (set[i] >= 0) continue;
+        /* A newline satisfies the end-of-line assertions before it and starts a line after it */
+        int group = set_len;
+        int eol_len = 0;
+        if (byte == '\n') {
+            regex_generation(rx);
+            for (int j = first; j < i; j++) {
+                if (rx->prog[set[j]].op == RX_EOL) {
+                    regex_closure(rx, rx->prog[set[j]].x, REGEX_AT_EOL, rx->eol_work, &eol_len);
+                }
+            }
+        }
+        regex_generation(rx);
+        for (int j = first; j < i + eol_len; j++) {
+            const RegexInst *inst = &rx->prog[(j < i) ? set[j] : rx->eol_work[j - i]];
+            if (inst->op == RX_CHAR && class_has(rx->classes[inst->arg], byte)) {
+                regex_closure(rx, inst->x, (byte == '\n') ? REGEX_AT_BOL : 0, rx->work, &set_len);
+            }
+        }
+        regex_end_group(rx, rx->work, group, &set_len, 0);
+        first = i + 1;
+    }
+    if (seed) {
+        if (!word) {
+            regex_new_group(rx, rx->entries, (byte == '\n') ? REGEX_AT_BOL : 0, rx->work, &set_len);
+        }
+        rx->work[set_len++] = REGEX_SEED;
+    }
+    regex_unclaim(rx, rx->work, set_len);
+
+    int next = dfa_state(rx, rx->work, set_len);
+    if (rx->flushes == flushes) {
+        rx->trans[slot] = next;
+    }
+    return next;
+}
+
+/* Forward start context for a match beginning at 'pos' */
+static int regex_context(const ReplaceList *replace_list, const char *str, size_t pos, int prev_byte) {
+    int before = (pos > 0) ? (unsigned char)str[pos - 1] : prev_byte;
+    if (replace_list->whole_word && before >= 0 && replace_list->word_chars[before]) {
+        return REGEX_CONTEXT_WORD;
+    }
+    return (before < 0 || before == '\n') ? REGEX_CONTEXT_BOL : REGEX_CONTEXT_MID;
+}
+
+/* Start of the leftmost match ending at 'end', found by running the reversed program back to 'from' */
+static size_t regex_match_start(ReplaceList *replace_list, const char *str, size_t len, size_t from, size_t end, int prev_byte, size_t *pair) {
+    Regex *rx = replace_list->regex;
+    int state = dfa_start(rx, REGEX_REVERSE_START + (end == len || str[end] == '\n'));
+    size_t start = end;
+
+    for (size_t pos = end; pos > from && state != DFA_DEAD; ) {
+        pos--;
+        state = dfa_next(rx, state, rx->byte_class[(unsigned char)str[pos]]);
+        if (state == DFA_DEAD) break;
+        int before = (pos > 0) ? (unsigned char)str[pos - 1] : prev_byte;
+        int accepted = (before < 0 || before == '\n') ? rx->states[state].eol_match_pair : rx->states[state].match_pair;
+        if (accepted >= 0 && (!replace_list->whole_word || before < 0 || !replace_list->word_chars[before])) {
+            start = pos;
+            *pair = (size_t)accepted;
+        }
+    }
+    return start;
+}
+
+/*
+   Find the leftmost-longest regex match at or after 'pos'; returns 0 when there
+   is none. One unanchored forward pass finds where the match ends and a reverse
+   pass from there finds where it starts, so the text is read at most twice.
+*/
+static int find_regex(ReplaceList *replace_list, const char *str, size_t len, size_t pos, int prev_byte, Match *match) {
+    Regex *rx = replace_list->regex;
+    size_t from = pos;
+    size_t end = 0;
+    size_t idle = pos;
+    int state = DFA_UNKNOWN;
+
+    for (;;) {
+        /*
+           In a start state every thread could have started here, so bytes no
+           match starts with can be skipped; the state is rebuilt for where the
+           scan lands unless it stays put.
+        */
+        if (end == 0 && (state == DFA_UNKNOWN || state == rx->start[REGEX_CONTEXT_MID]
+                         || state == rx->start[REGEX_CONTEXT_BOL] || state == rx->start[REGEX_CONTEXT_WORD])) {
+            const char *current = str + pos;
+            for (;;) {
+                current = kernels->find_first(current, str + len, &replace_list->prefilter);
+                if (current == str + len) {
+                    return 0;
+                }
+                /* Every match starts with the literal prefix, which more input may complete */
+                if (rx->prefix_len > (size_t)(str + len - current)) {
+                    if (!replace_list->hold) {
+                        return 0;
+                    }
+                    replace_list->undecided = (size_t)(current - str);
+                    return -1;
+                }
+                if (bytes_equal(current, rx->prefix, rx->prefix_len, replace_list->ignore_case)) {
+                    break;
+                }
+                current++;
+            }
+            if (state == DFA_UNKNOWN || current != str + pos) {
+                pos = (size_t)(current - str);
+                state = dfa_start(rx, regex_context(replace_list, str, pos, prev_byte));
+            }
+            idle = pos;
+        }
+
+        int at_eol = (pos == len || str[pos] == '\n');
+        int accepted = at_eol ? rx->states[state].eol_match_pair : rx->states[state].match_pair;
+        if (accepted >= 0 && (!replace_list->whole_word || pos == len || !replace_list->word_chars[(unsigned char)str[pos]])) {
+            end = pos;
+        }
+        if (pos == len) break;
+        state = dfa_next(rx, state, rx->byte_class[(unsigned char)str[pos]]);
+        pos++;
+        if (state == DFA_DEAD) break;
+    }
+    /* Threads still live at the end could go on; none of them started before the last idle point */
+    if (replace_list->hold && state != DFA_DEAD) {
+        replace_list->undecided = idle;
+        return -1;
+    }
+    if (end == 0) {
+        return 0;
+    }
+
+    size_t pair = 0;
+    size_t start = regex_match_start(replace_list, str, len, from, end, prev_byte, &pair);
+    if (start == end) {
+        return 0;
+    }
+    match->start = start;
+    match->len = end - start;
+    match->pair = pair;
+    return 1;
+}
+
+/* Add a thread and everything it reaches without consuming input, in priority order */
+static void pike_add(Regex *rx, PikeList *list, int pc, size_t *caps, const char *str, size_t len, size_t pos, int prev_byte) {
+    int sp = 0;
+    rx->pike_stack[sp].pc = pc;
+    rx->pike_stack[sp++].slot = -1;
+    while (sp > 0) {
+        PikeStackEntry entry = rx->pike_stack[--sp];
+        if (entry.slot >= 0) {
+            caps[entry.slot] = entry.value;
+            continue;
+        }
+        pc = entry.pc;
+        if (rx->mark[pc] == rx->generation) continue;
+        rx->mark[pc] = rx->generation;
+        const RegexInst *inst = &rx->prog[pc];
+        int before = (pos > 0) ? (unsigned char)str[pos - 1] : prev_byte;
+        switch (inst->op) {
+            case RX_CHAR:
+            case RX_MATCH:
+                list->pc[list->count] = pc;
+                memcpy(list->caps + (size_t)list->count * rx->nslots, caps, rx->nslots * sizeof(size_t));
+                list->count++;
+                break;
+            case RX_SPLIT:
+                rx->pike_stack[sp].pc = inst->y;
+                rx->pike_stack[sp++].slot = -1;
+                rx->pike_stack[sp].pc = inst->x;
+                rx->pike_stack[sp++].slot = -1;
+                break;
+            case RX_SAVE:
+                /* Restore the slot once everything reached through this save is added */
+                rx->pike_stack[sp].slot = inst->arg;
+                rx->pike_stack[sp++].value = caps[inst->arg];
+                caps[inst->arg] = pos;
+                rx->pike_stack[sp].pc = inst->x;
+                rx->pike_stack[sp++].slot = -1;
+                break;
+            case RX_BOL:
+                if (before < 0 || before == '\n') {
+                    rx->pike_stack[sp].pc = inst->x;
+                    rx->pike_stack[sp++].slot = -1;
+                }
+                break;
+            case RX_EOL:
+                if (pos == len || str[pos] == '\n') {
+                    rx->pike_stack[sp].pc = inst->x;
+                    rx->pike_stack[sp++].slot = -1;
+                }
+                break;
+            default:
+                rx->pike_stack[sp].pc = inst->x;
+                rx->pike_stack[sp++].slot = -1;
+                break;
+        }
+    }
+}
+
+/* Capture positions of a match the DFA found, recovered by a Pike VM run over just that span */
+static const size_t *regex_captures(Regex *rx, const Match *match, const char *str, size_t len, int prev_byte) {
+    size_t end = match->start + match->len;
+    PikeList *current = &rx->pike_lists[0];
+    PikeList *next = &rx->pike_lists[1];
+
+    for (size_t i = 0; i < rx->nslots; i++) {
+        rx->caps[i] = REGEX_UNSET;
+    }
+    current->count = 0;
+    regex_generation(rx);
+    pike_add(rx, current, rx->entries[match->pair], rx->caps, str, len, match->start, prev_byte);
+
+    for (size_t pos = match->start; current->count > 0; pos++) {
+        if (pos == end) {
+            /* The highest-priority thread accepting exactly here decides the groups */
+            for (int t = 0; t < current->count; t++) {
+                if (rx->prog[current->pc[t]].op == RX_MATCH) {
+                    memcpy(rx->caps, current->caps + (size_t)t * rx->nslots, rx->nslots * sizeof(size_t));
+                    return rx->caps;
+                }
+            }
+            break;
+        }
+        next->count = 0;
+        regex_generation(rx);
+        for (int t = 0; t < current->count; t++) {
+            const RegexInst *inst = &rx->prog[current->pc[t]];
+            if (inst->op == RX_CHAR && class_has(rx->classes[inst->arg], (unsigned char)str[pos])) {
+                pike_add(rx, next, inst->x, current->caps + (size_t)t * rx->nslots, str, len, pos + 1, prev_byte);
+            }
+        }
+        PikeList *swap = current;
+        current = next;
+        next = swap;
+    }
+
+    /* Not reached for matches the DFA reported; fall back to the whole match only */
+    for (size_t i = 0; i < rx->nslots; i++) {
+        rx->caps[i] = REGEX_UNSET;
+    }
+    rx->caps[0] = match->start;
+    rx->caps[1] = end;
+    return rx->caps;
+}
+
+/* Split every byte class by membership in 'bitmap' */
+static void regex_split_classes(Regex *rx, const unsigned char *bitmap) {
+    int remap[2][256];
+    int count = 0;
+    memset(remap, 0xff, sizeof(remap));
+    for (int c = 0; c < 256; c++) {
+        int *target = &remap[class_has(bitmap, (unsigned char)c)][rx->byte_class[c]];
+        if (*target < 0) *target = count++;
+        rx->byte_class[c] = (unsigned char)*target;
+    }
+    rx->nbyte_classes = count;
+}
+
+/*
+   Split bytes into classes that every character class treats alike, so DFA
+   rows stay narrow. A newline and, with -w, word characters also decide where
+   matches may start and end, so they get classes of their own.
+*/
+static void regex_byte_classes(Regex *rx) {
+    unsigned char bitmap[32] = {0};
+    memset(rx->byte_class, 0, sizeof(rx->byte_class));
+    rx->nbyte_classes = 1;
+    for (int k = 0; k < rx->nclasses; k++) {
+        regex_split_classes(rx, rx->classes[k]);
+    }
+    class_add(bitmap, '\n');
+    regex_split_classes(rx, bitmap);
+    if (rx->whole_word) {
+        memset(bitmap, 0, sizeof(bitmap));
+        for (int c = 0; c < 256; c++) {
+            if (rx->word_chars[c]) class_add(bitmap, (unsigned char)c);
+        }
+        regex_split_classes(rx, bitmap);
+    }
+    for (int c = 255; c >= 0; c--) {
+        rx->class_byte[rx->byte_class[c]] = (unsigned char)c;
+    }
+}
+
+/* Collect the literal every match must start with, folded when ignoring case */
+static void regex_prefix(Regex *rx, int ignore_case) {
+    int set_len = 0;
+    rx->prefix_len = 0;
+    regex_generation(rx);
+    for (size_t i = 0; i < rx->npairs; i++) {
+        regex_closure(rx, rx->entries[i], REGEX_AT_BOL, rx->work, &set_len);
+    }
+    while (rx->prefix_len < REGEX_MAX_PREFIX && set_len == 1 && rx->prog[rx->work[0]].op == RX_CHAR) {
+        const unsigned char *bitmap = rx->classes[rx->prog[rx->work[0]].arg];
+        int count = 0, byte = -1;
+        for (int c = 0; c < 256; c++) {
+            if (class_has(bitmap, (unsigned char)c)) {
+                count++;
+                if (byte < 0) byte = c;
+            }
+        }
+        /* With -i a letter is the pair of its cases; store the folded form */
+        if (!(count == 1 || (ignore_case && count == 2 && byte >= 'A' && byte <= 'Z' && class_has(bitmap, (unsigned char)(byte | 0x20))))) {
+            break;
+        }
+        rx->prefix[rx->prefix_len++] = (char)(ignore_case ? fold_byte((unsigned char)byte) : byte);
+        int pc = rx->prog[rx->work[0]].x;
+        set_len = 0;
+        regex_generation(rx);
+        regex_closure(rx, pc, (byte == '\n') ? REGEX_AT_BOL : 0, rx->work, &set_len);
+    }
+}
+
+/* Most newlines a match of a syntax tree node can hold, SIZE_MAX when there is no bound */
+static size_t regex_newlines(const RegexParser *ps, int index) {
+    const RegexNode *node = &ps->nodes[index];
+    size_t left, right;
+    switch (node->type) {
+        case RN_CHAR:
+            return class_has(ps->rx->classes[node->arg], '\n');
+        case RN_GROUP:
+            return regex_newlines(ps, node->left);
+        case RN_ALT:
+            left = regex_newlines(ps, node->left);
+            right = regex_newlines(ps, node->right);
+            return (left > right) ? left : right;
+        case RN_CAT:
+            left = regex_newlines(ps, node->left);
+            right = regex_newlines(ps, node->right);
+            return (left > REGEX_MAX_SPAN || right > REGEX_MAX_SPAN) ? SIZE_MAX : left + right;
+        case RN_REPEAT:
+            left = regex_newlines(ps, node->left);
+            if (left == 0) return 0;
+            if (node->max < 0 || left > REGEX_MAX_SPAN / (size_t)node->max) return SIZE_MAX;
+            return left * (size_t)node->max;
+        default:
+            return 0;
+    }
+}
+
+/* Compile every 'from' string as a regex into one program; DFA states are built lazily while matching */
+static int compile_regexes(ReplaceList *replace_list) {
+    Regex *rx = regex_alloc(sizeof(Regex));
+    RegexParser ps;
+    memset(&ps, 0, sizeof(ps));
+    replace_list->regex = rx;
+    rx->pairs = replace_list->pairs;
+    rx->npairs = replace_list->count;
+    rx->entries = regex_alloc(rx->npairs * sizeof(int));
+    rx->reverse_entries = regex_alloc(rx->npairs * sizeof(int));
+    rx->whole_word = replace_list->whole_word;
+    rx->word_chars = replace_list->word_chars;
+
+    for (size_t k = 0; k < replace_list->count; k++) {
+        ReplacePair *pair = &replace_list->pairs[k];
+        ps.p = pair->from;
+        ps.end = pair->from + pair->from_len;
+        ps.nnodes = 0;
+        ps.ngroups = 0;
+        ps.depth = 0;
+        ps.rx = rx;
+        ps.ignore_case = replace_list->ignore_case;
+        ps.error = NULL;
+        int root = regex_parse_alt(&ps);
+        if (root >= 0 && ps.p != ps.end) {
+            ps.error = "unmatched ')'";
+            root = -1;
+        }
+        if (root < 0) {
+            fprintf(stderr, "Error: Invalid regex '%.*s': %s.\n", (int)pair->from_len, pair->from, ps.error);
+            free(ps.nodes);
+            return 1;
+        }
+
+        rx->entries[k] = regex_inst(rx, RX_SAVE, 0);
+        int failed = regex_emit(rx, &ps, root, 0);
+        if (!failed) {
+            regex_inst(rx, RX_SAVE, 1);
+            regex_inst(rx, RX_MATCH, (int)k);
+            rx->reverse_entries[k] = rx->prog_len;
+            failed = regex_emit(rx, &ps, root, 1);
+        }
+        if (failed) {
+            fprintf(stderr, "Error: Regex '%.*s' is too large.\n", (int)pair->from_len, pair->from);
+            free(ps.nodes);
+            return 1;
+        }
+        regex_inst(rx, RX_MATCH, (int)k);
+        /* With -e, a regex that can match a newline is matched across lines */
+        if (replace_list->escapes) {
+            size_t lines = regex_newlines(&ps, root);
+            if (lines > replace_list->span_lines) {
+                replace_list->span_lines = lines;
+                replace_list->stream = 1;
+            }
+        }
+        if (ps.ngroups > rx->ngroups) {
+            rx->ngroups = ps.ngroups;
+        }
+        pair->has_refs = (memchr(pair->to, '\\', pair->to_len) != NULL);
+        /* As in sed, a reference to a group the pattern lacks is an error, not an empty string */
+        for (size_t i = 0; pair->has_refs && i + 1 < pair->to_len; i++) {
+            if (pair->to[i] != '\\') continue;
+            int group = pair->to[i + 1] - '0';
+            if (group > ps.ngroups && group <= 9) {
+                fprintf(stderr, "Error: Invalid reference \\%d in '%.*s': regex '%.*s' has %d group%s.\n", group,
+                        (int)pair->to_len, pair->to, (int)pair->from_len, pair->from, ps.ngroups, ps.ngroups == 1 ? "" : "s");
+                free(ps.nodes);
+                return 1;
+            }
+            i++;
+        }
+    }
+    free(ps.nodes);
+
+    /* Scratch space sized by the program, allocated once */
+    size_t insts = (size_t)rx->prog_len;
+    rx->nslots = 2 * (size_t)(rx->ngroups + 1);
+    rx->mark = regex_alloc(insts * sizeof(unsigned));
+    rx->stack = regex_alloc((2 * insts + 1) * sizeof(int));
+    rx->work = regex_alloc((3 * insts + 2) * sizeof(int));
+    rx->eol_work = regex_alloc(insts * sizeof(int));
+    rx->claimed = regex_alloc(insts);
+    rx->pike_stack = regex_alloc((3 * insts + 2) * sizeof(PikeStackEntry));
+    rx->caps = regex_alloc(rx->nslots * sizeof(size_t));
+    for (int i = 0; i < 2; i++) {
+        rx->pike_lists[i].pc = regex_alloc(insts * sizeof(int));
+        rx->pike_lists[i].caps = regex_alloc(insts * rx->nslots * sizeof(size_t));
+    }
+    rx->table_size = REGEX_DFA_TABLE;
+    rx->table = regex_alloc((size_t)rx->table_size * sizeof(int));
+    regex_byte_classes(rx);
+    dfa_flush(rx);
+
+    /* Bytes that can start a match drive the same prefilter as literal pairs */
+    unsigned char member[256] = {0};
+    int set_len = 0;
+    regex_generation(rx);
+    for (size_t i = 0; i < rx->npairs; i++) {
+        regex_closure(rx, rx->entries[i], REGEX_AT_BOL, rx->work, &set_len);
+    }
+    for (int i = 0; i < set_len; i++) {
+        /* A match starting at the end of a line goes on with the newline */
+        if (rx->prog[rx->work[i]].op == RX_EOL) member['\n'] = 1;
+        if (rx->prog[rx->work[i]].op != RX_CHAR) continue;
+        for (int c = 0; c < 256; c++) {
+            if (class_has(rx->classes[rx->prog[rx->work[i]].arg], (unsigned char)c)) member[c] = 1;
+        }
+    }
+    build_prefilter(&replace_list->prefilter, member);
+    regex_prefix(rx, replace_list->ignore_case);
+    return 0;
+}
+
+static void free_regex(Regex *rx) {
+    if (!rx) {
+        return;
+    }
+    free(rx->prog);
+    free(rx->classes);
+    free(rx->entries);
+    free(rx->reverse_entries);
+    free(rx->mark);
+    free(rx->stack);
+    free(rx->work);
+    free(rx->eol_work);
+    free(rx->claimed);
+    free(rx->pike_stack);
+    free(rx->caps);
+    for (int i = 0; i < 2; i++) {
+        free(rx->pike_lists[i].pc);
+        free(rx->pike_lists[i].caps);
+    }
+    free(rx->table);
+    free(rx->states);
+    free(rx->trans);
+    free(rx->set_pool);
+    free(rx);
+}
+
+/* Return the next line (newline included) from the reader: 1 on success, 0 at end, -1 on error */
+static int read_line(LineReader *reader, const char **line, size_t *len) {
+    size_t scanned = reader->start;
+    for (;;) {
+        const char *base = reader->data + reader->start;
+        const char *limit = reader->data + reader->end;
+        const char *newline = kernels->find_byte(reader->data + scanned, limit, '\n');
+        if (newline != limit) {
+            *line = base;
+            *len = (size_t)(newline + 1 - base);
+            reader->start += *len;
+            return 1;
+        }
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return 0;
+            }
+            *line = base;
+            *len = reader->end - reader->start;
+            reader->start = reader->end;
+            return 1;
+        }
+
+        /* Keep the partial line at the front and grow only when it fills the buffer */
+        size_t pending = reader->end - reader->start;
+        if (reader->start > 0) {
+            memmove(reader->data, base, pending);
+            reader->start = 0;
+            reader->end = pending;
+        }
+        if (reader->end == reader->capacity) {
+            size_t capacity = reader->capacity ? reader->capacity * 2 : 65536;
+            char *data = realloc(reader->data, capacity);
+            if (!data) {
+                fprintf(stderr, "Memory allocation failed for input buffer.\n");
+                return -1;
+            }
+            reader->data = data;
+            reader->capacity = capacity;
+        }
+        scanned = pending;
+
+        ssize_t got = read(reader->fd, reader->data + reader->end, reader->capacity - reader->end);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+            return -1;
+        }
+        if (got == 0) {
+            reader->eof = 1;
+        }
+        reader->end += (size_t)got;
+    }
+}
+
+/* Process a single input stream (stdin or a file) */
+static int process_stream(FILE *in, FILE *out, ReplaceList *replace_list, ProgramOptions *options, size_t *replaced) {
+    LineReader reader = {fileno(in), NULL, 0, 0, 0, 0};
+    const char *line;
+    size_t read;
+    int status;
+    int error = 0;
+    OutputBuffer buffer = {NULL, 0, 0};
+    int prev_byte = -1;
+
+    if (options->check) {
+        int changed;
+        return check_input(reader.fd, NULL, replace_list, options, replaced, &changed);
+    }
+    if (options->diff) {
+        return diff_input(reader.fd, "-", replace_list, replaced);
+    }
+    if (replace_list->stream || replace_list->next) {
+        return process_chunks(reader.fd, out, replace_list, replaced, NULL);
+    }
+    if (options->memo_entries && !replace_list->memo) {
+        replace_list->memo = memo_create(options->memo_entries);
+        if (!replace_list->memo) {
+            return 1;
+        }
+    }
+    Memo *memo = replace_list->memo;
+
+    while ((status = read_line(&reader, &line, &read)) > 0) {
+        /* Strip the newline for consistent processing; it is restored only if present */
+        int has_newline = (line[read - 1] == '\n');
+        size_t line_len = read - has_newline;
+
+        size_t updated = 0;
+        buffer.len = 0;
+        const MemoEntry *hit = memo ? memo_lookup(memo, line, line_len) : NULL;
+        if (hit) {
+            output_reserve(&buffer, hit->out_len + 1);
+            memcpy(buffer.data, hit->data + hit->key_len, hit->out_len);
+            buffer.len = hit->out_len;
+            updated = hit->replaced;
+        } else {
+            replace_in_string(line, line_len, line_len, prev_byte, replace_list, &buffer, &updated);
+            if (memo && line_len <= MEMO_MAX_LINE) {
+                memo_store(memo, line, line_len, buffer.data, buffer.len, updated);
+            }
+        }
+        if (replace_list->report || replace_list->journal) {
+            track_advance(replace_list, line, read);
+        }
+        prev_byte = '\n';
+        if (has_newline) {
+            buffer.data[buffer.len++] = '\n';
+        }
+
+        /* Write to output */
+        if (fwrite(buffer.data, 1, buffer.len, out) != buffer.len) {
+            fprintf(stderr, "Error writing to output: %s\n", strerror(errno));
+            error = 1;
+            break;
+        }
+
+        if (options->verbose && updated) {
+            printf("Replaced in line: %.*s\n", (int)(buffer.len - has_newline), buffer.data);
+        }
+        *replaced += updated;
+    }
+    if (status < 0) {
+        error = 1;
+    }
+
+    free(buffer.data);
+    free(reader.data);
+    return error;
+}
+
+/*
+   Process a stream in large chunks rather than lines, for patterns that span
+   lines or for a chain of --then stages. Every stage keeps the bytes it cannot
+   decide yet and hands the rest of its output straight to the next stage, so
+   the whole chain is one pass over the input with no intermediate files.
+   A check passes no 'out' and has the output compared with the input instead.
+*/
+static int process_chunks(int fd, FILE *out, ReplaceList *replace_list, size_t *replaced, ChangeCheck *check) {
+    size_t stages = 0;
+    for (const ReplaceList *stage = replace_list; stage; stage = stage->next) {
+        stages++;
+    }
+    StageBuffer *buffers = calloc(stages, sizeof(StageBuffer));
+    if (!buffers) {
+        fprintf(stderr, "Memory allocation failed for input buffer.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < stages; i++) {
+        buffers[i].prev_byte = -1;
+    }
+
+    /* Read straight into the first stage's pending input */
+    OutputBuffer *in = &buffers[0].in;
+    int eof = 0;
+    int error = 0;
+    while (!error && !eof && !(check && check->stop && check->differs)) {
+        size_t start = in->len;
+        size_t target = in->len + STREAM_CHUNK;
+        output_reserve(in, STREAM_CHUNK);
+        while (!eof && in->len < target) {
+            ssize_t got = read(fd, in->data + in->len, target - in->len);
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+                error = 1;
+                break;
+            }
+            if (got == 0) {
+                eof = 1;
+            }
+            in->len += (size_t)got;
+        }
+        if (!error && check) {
+            change_feed(check, in->data + start, in->len - start, 0);
+        }
+        if (!error) {
+            error = stage_push(replace_list, buffers, NULL, 0, eof, out, replaced);
+        }
+        if (!error && check) {
+            change_feed(check, buffers[stages - 1].out.data, buffers[stages - 1].out.len, 1);
+        }
+    }
+    if (check && eof && check->ahead.len > 0) {
+        check->differs = 1;
+    }
+
+    for (size_t i = 0; i < stages; i++) {
+        free(buffers[i].in.data);
+        free(buffers[i].out.data);
+    }
+    free(buffers);
+    return error;
+}
+
+/*
+   Compare the next bytes of one side of a chunked pass with what the other
+   side is ahead by; output lags behind input while a stage holds bytes back.
+*/
+static void change_feed(ChangeCheck *check, const char *data, size_t len, int output) {
+    if (check->differs || len == 0) {
+        return;
+    }
+    if (check->ahead.len > 0 && check->output_ahead != output) {
+        size_t n = (len < check->ahead.len) ? len : check->ahead.len;
+        if (memcmp(check->ahead.data, data, n) != 0) {
+            check->differs = 1;
+            return;
+        }
+        memmove(check->ahead.data, check->ahead.data + n, check->ahead.len - n);
+        check->ahead.len -= n;
+        data += n;
+        len -= n;
+    }
+    if (len > 0) {
+        output_reserve(&check->ahead, len);
+        memcpy(check->ahead.data + check->ahead.len, data, len);
+        check->ahead.len += len;
+        check->output_ahead = output;
+    }
+}
+
+/*
+   Append data to a stage's pending input and replace what can be decided.
+   Stages with a multi-line pattern keep their last max_from_len + 1 bytes,
+   or for a regex the lines after the last span_lines + 1 newlines, so a
+   match is never cut by a chunk boundary; the others take complete lines,
+   exactly as in line mode. The output goes on to the next stage.
+*/
+static int stage_push(ReplaceList *stage, StageBuffer *buf, const char *data, size_t len, int eof, FILE *out, size_t *replaced) {
+    OutputBuffer *in = &buf->in;
+    if (len > 0) {
+        output_reserve(in, len);
+        memcpy(in->data + in->len, data, len);
+        in->len += len;
+    }
+
+    size_t consumed = 0;
+    buf->out.len = 0;
+    if (stage->stream) {
+        size_t horizon = in->len;
+        /* With no bound on its newlines, a regex find stops where its threads are still live */
+        int hold = !eof && stage->span_lines == SIZE_MAX;
+        if (hold) {
+            /* Looking again only once the input has doubled (or is about to fail) keeps a long undecided run linear */
+            horizon = (in->len >= 2 * buf->held || in->len > REGEX_MAX_HOLD) ? in->len : 0;
+        } else if (!eof && stage->span_lines) {
+            horizon = regex_horizon(stage, in);
+        } else if (!eof) {
+            size_t keep = stage->max_from_len + 1;
+            horizon = (in->len > keep) ? in->len - keep : 0;
+        }
+        if (horizon > 0) {
+            stage->hold = hold;
+            consumed = replace_in_string(in->data, in->len, horizon, buf->prev_byte, stage, &buf->out, replaced);
+            stage->hold = 0;
+            if (stage->report || stage->journal) {
+                track_advance(stage, in->data, consumed);
+            }
+            if (hold) {
+                buf->held = in->len - consumed;
+            }
+        }
+        if (hold && in->len - consumed > REGEX_MAX_HOLD) {
+            fprintf(stderr, "Error: A regex match may span more than %u MiB of input; giving up.\n", REGEX_MAX_HOLD >> 20);
+            return 1;
+        }
+    } else {
+        const char *p = in->data;
+        const char *end = in->data + in->len;
+        int prev_byte = buf->prev_byte;
+        while (p < end) {
+            const char *newline = kernels->find_byte(p, end, '\n');
+            if (newline == end && !eof) {
+                break;
+            }
+            replace_in_string(p, (size_t)(newline - p), (size_t)(newline - p), prev_byte, stage, &buf->out, replaced);
+            if (stage->report || stage->journal) {
+                track_advance(stage, p, (size_t)(newline - p) + (newline < end));
+            }
+            prev_byte = '\n';
+            p = newline;
+            if (p < end) {
+                buf->out.data[buf->out.len++] = '\n';
+                p++;
+            }
+        }
+        consumed = (size_t)(p - in->data);
+    }
+    if (consumed > 0) {
+        buf->prev_byte = (unsigned char)in->data[consumed - 1];
+        memmove(in->data, in->data + consumed, in->len - consumed);
+        in->len -= consumed;
+    }
+
+    if (stage->next) {
+        return stage_push(stage->next, buf + 1, buf->out.data, buf->out.len, eof, out, replaced);
+    }
+    if (out && buf->out.len > 0 && fwrite(buf->out.data, 1, buf->out.len, out) != buf->out.len) {
+        fprintf(stderr, "Error writing to output: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+   Where a regex stage's undecided input starts: a match beginning before the
+   last span_lines + 1 newlines ends at the last one at the latest. 0 while
+   fewer newlines are buffered.
+*/
+static size_t regex_horizon(const ReplaceList *stage, const OutputBuffer *in) {
+    size_t end = in->len;
+    for (size_t n = 0; n <= stage->span_lines; n++) {
+        const char *newline = memrchr(in->data, '\n', end);
+        if (!newline) {
+            return 0;
+        }
+        end = (size_t)(newline - in->data);
+    }
+    return end + 1;
+}
+
+/* Open the --report sink; a binary report starts with REPORT_MAGIC */
+static int report_open(Report *report, const char *filename, int binary) {
+    report->out = fopen(filename, binary ? "wb" : "w");
+    if (!report->out) {
+        fprintf(stderr, "Failed to open report %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    setvbuf(report->out, NULL, _IOFBF, STREAM_CHUNK);
+    report->binary = binary;
+    if (binary) {
+        fwrite(REPORT_MAGIC, 1, sizeof(REPORT_MAGIC) - 1, report->out);
+    }
+    return 0;
+}
+
+static int report_close(Report *report) {
+    int error = ferror(report->out);
+    if (fclose(report->out) != 0) {
+        error = 1;
+    }
+    if (error) {
+        fprintf(stderr, "Error writing report: %s\n", strerror(errno));
+    }
+    free(report->name);
+    report->name = NULL;
+    return error ? 1 : 0;
+}
+
+/* Start a new input: every stage counts from its first line again */
+static void track_begin(ReplaceList *replace_list, const char *filename) {
+    Report *report = replace_list->report;
+    if (replace_list->journal) {
+        replace_list->journal->edits.len = 0;
+        replace_list->journal->count = 0;
+    } else if (!report) {
+        return;
+    }
+    for (ReplaceList *stage = replace_list; stage; stage = stage->next) {
+        stage->cursor.base = 0;
+        stage->cursor.counted = 0;
+        stage->cursor.line = 1;
+        stage->cursor.line_start = 0;
+    }
+    if (!report || report->binary) {
+        return;
+    }
+
+    /* Quote the name once for all of its records */
+    OutputBuffer name = {NULL, 0, 0};
+    output_reserve(&name, 6 * strlen(filename) + 3);
+    name.data[name.len++] = '"';
+    for (const unsigned char *p = (const unsigned char *)filename; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            name.data[name.len++] = '\\';
+            name.data[name.len++] = (char)*p;
+        } else if (*p < 0x20) {
+            name.len += (size_t)sprintf(name.data + name.len, "\\u%04x", *p);
+        } else {
+            name.data[name.len++] = (char)*p;
+        }
+    }
+    name.data[name.len++] = '"';
+    name.data[name.len] = '\0';
+    free(report->name);
+    report->name = name.data;
+}
+
+/* Move the cursor to offset 'to' of str, counting the newlines passed */
+static void report_count(ReportCursor *cursor, const char *str, size_t to) {
+    if (to <= cursor->counted) {
+        return;
+    }
+    size_t newlines = kernels->count_byte(str + cursor->counted, str + to, '\n');
+    if (newlines > 0) {
+        const char *last = memrchr(str + cursor->counted, '\n', to - cursor->counted);
+        cursor->line += newlines;
+        cursor->line_start = cursor->base + (uint64_t)(last - str) + 1;
+    }
+    cursor->counted = to;
+}
+
+/* Write the record of a replacement found in str, the buffer at cursor.base */
+static void report_match(ReplaceList *replace_list, const char *str, const Match *match) {
+    Report *report = replace_list->report;
+    ReportCursor *cursor = &replace_list->cursor;
+    report_count(cursor, str, match->start);
+
+    ReportRecord record;
+    record.offset = cursor->base + match->start;
+    record.line = cursor->line;
+    record.column = record.offset - cursor->line_start + 1;
+    record.file = report->file;
+    record.pair = (uint32_t)replace_list->pairs[match->pair].index;
+    record.stage = replace_list->stage;
+    record.length = (uint32_t)match->len;
+    if (report->binary) {
+        fwrite(&record, sizeof(record), 1, report->out);
+        return;
+    }
+    fprintf(report->out, "{\"file\":%s,\"offset\":%llu,\"line\":%llu,\"column\":%llu,\"length\":%u,\"pair\":%u,\"stage\":%u}\n",
+            report->name, (unsigned long long)record.offset, (unsigned long long)record.line,
+            (unsigned long long)record.column, record.length, record.pair, record.stage);
+}
+
+/* The caller is done with the first 'consumed' bytes of str; the next buffer follows them */
+static void track_advance(ReplaceList *replace_list, const char *str, size_t consumed) {
+    ReportCursor *cursor = &replace_list->cursor;
+    if (replace_list->report) {
+        report_count(cursor, str, consumed);
+    }
+    cursor->base += consumed;
+    cursor->counted = 0;
+}
+
+/*
+   -n, -l, -q: find out whether an input would change without writing
+   anything. Replacements that give back the bytes they match are no change,
+   so the lines of a single stage are only replaced while none has changed
+   yet and then just searched; -l and -q stop at the first line that
+   changes. --then chains and streams run with their output compared with
+   the input, since later stages match on what earlier ones produce.
+*/
+static int check_input(int fd, const char *filename, ReplaceList *replace_list, ProgramOptions *options, size_t *count, int *changed) {
+    int stop = (options->check != CHECK_COUNT);
+    int error = 0;
+
+    *changed = 0;
+    if (replace_list->stream || replace_list->next) {
+        ChangeCheck check = {{NULL, 0, 0}, 0, 0, stop};
+        error = process_chunks(fd, NULL, replace_list, count, &check);
+        *changed = check.differs;
+        free(check.ahead.data);
+    } else {
+        LineReader reader = {fd, NULL, 0, 0, 0, 0};
+        OutputBuffer text = {NULL, 0, 0};
+        const char *line;
+        size_t read;
+        int status;
+        int prev_byte = -1;
+        while (!(stop && *changed) && (status = read_line(&reader, &line, &read)) > 0) {
+            size_t line_len = read - (line[read - 1] == '\n');
+            size_t before = *count;
+            text.len = 0;
+            count_in_string(line, line_len, line_len, prev_byte, replace_list, count, *changed ? NULL : &text);
+            if (!*changed && *count > before) {
+                *changed = (text.len != line_len || memcmp(text.data, line, line_len) != 0);
+            }
+            if (replace_list->report) {
+                track_advance(replace_list, line, read);
+            }
+            prev_byte = '\n';
+        }
+        if (!(stop && *changed) && status < 0) {
+            error = 1;
+        }
+        free(text.data);
+        free(reader.data);
+    }
+    if (error) {
+        return 1;
+    }
+
+    report_check(filename, *count, *changed, options);
+    return 0;
+}
+
+/* Print the result of a check for one input; stdin has no name */
+static void report_check(const char *filename, size_t count, int changed, ProgramOptions *options) {
+    if (changed) {
+        options->matched = 1;
+    }
+    if (options->check == CHECK_COUNT) {
+        if (filename) {
+            printf("%s:%zu\n", filename, count);
+        } else {
+            printf("%zu\n", count);
+        }
+    } else if (options->check == CHECK_LIST && changed) {
+        printf("%s\n", filename ? filename : "(standard input)");
+    }
+}
+
+/*
+   --diff: print the changes as unified diff hunks on stdout and leave the
+   input alone. A regular file is mapped rather than read; the matcher runs
+   over all of it and only the lines around its matches are looked at, so a
+   file without matches costs one scan.
+*/
+static int diff_input(int fd, const char *label, ReplaceList *replace_list, size_t *replaced) {
+    struct stat st;
+    char *data = NULL;
+    size_t len = 0;
+    int mapped = 0;
+    int error = 0;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            len = (size_t)st.st_size;
+            mapped = 1;
+        } else {
+            data = NULL;
+        }
+    }
+    if (!mapped) {
+        OutputBuffer in = {NULL, 0, 0};
+        for (;;) {
+            output_reserve(&in, STREAM_CHUNK);
+            ssize_t got = read(fd, in.data + in.len, in.capacity - in.len);
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+                free(in.data);
+                return 1;
+            }
+            if (got == 0) break;
+            in.len += (size_t)got;
+        }
+        data = in.data;
+        len = in.len;
+    }
+
+    DiffEdits edits = {NULL, 0, 0, {NULL, 0, 0}};
+    if (replace_list->next) {
+        error = diff_collect_chain(replace_list, data, len, &edits, replaced);
+    } else if (replace_list->regex_mode && !replace_list->stream) {
+        diff_collect_lines(replace_list, data, len, &edits, replaced);
+    } else {
+        diff_collect_matches(replace_list, data, len, &edits, replaced);
+    }
+    if (!error && edits.count > 0) {
+        diff_print(label, data, len, &edits);
+        if (ferror(stdout)) {
+            fprintf(stderr, "Error writing to output: %s\n", strerror(errno));
+            error = 1;
+        }
+    }
+
+    free(edits.edits);
+    free(edits.text.data);
+    if (mapped) {
+        munmap(data, len);
+    } else {
+        free(data);
+    }
+    return error;
+}
+
+/* Offset just past the line holding data[i], or len */
+static size_t diff_line_end(const char *data, size_t len, size_t i) {
+    if (i >= len) return len;
+    const char *newline = kernels->find_byte(data + i, data + len, '\n');
+    return (newline == data + len) ? len : (size_t)(newline - data) + 1;
+}
+
+/* Start of the line holding data[i] */
+static size_t diff_line_start(const char *data, size_t i) {
+    const char *newline = (i > 0) ? memrchr(data, '\n', i) : NULL;
+    return newline ? (size_t)(newline - data) + 1 : 0;
+}
+
+/* Lines in [p, end): newlines, plus an unterminated last line */
+static size_t diff_count_lines(const char *p, const char *end) {
+    if (p == end) return 0;
+    return kernels->count_byte(p, end, '\n') + (end[-1] != '\n');
+}
+
+/* Record old lines [old_start, old_end) becoming the text added since text_start, unless it is the same */
+static void diff_add_edit(DiffEdits *edits, const char *data, size_t old_start, size_t old_end, size_t text_start) {
+    size_t text_len = edits->text.len - text_start;
+    if (text_len == old_end - old_start && memcmp(edits->text.data + text_start, data + old_start, text_len) == 0) {
+        edits->text.len = text_start;
+        return;
+    }
+
+    /* Edits of adjacent lines form one block, all removals before all additions */
+    DiffEdit *previous = edits->count ? &edits->edits[edits->count - 1] : NULL;
+    if (previous && previous->old_end == old_start && previous->text_start + previous->text_len == text_start) {
+        previous->old_end = old_end;
+        previous->text_len += text_len;
+        return;
+    }
+    if (edits->count == edits->capacity) {
+        size_t capacity = edits->capacity ? edits->capacity * 2 : 64;
+        DiffEdit *grown = realloc(edits->edits, capacity * sizeof(DiffEdit));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed for diff.\n");
+            exit(1);
+        }
+        edits->edits = grown;
+        edits->capacity = capacity;
+    }
+    DiffEdit *edit = &edits->edits[edits->count++];
+    edit->old_start = old_start;
+    edit->old_end = old_end;
+    edit->text_start = text_start;
+    edit->text_len = text_len;
+}
+
+/*
+   Literal engines find the same matches over the whole buffer as line by
+   line, and from-strings (or -e regexes) with a newline are matched across
+   lines anyway, so the engine runs once over the input. Each match grows an edit to the whole
+   lines it touches; matches that share lines share the edit.
+*/
+static void diff_collect_matches(ReplaceList *replace_list, const char *data, size_t len, DiffEdits *edits, size_t *replaced) {
+    Match match;
+    size_t pos = 0;
+    while (pos < len && replace_list->engine->find(replace_list, data, len, pos, -1, &match)) {
+        size_t start = diff_line_start(data, match.start);
+        size_t end = diff_line_end(data, len, match.start + (match.len ? match.len - 1 : 0));
+        size_t text_start = edits->text.len;
+        size_t cursor = start;
+        int more;
+        do {
+            output_reserve(&edits->text, match.start - cursor);
+            memcpy(edits->text.data + edits->text.len, data + cursor, match.start - cursor);
+            edits->text.len += match.start - cursor;
+            append_replacement(replace_list, &match, data, end, -1, &edits->text);
+            cursor = match.start + match.len;
+            (*replaced)++;
+            more = cursor < len && replace_list->engine->find(replace_list, data, len, cursor, -1, &match);
+
+            /* A replacement that drops the region's last newline joins it with the next line */
+            for (;;) {
+                if (more && match.start < end) {
+                    size_t match_end = diff_line_end(data, len, match.start + (match.len ? match.len - 1 : 0));
+                    end = (match_end > end) ? match_end : end;
+                    break;
+                }
+                int ends_line = (end > cursor) ? data[end - 1] == '\n' : (edits->text.len == text_start || edits->text.data[edits->text.len - 1] == '\n');
+                if (ends_line || end == len) {
+                    more = 0;
+                    break;
+                }
+                end = diff_line_end(data, len, end);
+            }
+        } while (more);
+        output_reserve(&edits->text, end - cursor);
+        memcpy(edits->text.data + edits->text.len, data + cursor, end - cursor);
+        edits->text.len += end - cursor;
+        diff_add_edit(edits, data, start, end, text_start);
+        pos = end;
+    }
+}
+
+/* Regexes anchor on line boundaries, so each line is matched on its own as in line mode */
+static void diff_collect_lines(ReplaceList *replace_list, const char *data, size_t len, DiffEdits *edits, size_t *replaced) {
+    const char *p = data;
+    const char *end = data + len;
+    int prev_byte = -1;
+    Match match;
+    while (p < end) {
+        const char *newline = kernels->find_byte(p, end, '\n');
+        size_t line_len = (size_t)(newline - p);
+        if (replace_list->engine->find(replace_list, p, line_len, 0, prev_byte, &match)) {
+            size_t text_start = edits->text.len;
+            replace_in_string(p, line_len, line_len, prev_byte, replace_list, &edits->text, replaced);
+            if (newline < end) {
+                edits->text.data[edits->text.len++] = '\n';
+            }
+            diff_add_edit(edits, data, (size_t)(p - data), (size_t)(newline - data) + (newline < end), text_start);
+        }
+        prev_byte = '\n';
+        p = (newline < end) ? newline + 1 : end;
+    }
+}
+
+/*
+   A --then chain can move text between lines, so its output is produced in
+   full and the changed lines are the span between the common leading and
+   trailing lines of the input and the output.
+*/
+static int diff_collect_chain(ReplaceList *replace_list, const char *data, size_t len, DiffEdits *edits, size_t *replaced) {
+    char *out_data = NULL;
+    size_t out_len = 0;
+    FILE *out = open_memstream(&out_data, &out_len);
+    size_t stages = 0;
+    for (const ReplaceList *stage = replace_list; stage; stage = stage->next) {
+        stages++;
+    }
+    StageBuffer *buffers = calloc(stages, sizeof(StageBuffer));
+    if (!out || !buffers) {
+        fprintf(stderr, "Memory allocation failed for diff.\n");
+        if (out) fclose(out);
+        free(out_data);
+        free(buffers);
+        return 1;
+    }
+    for (size_t i = 0; i < stages; i++) {
+        buffers[i].prev_byte = -1;
+    }
+    int error = stage_push(replace_list, buffers, data, len, 1, out, replaced);
+    for (size_t i = 0; i < stages; i++) {
+        free(buffers[i].in.data);
+        free(buffers[i].out.data);
+    }
+    free(buffers);
+    if (fclose(out) != 0) {
+        error = 1;
+    }
+
+    size_t prefix = 0;
+    while (prefix < len && prefix < out_len && data[prefix] == out_data[prefix]) {
+        prefix++;
+    }
+    if (!error && (prefix < len || prefix < out_len)) {
+        size_t start = diff_line_start(data, prefix);
+        size_t suffix = 0;
+        while (suffix < len - start && suffix < out_len - start && data[len - 1 - suffix] == out_data[out_len - 1 - suffix]) {
+            suffix++;
+        }
+        /* The common tail must begin on a line of its own in both */
+        size_t old_end = len - suffix;
+        size_t new_end = out_len - suffix;
+        if ((old_end > start && data[old_end - 1] != '\n') || (new_end > start && out_data[new_end - 1] != '\n')) {
+            old_end = diff_line_end(data, len, old_end);
+            new_end = out_len - (len - old_end);
+        }
+        size_t text_start = edits->text.len;
+        output_reserve(&edits->text, new_end - start);
+        memcpy(edits->text.data + edits->text.len, out_data + start, new_end - start);
+        edits->text.len += new_end - start;
+        diff_add_edit(edits, data, start, old_end, text_start);
+    }
+    free(out_data);
+    return error;
+}
+
+/* Print lines of [p, end) with a diff prefix, marking an unterminated last line */
+static void diff_print_lines(char prefix, const char *p, const char *end) {
+    while (p < end) {
+        const char *newline = kernels->find_byte(p, end, '\n');
+        putchar(prefix);
+        fwrite(p, 1, (size_t)(newline - p), stdout);
+        if (newline == end) {
+            fputs("\n\\ No newline at end of file\n", stdout);
+            break;
+        }
+        putchar('\n');
+        p = newline + 1;
+    }
+}
+
+/* Print a unified range; an empty one names the line before it */
+static void diff_print_range(char sign, size_t start, size_t count) {
+    if (count == 1) {
+        printf("%c%zu", sign, start);
+    } else {
+        printf("%c%zu,%zu", sign, count ? start : start - 1, count);
+    }
+}
+
+/* Group edits whose context overlaps into hunks and print them with DIFF_CONTEXT lines around */
+static void diff_print(const char *label, const char *data, size_t len, const DiffEdits *edits) {
+    printf("--- %s\n+++ %s\n", label, label);
+    size_t line = 1;          /* Line number of data[offset] */
+    size_t offset = 0;
+    long long delta = 0;      /* New minus old lines before the current hunk */
+
+    for (size_t first = 0; first < edits->count;) {
+        /* Extend the hunk while the gap to the next edit fits in both contexts */
+        size_t last = first;
+        while (last + 1 < edits->count) {
+            const char *gap = data + edits->edits[last].old_end;
+            const char *next = data + edits->edits[last + 1].old_start;
+            if (diff_count_lines(gap, next) > 2 * DIFF_CONTEXT) break;
+            last++;
+        }
+
+        size_t context_start = edits->edits[first].old_start;
+        for (int i = 0; i < DIFF_CONTEXT && context_start > 0; i++) {
+            context_start = diff_line_start(data, context_start - 1);
+        }
+        size_t context_end = edits->edits[last].old_end;
+        for (int i = 0; i < DIFF_CONTEXT && context_end < len; i++) {
+            context_end = diff_line_end(data, len, context_end);
+        }
+
+        line += diff_count_lines(data + offset, data + context_start);
+        offset = context_start;
+        size_t old_count = diff_count_lines(data + context_start, data + context_end);
+        size_t new_count = old_count;
+        for (size_t i = first; i <= last; i++) {
+            const DiffEdit *edit = &edits->edits[i];
+            const char *text = edits->text.data + edit->text_start;
+            new_count += diff_count_lines(text, text + edit->text_len);
+            new_count -= diff_count_lines(data + edit->old_start, data + edit->old_end);
+        }
+
+        printf("@@ ");
+        diff_print_range('-', line, old_count);
+        putchar(' ');
+        diff_print_range('+', (size_t)((long long)line + delta), new_count);
+        printf(" @@\n");
+
+        size_t cursor = context_start;
+        for (size_t i = first; i <= last; i++) {
+            const DiffEdit *edit = &edits->edits[i];
+            const char *text = edits->text.data + edit->text_start;
+            diff_print_lines(' ', data + cursor, data + edit->old_start);
+            diff_print_lines('-', data + edit->old_start, data + edit->old_end);
+            diff_print_lines('+', text, text + edit->text_len);
+            cursor = edit->old_end;
+        }
+        diff_print_lines(' ', data + cursor, data + context_end);
+
+        delta += (long long)new_count - (long long)old_count;
+        first = last + 1;
+    }
+}
+
+/* Process a single file: read, replace, write to a temporary file, then replace original */
+static int process_file(const char *filename, ReplaceList *replace_list, ProgramOptions *options) {
+    struct stat st;
+    size_t replaced = 0;
+    int changed = 0;
+
+    /* A file in the state the cache last saw needs no read: a check reuses its count, a rewrite had nothing to do */
+    if (options->cache) {
+        if (!replace_list->set_hash) {
+            replace_list->set_hash = hash_replace_list(replace_list);
+        }
+        const CacheEntry *entry = (stat(filename, &st) == 0) ? cache_lookup(options->cache, &st, replace_list->set_hash) : NULL;
+        if (entry && ((options->check && !options->report) || entry->replaced == 0)) {
+            count_input(options, (size_t)entry->replaced);
+            if (options->check) {
+                report_check(filename, (size_t)entry->replaced, entry->replaced > 0, options);
+            } else if (options->verbose && !options->silent) {
+                printf("%s unchanged (cached)\n", filename);
+            }
+            return 0;
+        }
+    }
+
+    track_begin(replace_list, filename);
+    if (options->check) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open file %s: %s\n", filename, strerror(errno));
+            return 1;
+        }
+        int error = (fstat(fd, &st) != 0) || check_input(fd, filename, replace_list, options, &replaced, &changed);
+        close(fd);
+        if (!error) {
+            count_input(options, replaced);
+        }
+        /* -l and -q stop at the first change, so only their zero counts are exact; a count
+           is reused as a change, so one whose replacements change nothing is not kept */
+        if (!error && options->cache && (replaced == 0 || (options->check == CHECK_COUNT && changed))) {
+            cache_record(options->cache, &st, replace_list->set_hash, replaced);
+        }
+        return error;
+    }
+
+    if (options->diff) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open file %s: %s\n", filename, strerror(errno));
+            return 1;
+        }
+        int error = (fstat(fd, &st) != 0) || diff_input(fd, filename, replace_list, &replaced);
+        close(fd);
+        if (!error) {
+            count_input(options, replaced);
+        }
+        if (!error && options->cache && replaced == 0) {
+            cache_record(options->cache, &st, replace_list->set_hash, 0);
+        }
+        return error;
+    }
+
+    FILE *in = fopen(filename, "r");
+    if (!in) {
+        fprintf(stderr, "Failed to open file %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    if (fstat(fileno(in), &st) != 0) {
+        fprintf(stderr, "Failed to stat file %s: %s\n", filename, strerror(errno));
+        fclose(in);
+        return 1;
+    }
+
+    /* Create the temporary file next to the original, on the same filesystem */
+    char *temp_template;
+    int temp_fd = make_temp(filename, &temp_template);
+    if (temp_fd == -1) {
+        fclose(in);
+        return 1;
+    }
+
+    /* A large file starts as a clone of itself, so unchanged blocks are never written */
+    FILE *out = NULL;
+    if (S_ISREG(st.st_mode) && (uint64_t)st.st_size >= CLONE_MIN_SIZE && keeps_length(replace_list)
+        && clone_open(fileno(in), temp_fd, (size_t)st.st_size, &out) != 0) {
+        /* A clone that could not be emptied again is no use: start over with a new file */
+        close(temp_fd);
+        remove(temp_template);
+        free(temp_template);
+        temp_fd = make_temp(filename, &temp_template);
+        if (temp_fd == -1) {
+            fclose(in);
+            return 1;
+        }
+    }
+    if (!out) {
+        out = fdopen(temp_fd, "w");
+    }
+    if (!out) {
+        fprintf(stderr, "Failed to open temporary file: %s\n", strerror(errno));
+        close(temp_fd);
+        fclose(in);
+        remove(temp_template);
+        free(temp_template);
+        return 1;
+    }
+
+    /* The new file takes the original's owner (or at least its group) where allowed, then its mode */
+    if (fchown(temp_fd, st.st_uid, st.st_gid) != 0 && fchown(temp_fd, (uid_t)-1, st.st_gid) != 0 && !options->silent) {
+        fprintf(stderr, "Warning: %s will not keep its owner: %s\n", filename, strerror(errno));
+    }
+    if (fchmod(temp_fd, st.st_mode & 07777) != 0) {
+        fprintf(stderr, "Failed to set the permissions of the temporary file for %s: %s\n", filename, strerror(errno));
+        fclose(out);
+        fclose(in);
+        remove(temp_template);
+        free(temp_template);
+        return 1;
+    }
+
+    /* Process the file */
+    int error = process_stream(in, out, replace_list, options, &replaced);
+    fclose(in);
+    if (fclose(out) != 0 && !error) {
+        fprintf(stderr, "Failed to write temporary file for %s: %s\n", filename, strerror(errno));
+        error = 1;
+    }
+
+    if (error) {
+        /* Remove temporary file on error */
+        remove(temp_template);
+        free(temp_template);
+        return 1;
+    }
+
+    /* Nothing replaced: the copy is identical, so the original keeps its inode and times */
+    count_input(options, replaced);
+    if (replaced == 0) {
+        remove(temp_template);
+        free(temp_template);
+        if (options->cache) {
+            cache_record(options->cache, &st, replace_list->set_hash, 0);
+        }
+        if (!options->silent && options->verbose) {
+            printf("%s unchanged\n", filename);
+        }
+        return 0;
+    }
+    if (options->cache) {
+        cache_record(options->cache, &st, replace_list->set_hash, CACHE_FORGET);
+    }
+
+    /* The original becomes the backup; it is about to lose its name anyway */
+    if (options->backup_suffix && backup_file(filename, &st, options->backup_suffix)) {
+        remove(temp_template);
+        free(temp_template);
+        return 1;
+    }
+
+    /* Replace the original file with the temporary file */
+    if (remove(filename) != 0) {
+        fprintf(stderr, "Failed to remove original file %s: %s\n", filename, strerror(errno));
+        remove(temp_template);
+        free(temp_template);
+        return 1;
+    }
+    if (rename(temp_template, filename) != 0) {
+        fprintf(stderr, "Failed to rename temporary file to %s: %s\n", filename, strerror(errno));
+        remove(temp_template);
+        free(temp_template);
+        return 1;
+    }
+    free(temp_template);
+    if (options->journal) {
+        uint32_t stages = 0;
+        for (const ReplaceList *stage = replace_list; stage; stage = stage->next) {
+            stages++;
+        }
+        if (journal_commit(options->journal, filename, &st, stages)) {
+            return 1;
+        }
+    }
+
+    if (!options->silent) {
+        if (options->verbose) {
+            printf("%s converted\n", filename);
+        }
+    }
+
+    return 0;
+}
+
+/* Add a processed input to the --stats counters */
+static void count_input(ProgramOptions *options, size_t replaced) {
+    options->inputs++;
+    options->changed += (replaced > 0);
+    options->replaced += replaced;
+}
+
+/* --stats: totals and, with --memo, how often lines were found in the memo */
+static void print_stats(const ProgramOptions *options, const ReplaceList *lists, size_t count) {
+    fprintf(stderr, "inputs: %zu, changed: %zu, replacements: %zu\n", options->inputs, options->changed, options->replaced);
+    if (!options->memo_entries) {
+        fprintf(stderr, "memo: off\n");
+        return;
+    }
+    uint64_t hits = 0, misses = 0, evictions = 0, bypassed = 0;
+    for (size_t i = 0; i < count; i++) {
+        const Memo *memo = lists[i].memo;
+        if (memo) {
+            hits += memo->hits;
+            misses += memo->misses;
+            evictions += memo->evictions;
+            bypassed += memo->bypassed;
+        }
+    }
+    double rate = (hits + misses) ? 100.0 * (double)hits / (double)(hits + misses) : 0.0;
+    fprintf(stderr, "memo: %llu hits, %llu misses (%.1f%% hit rate), %llu evictions, %llu lines too long\n",
+            (unsigned long long)hits, (unsigned long long)misses, rate,
+            (unsigned long long)evictions, (unsigned long long)bypassed);
+}
+
+static Memo *memo_create(size_t capacity) {
+    Memo *memo = calloc(1, sizeof(Memo));
+    size_t buckets = 1;
+    while (buckets < 2 * capacity) {
+        buckets <<= 1;
+    }
+    if (memo) {
+        memo->entries = calloc(capacity, sizeof(MemoEntry));
+        memo->buckets = malloc(buckets * sizeof(uint32_t));
+    }
+    if (!memo || !memo->entries || !memo->buckets) {
+        fprintf(stderr, "Memory allocation failed for line memo.\n");
+        free_memo(memo);
+        return NULL;
+    }
+    memset(memo->buckets, 0xff, buckets * sizeof(uint32_t));
+    memo->capacity = (uint32_t)capacity;
+    memo->mask = (uint32_t)(buckets - 1);
+    memo->head = MEMO_NONE;
+    memo->tail = MEMO_NONE;
+    return memo;
+}
+
+static void free_memo(Memo *memo) {
+    if (!memo) {
+        return;
+    }
+    if (memo->entries) {
+        for (uint32_t i = 0; i < memo->count; i++) {
+            free(memo->entries[i].data);
+        }
+    }
+    free(memo->entries);
+    free(memo->buckets);
+    free(memo);
+}
+
+/* Word-at-a-time multiplicative hash; lines only need to spread over the buckets */
+static uint64_t memo_hash(const char *p, size_t len) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t word;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    word = 0;
+    memcpy(&word, p, len);
+    hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 29);
+}
+
+static void memo_unlink(Memo *memo, uint32_t index) {
+    MemoEntry *entry = &memo->entries[index];
+    if (entry->lru_prev != MEMO_NONE) memo->entries[entry->lru_prev].lru_next = entry->lru_next;
+    else memo->head = entry->lru_next;
+    if (entry->lru_next != MEMO_NONE) memo->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    else memo->tail = entry->lru_prev;
+}
+
+static void memo_push_front(Memo *memo, uint32_t index) {
+    MemoEntry *entry = &memo->entries[index];
+    entry->lru_prev = MEMO_NONE;
+    entry->lru_next = memo->head;
+    if (memo->head != MEMO_NONE) memo->entries[memo->head].lru_prev = index;
+    else memo->tail = index;
+    memo->head = index;
+}
+
+/* The memoized replacement of a line, made most recently used; NULL on a miss */
+static const MemoEntry *memo_lookup(Memo *memo, const char *line, size_t len) {
+    if (len > MEMO_MAX_LINE) {
+        memo->bypassed++;
+        return NULL;
+    }
+    memo->hash = memo_hash(line, len);
+    for (uint32_t i = memo->buckets[memo->hash & memo->mask]; i != MEMO_NONE; i = memo->entries[i].bucket_next) {
+        MemoEntry *entry = &memo->entries[i];
+        if (entry->hash == memo->hash && entry->key_len == len && memcmp(entry->data, line, len) == 0) {
+            if (memo->head != i) {
+                memo_unlink(memo, i);
+                memo_push_front(memo, i);
+            }
+            memo->hits++;
+            return entry;
+        }
+    }
+    memo->misses++;
+    return NULL;
+}
+
+/* Remember the replacement of the line memo_lookup just missed, evicting the least recently used */
+static void memo_store(Memo *memo, const char *line, size_t len, const char *out, size_t out_len, size_t replaced) {
+    uint32_t index = (memo->count < memo->capacity) ? memo->count : memo->tail;
+    MemoEntry *entry = &memo->entries[index];
+    char *data = realloc(entry->data, len + out_len + 1);
+    if (!data) {
+        return;   /* The memo only saves work; the line just stays unmemoized */
+    }
+    entry->data = data;
+    if (index == memo->count) {
+        memo->count++;
+    } else {
+        memo_unlink(memo, index);
+        uint32_t *link = &memo->buckets[entry->hash & memo->mask];
+        while (*link != index) {
+            link = &memo->entries[*link].bucket_next;
+        }
+        *link = entry->bucket_next;
+        memo->evictions++;
+    }
+
+    memcpy(data, line, len);
+    memcpy(data + len, out, out_len);
+    entry->data = data;
+    entry->hash = memo->hash;
+    entry->key_len = len;
+    entry->out_len = out_len;
+    entry->replaced = replaced;
+    entry->bucket_next = memo->buckets[memo->hash & memo->mask];
+    memo->buckets[memo->hash & memo->mask] = index;
+    memo_push_front(memo, index);
+}
+
+/* Create a temporary file in the directory of filename; *path is allocated and owned by the caller */
+static int make_temp(const char *filename, char **path) {
+    const char *slash = strrchr(filename, '/');
+    size_t dir_len = slash ? (size_t)(slash - filename) + 1 : 0;
+    *path = malloc(dir_len + sizeof("replace_tempXXXXXX"));
+    if (!*path) {
+        fprintf(stderr, "Memory allocation failed for temporary file name.\n");
+        return -1;
+    }
+    memcpy(*path, filename, dir_len);
+    strcpy(*path + dir_len, "replace_tempXXXXXX");
+    int fd = mkstemp(*path);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to create temporary file: %s\n", strerror(errno));
+        free(*path);
+        *path = NULL;
+    }
+    return fd;
+}
+
+/*
+   --backup: keep the original as filename + suffix. The rewrite puts a new
+   inode under the name, so a hard link keeps the original for free; where
+   links are not possible the backup is a clone, and only failing that a copy.
+*/
+static int backup_file(const char *filename, const struct stat *st, const char *suffix) {
+    size_t name_len = strlen(filename);
+    char *backup = malloc(name_len + strlen(suffix) + 1);
+    if (!backup) {
+        fprintf(stderr, "Memory allocation failed for backup name.\n");
+        return 1;
+    }
+    memcpy(backup, filename, name_len);
+    strcpy(backup + name_len, suffix);
+    if (unlink(backup) != 0 && errno != ENOENT) {
+        fprintf(stderr, "Failed to replace backup %s: %s\n", backup, strerror(errno));
+        free(backup);
+        return 1;
+    }
+    if (link(filename, backup) == 0) {
+        free(backup);
+        return 0;
+    }
+
+    int src = open(filename, O_RDONLY);
+    int dst = (src >= 0) ? open(backup, O_WRONLY | O_CREAT | O_EXCL, st->st_mode & 07777) : -1;
+    int error = (dst < 0);
+    if (!error && ioctl(dst, FICLONE, src) != 0) {
+        off_t offset = 0;
+        error = copy_range(src, &offset, dst, (uint64_t)st->st_size);
+    }
+    if (!error) {
+        struct timespec times[2] = {st->st_atim, st->st_mtim};
+        futimens(dst, times);
+    }
+    if (error) {
+        fprintf(stderr, "Failed to back up %s to %s: %s\n", filename, backup, strerror(errno));
+    }
+    if (dst >= 0 && close(dst) != 0 && !error) {
+        fprintf(stderr, "Failed to back up %s to %s: %s\n", filename, backup, strerror(errno));
+        error = 1;
+    }
+    if (error && dst >= 0) {
+        unlink(backup);
+    }
+    if (src >= 0) {
+        close(src);
+    }
+    free(backup);
+    return error;
+}
+
+/*
+   Whether every replacement of the chain is as long as what it replaces.
+   Only then does each output byte sit at its input offset, so that comparing
+   blocks at the same offset finds just the ones an edit touched; after a
+   length change every later block differs and the clone saves nothing.
+*/
+static int keeps_length(const ReplaceList *replace_list) {
+    for (; replace_list; replace_list = replace_list->next) {
+        if (replace_list->regex_mode) {
+            return 0;
+        }
+        for (size_t i = 0; i < replace_list->count; i++) {
+            if (replace_list->pairs[i].from_len != replace_list->pairs[i].to_len) return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+   Make temp_fd a clone of the original and set *out to a stream that writes
+   only the blocks whose bytes differ from it. *out stays NULL when the
+   filesystem cannot clone; temp_fd is then still empty and the caller writes
+   it in full. Returns -1 if a clone was made but could not be emptied again.
+*/
+static int clone_open(int orig_fd, int temp_fd, size_t size, FILE **out) {
+    CloneWriter *writer = malloc(sizeof(CloneWriter));
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, orig_fd, 0);
+    *out = NULL;
+    if (writer && map != MAP_FAILED && ioctl(temp_fd, FICLONE, orig_fd) == 0) {
+        writer->fd = temp_fd;
+        writer->orig = map;
+        writer->orig_len = size;
+        writer->pos = 0;
+        cookie_io_functions_t io = {NULL, clone_write, NULL, clone_close};
+        *out = fopencookie(writer, "w", io);
+        if (!*out && ftruncate(temp_fd, 0) != 0) {
+            munmap(map, size);
+            free(writer);
+            return -1;
+        }
+    }
+    if (!*out) {
+        if (map != MAP_FAILED) munmap(map, size);
+        free(writer);
+        return 0;
+    }
+    setvbuf(*out, NULL, _IOFBF, STREAM_CHUNK);
+    return 0;
+}
+
+/* Write the runs of blocks that differ from the original, at the output position */
+static ssize_t clone_write(void *cookie, const char *buf, size_t size) {
+    CloneWriter *writer = cookie;
+    size_t done = 0;
+    size_t run = SIZE_MAX;   /* Start of the pending run of changed blocks in buf */
+    while (done < size) {
+        uint64_t at = writer->pos + done;
+        size_t n = CLONE_BLOCK - (size_t)(at % CLONE_BLOCK);
+        if (n > size - done) {
+            n = size - done;
+        }
+        int changed = (at + n > writer->orig_len) || memcmp(buf + done, writer->orig + at, n) != 0;
+        if (changed && run == SIZE_MAX) {
+            run = done;
+        } else if (!changed && run != SIZE_MAX) {
+            if (write_at(writer->fd, buf + run, done - run, writer->pos + run)) return -1;
+            run = SIZE_MAX;
+        }
+        done += n;
+    }
+    if (run != SIZE_MAX && write_at(writer->fd, buf + run, size - run, writer->pos + run)) {
+        return -1;
+    }
+    writer->pos += size;
+    return (ssize_t)size;
+}
+
+/* The output may be shorter than the clone: cut it to the bytes written */
+static int clone_close(void *cookie) {
+    CloneWriter *writer = cookie;
+    int error = (ftruncate(writer->fd, (off_t)writer->pos) != 0);
+    munmap((void *)writer->orig, writer->orig_len);
+    if (close(writer->fd) != 0) {
+        error = 1;
+    }
+    free(writer);
+    return error ? -1 : 0;
+}
+
+static int write_at(int fd, const char *buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)offset);
+        if (n <= 0) {
+            return 1;
+        }
+        buf += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+/* Open the --journal sink and write its magic */
+static int journal_open(Journal *journal, const char *filename) {
+    journal->out = fopen(filename, "wb");
+    if (!journal->out) {
+        fprintf(stderr, "Failed to open journal %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    setvbuf(journal->out, NULL, _IOFBF, STREAM_CHUNK);
+    fwrite(JOURNAL_MAGIC, 1, sizeof(JOURNAL_MAGIC) - 1, journal->out);
+    return 0;
+}
+
+static int journal_close(Journal *journal) {
+    int error = ferror(journal->out);
+    if (fclose(journal->out) != 0) {
+        error = 1;
+    }
+    if (error) {
+        fprintf(stderr, "Error writing journal: %s\n", strerror(errno));
+    }
+    free(journal->edits.data);
+    journal->edits.data = NULL;
+    return error ? 1 : 0;
+}
+
+/* Keep the original bytes of a replacement found in str, the buffer at cursor.base */
+static void journal_match(ReplaceList *replace_list, const char *str, const Match *match, size_t new_len) {
+    Journal *journal = replace_list->journal;
+    JournalEdit edit = {replace_list->cursor.base + match->start, match->len, new_len, replace_list->stage, 0};
+    output_reserve(&journal->edits, sizeof(edit) + match->len);
+    memcpy(journal->edits.data + journal->edits.len, &edit, sizeof(edit));
+    memcpy(journal->edits.data + journal->edits.len + sizeof(edit), str + match->start, match->len);
+    journal->edits.len += sizeof(edit) + match->len;
+    journal->count++;
+}
+
+/* The rewrite of filename is in place: write its records, stamped with what it looks like now */
+static int journal_commit(Journal *journal, const char *filename, const struct stat *orig, uint32_t stages) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        fprintf(stderr, "Failed to stat file %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    JournalFile file;
+    file.size = (uint64_t)st.st_size;
+    file.mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+    file.orig_mtime_ns = (uint64_t)orig->st_mtim.tv_sec * 1000000000ULL + (uint64_t)orig->st_mtim.tv_nsec;
+    file.edits = journal->count;
+    file.name_len = (uint32_t)strlen(filename);
+    file.stages = stages;
+    fwrite(&file, sizeof(file), 1, journal->out);
+    fwrite(filename, 1, file.name_len, journal->out);
+    fwrite(journal->edits.data, 1, journal->edits.len, journal->out);
+    journal->edits.len = 0;
+    journal->count = 0;
+    return 0;
+}
+
+/*
+   --undo: restore the files of a journal, last rewritten first, so a file
+   given twice is taken back through each of its rewrites in turn. Files
+   changed since the run are left alone. A journal cut short by a crash still
+   restores the files it has complete records for.
+*/
+static int undo_journal(const char *path, const ProgramOptions *options) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open journal %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(JOURNAL_MAGIC) - 1) {
+        fprintf(stderr, "Error: %s is not a replace journal.\n", path);
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || memcmp(map, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC) - 1) != 0) {
+        fprintf(stderr, "Error: %s is not a replace journal.\n", path);
+        if (map != MAP_FAILED) munmap(map, size);
+        return 1;
+    }
+
+    /* Index the complete file entries */
+    const char **entries = NULL;
+    size_t count = 0, capacity = 0;
+    int error = 0;
+    const char *p = map + sizeof(JOURNAL_MAGIC) - 1;
+    const char *end = map + size;
+    while (p < end) {
+        JournalFile file;
+        const char *entry = p;
+        int complete = ((size_t)(end - p) >= sizeof(file));
+        if (complete) {
+            memcpy(&file, p, sizeof(file));
+            complete = (file.stages > 0 && file.name_len <= (size_t)(end - p) - sizeof(file));
+            p += sizeof(file) + (complete ? file.name_len : 0);
+        }
+        for (uint64_t i = 0; complete && i < file.edits; i++) {
+            JournalEdit edit;
+            complete = ((size_t)(end - p) >= sizeof(edit));
+            if (complete) {
+                memcpy(&edit, p, sizeof(edit));
+                complete = (edit.old_len <= (uint64_t)(end - p) - sizeof(edit));
+                p += sizeof(edit) + (complete ? edit.old_len : 0);
+            }
+        }
+        if (!complete) {
+            fprintf(stderr, "Error: journal %s is truncated; restoring the files before the cut.\n", path);
+            error = 1;
+            break;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            const char **grown = realloc(entries, capacity * sizeof(*entries));
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed for journal.\n");
+                free(entries);
+                munmap(map, size);
+                return 1;
+            }
+            entries = grown;
+        }
+        entries[count++] = entry;
+    }
+
+    for (size_t i = count; i > 0; i--) {
+        error |= undo_file(entries[i - 1], options);
+    }
+    free(entries);
+    munmap(map, size);
+    return error;
+}
+
+/* Take one file back through its stages, last first, each a copy of the kept spans around the old bytes */
+static int undo_file(const char *entry, const ProgramOptions *options) {
+    JournalFile file;
+    memcpy(&file, entry, sizeof(file));
+    char *name = malloc(file.name_len + 1);
+    if (!name) {
+        fprintf(stderr, "Memory allocation failed for journal.\n");
+        return 1;
+    }
+    memcpy(name, entry + sizeof(file), file.name_len);
+    name[file.name_len] = '\0';
+    const char *edits = entry + sizeof(file) + file.name_len;
+
+    struct stat st;
+    if (stat(name, &st) != 0) {
+        fprintf(stderr, "Failed to stat file %s: %s\n", name, strerror(errno));
+        free(name);
+        return 1;
+    }
+    uint64_t mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+    if ((uint64_t)st.st_size != file.size || mtime_ns != file.mtime_ns) {
+        fprintf(stderr, "Error: %s has changed since the journal was written; not restored.\n", name);
+        free(name);
+        return 1;
+    }
+    int src = open(name, O_RDONLY);
+    if (src < 0) {
+        fprintf(stderr, "Failed to open file %s: %s\n", name, strerror(errno));
+        free(name);
+        return 1;
+    }
+
+    char *temps[2] = {NULL, NULL};
+    int error = 0;
+    for (uint32_t stage = file.stages; stage > 0 && !error; stage--) {
+        char **temp = &temps[stage & 1];
+        int dst = make_temp(name, temp);
+        if (dst < 0) {
+            error = 1;
+        } else if (undo_stage(src, dst, edits, file.edits, stage)) {
+            fprintf(stderr, "Failed to restore %s: %s\n", name, errno ? strerror(errno) : "journal does not match the file");
+            error = 1;
+            close(dst);
+            remove(*temp);
+            dst = -1;
+        }
+        close(src);
+        if (stage < file.stages) {
+            remove(temps[(stage + 1) & 1]);
+            free(temps[(stage + 1) & 1]);
+            temps[(stage + 1) & 1] = NULL;
+        }
+        src = dst;
+    }
+    if (error) {
+        free(temps[0]);
+        free(temps[1]);
+        free(name);
+        return 1;
+    }
+
+    /* The restored file keeps the current permissions and gets its old modification time back */
+    char *restored = temps[1];
+    struct timespec times[2] = {{0, UTIME_OMIT}, {(time_t)(file.orig_mtime_ns / 1000000000ULL), (long)(file.orig_mtime_ns % 1000000000ULL)}};
+    if (fchmod(src, st.st_mode & 07777) != 0 || futimens(src, times) != 0 || close(src) != 0 || rename(restored, name) != 0) {
+        fprintf(stderr, "Failed to restore %s: %s\n", name, strerror(errno));
+        remove(restored);
+        free(restored);
+        free(name);
+        return 1;
+    }
+    free(restored);
+    if (!options->silent && options->verbose) {
+        printf("%s restored\n", name);
+    }
+    free(name);
+    return 0;
+}
+
+/* Write the input of a stage to dst from its output in src: kept spans are copied, replacements swapped back */
+static int undo_stage(int src, int dst, const char *edits, uint64_t count, uint32_t stage) {
+    off_t src_pos = 0;
+    uint64_t dst_pos = 0;
+    const char *p = edits;
+    errno = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        JournalEdit edit;
+        memcpy(&edit, p, sizeof(edit));
+        const char *old = p + sizeof(edit);
+        p = old + edit.old_len;
+        if (edit.stage != stage) continue;
+        if (edit.offset < dst_pos
+            || copy_range(src, &src_pos, dst, edit.offset - dst_pos)
+            || write(dst, old, edit.old_len) != (ssize_t)edit.old_len) {
+            return 1;
+        }
+        src_pos += (off_t)edit.new_len;
+        dst_pos = edit.offset + edit.old_len;
+    }
+    struct stat st;
+    if (fstat(src, &st) != 0 || st.st_size < src_pos) {
+        return 1;
+    }
+    return copy_range(src, &src_pos, dst, (uint64_t)(st.st_size - src_pos));
+}
+
+/* Append len bytes of src from *offset to dst in the kernel, by plain reads where it cannot */
+static int copy_range(int src, off_t *offset, int dst, uint64_t len) {
+    while (len > 0) {
+        ssize_t n = copy_file_range(src, offset, dst, NULL, len, 0);
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            char buffer[65536];
+            n = pread(src, buffer, len < sizeof(buffer) ? (size_t)len : sizeof(buffer), *offset);
+            if (n > 0 && write(dst, buffer, (size_t)n) != n) {
+                return 1;
+            }
+            if (n > 0) {
+                *offset += n;
+            }
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        len -= (uint64_t)n;
+    }
+    errno = 0;
+    return 0;
+}
+
+/*
+   Identity of a chain for --cache: every option that affects matching and
+   every pair of every stage, FNV-1a hashed. Never 0, which means not hashed.
+*/
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_replace_list(const ReplaceList *replace_list) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const ReplaceList *stage = replace_list; stage; stage = stage->next) {
+        int flags[] = {stage->ignore_case, stage->whole_word, stage->regex_mode, stage->tokens};
+        hash = hash_bytes(hash, flags, sizeof(flags));
+        hash = hash_bytes(hash, stage->word_chars, sizeof(stage->word_chars));
+        hash = hash_bytes(hash, &stage->count, sizeof(stage->count));
+        for (size_t i = 0; i < stage->count; i++) {
+            const ReplacePair *pair = &stage->pairs[i];
+            hash = hash_bytes(hash, &pair->from_len, sizeof(pair->from_len));
+            hash = hash_bytes(hash, pair->from, pair->from_len);
+            hash = hash_bytes(hash, &pair->to_len, sizeof(pair->to_len));
+            hash = hash_bytes(hash, pair->to, pair->to_len);
+        }
+    }
+    return hash ? hash : 1;
+}
+
+static void cache_entry_from_stat(CacheEntry *entry, const struct stat *st, uint64_t set_hash, uint64_t replaced) {
+    entry->dev = (uint64_t)st->st_dev;
+    entry->ino = (uint64_t)st->st_ino;
+    entry->size = (uint64_t)st->st_size;
+    entry->mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + (uint64_t)st->st_mtim.tv_nsec;
+    entry->ctime_ns = (uint64_t)st->st_ctim.tv_sec * 1000000000ULL + (uint64_t)st->st_ctim.tv_nsec;
+    entry->set_hash = set_hash;
+    entry->replaced = replaced;
+}
+
+static int cache_key_compare(const CacheEntry *a, const CacheEntry *b) {
+    if (a->dev != b->dev) return (a->dev > b->dev) - (a->dev < b->dev);
+    return (a->ino > b->ino) - (a->ino < b->ino);
+}
+
+/* Updates sorted by key, the latest state of a file last */
+static int compare_cache_updates(const void *a, const void *b) {
+    const CacheEntry *x = a;
+    const CacheEntry *y = b;
+    int order = cache_key_compare(x, y);
+    if (order) return order;
+    if (x->ctime_ns != y->ctime_ns) return (x->ctime_ns > y->ctime_ns) - (x->ctime_ns < y->ctime_ns);
+    return (x->replaced == CACHE_FORGET) - (y->replaced == CACHE_FORGET);
+}
+
+static char *cache_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    char *path = malloc(dir_len + strlen(name) + 2);
+    if (path) {
+        sprintf(path, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+/* Create the cache directory if needed and map the current cache file */
+static int cache_open(Cache *cache, const char *dir) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    cache->dir = dir;
+    cache->started_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create cache directory %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    char *path = cache_path(dir, CACHE_FILE);
+    if (!path) {
+        fprintf(stderr, "Memory allocation failed for cache.\n");
+        return 1;
+    }
+    int error = cache_map(path, &cache->map, &cache->map_size, &cache->entries, &cache->count);
+    free(path);
+    return error;
+}
+
+/*
+   Map a cache file read-only. A missing file is an empty cache; one that
+   does not look like a cache is ignored with a warning, and rewritten at
+   exit. Writers replace the file by rename, so a mapping never changes.
+*/
+static int cache_map(const char *path, void **map, size_t *map_size, const CacheEntry **entries, size_t *count) {
+    *map = NULL;
+    *map_size = 0;
+    *entries = NULL;
+    *count = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return 0;
+        fprintf(stderr, "Failed to open cache %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map cache %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    const CacheHeader *header = data;
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(CacheHeader) || memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        (size - sizeof(CacheHeader)) / sizeof(CacheEntry) != header->count ||
+        (size - sizeof(CacheHeader)) % sizeof(CacheEntry) != 0) {
+        fprintf(stderr, "Warning: ignoring malformed cache %s\n", path);
+        munmap(data, size);
+        return 0;
+    }
+    *map = data;
+    *map_size = size;
+    *entries = (const CacheEntry *)(header + 1);
+    *count = (size_t)header->count;
+    return 0;
+}
+
+/* Record of the file if it is still in the state it had for the same pair set */
+static const CacheEntry *cache_lookup(const Cache *cache, const struct stat *st, uint64_t set_hash) {
+    CacheEntry key;
+    cache_entry_from_stat(&key, st, set_hash, 0);
+    size_t lo = 0;
+    size_t hi = cache->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int order = cache_key_compare(&cache->entries[mid], &key);
+        if (order == 0) {
+            const CacheEntry *entry = &cache->entries[mid];
+            if (entry->size == key.size && entry->mtime_ns == key.mtime_ns && entry->ctime_ns == key.ctime_ns &&
+                entry->set_hash == set_hash) {
+                return entry;
+            }
+            return NULL;
+        }
+        if (order < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/*
+   Remember the outcome for a file state, or with CACHE_FORGET drop its
+   record. A file changed within CACHE_RACY_NS of the run could change again
+   without a visible mtime step, so it is dropped rather than trusted.
+*/
+static void cache_record(Cache *cache, const struct stat *st, uint64_t set_hash, uint64_t replaced) {
+    if (cache->update_count == cache->update_capacity) {
+        size_t capacity = cache->update_capacity ? cache->update_capacity * 2 : 1024;
+        CacheEntry *updates = realloc(cache->updates, capacity * sizeof(CacheEntry));
+        if (!updates) {
+            return;  /* The cache is only an optimization; the file is simply read next time */
+        }
+        cache->updates = updates;
+        cache->update_capacity = capacity;
+    }
+    CacheEntry *entry = &cache->updates[cache->update_count++];
+    cache_entry_from_stat(entry, st, set_hash, replaced);
+    if (entry->mtime_ns + CACHE_RACY_NS > cache->started_ns || entry->ctime_ns + CACHE_RACY_NS > cache->started_ns) {
+        entry->replaced = CACHE_FORGET;
+    }
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+/*
+   Merge this run's records into the cache file. Writers serialize on a lock
+   file and re-read the current cache under it, so records from concurrent
+   runs are kept; the merged table is written next to it and renamed over it.
+*/
+static int cache_close(Cache *cache) {
+    int error = 0;
+    if (cache->map) {
+        munmap(cache->map, cache->map_size);
+        cache->map = NULL;
+    }
+    if (cache->update_count == 0) {
+        free(cache->updates);
+        return 0;
+    }
+
+    char *path = cache_path(cache->dir, CACHE_FILE);
+    char *lock_path = cache_path(cache->dir, CACHE_FILE ".lock");
+    char *temp_path = cache_path(cache->dir, CACHE_FILE ".XXXXXX");
+    int lock_fd = (path && lock_path && temp_path) ? open(lock_path, O_RDWR | O_CREAT, 0666) : -1;
+    if (lock_fd < 0) {
+        fprintf(stderr, "Failed to lock cache in %s: %s\n", cache->dir, strerror(errno));
+        error = 1;
+        goto done;
+    }
+    while (flock(lock_fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "Failed to lock cache in %s: %s\n", cache->dir, strerror(errno));
+            error = 1;
+            goto done;
+        }
+    }
+
+    void *map;
+    size_t map_size;
+    const CacheEntry *entries;
+    size_t count;
+    if (cache_map(path, &map, &map_size, &entries, &count)) {
+        error = 1;
+        goto done;
+    }
+
+    /* Keep the latest update per file, then merge both sorted tables */
+    qsort(cache->updates, cache->update_count, sizeof(CacheEntry), compare_cache_updates);
+    size_t updates = 0;
+    for (size_t i = 0; i < cache->update_count; i++) {
+        if (updates > 0 && cache_key_compare(&cache->updates[updates - 1], &cache->updates[i]) == 0) {
+            updates--;
+        }
+        cache->updates[updates++] = cache->updates[i];
+    }
+    CacheEntry *merged = malloc((count + updates) * sizeof(CacheEntry));
+    size_t merged_count = 0;
+    if (!merged) {
+        fprintf(stderr, "Memory allocation failed for cache.\n");
+        error = 1;
+    }
+    for (size_t i = 0, j = 0; merged && (i < count || j < updates);) {
+        int order = (i == count) ? 1 : (j == updates) ? -1 : cache_key_compare(&entries[i], &cache->updates[j]);
+        if (order < 0) {
+            merged[merged_count++] = entries[i++];
+            continue;
+        }
+        if (order == 0) {
+            i++;
+        }
+        if (cache->updates[j].replaced != CACHE_FORGET) {
+            merged[merged_count++] = cache->updates[j];
+        }
+        j++;
+    }
+    if (map) {
+        munmap(map, map_size);
+    }
+
+    if (merged) {
+        CacheHeader header;
+        memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+        header.count = merged_count;
+        int fd = mkstemp(temp_path);
+        if (fd < 0 || write_all(fd, &header, sizeof(header)) != 0 ||
+            write_all(fd, merged, merged_count * sizeof(CacheEntry)) != 0 || fsync(fd) != 0 ||
+            rename(temp_path, path) != 0) {
+            fprintf(stderr, "Failed to write cache %s: %s\n", path, strerror(errno));
+            if (fd >= 0) {
+                remove(temp_path);
+            }
+            error = 1;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(merged);
+    }
+
+done:
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+    free(path);
+    free(lock_path);
+    free(temp_path);
+    free(cache->updates);
+    cache->updates = NULL;
+    return error;
+}
+
+/* CPU kernels: each variant must return exactly what the generic one does */
+
+static const char *find_byte_generic(const char *p, const char *end, unsigned char c) {
+    if (p == end) return end;  /* p may be NULL for an empty buffer */
+    const char *hit = memchr(p, c, (size_t)(end - p));
+    return hit ? hit : end;
+}
+
+static const char *find_first_generic(const char *p, const char *end, const Prefilter *prefilter) {
+    if (prefilter->nbytes == 0) return end;
+    if (prefilter->nbytes == 1 && !prefilter->case_mask[0]) return find_byte_generic(p, end, prefilter->bytes[0]);
+    while (p < end && !prefilter->member[(unsigned char)*p]) p++;
+    return p;
+}
+
+static const char *find_outside_generic(const char *p, const char *end, const Prefilter *set) {
+    while (p < end && set->member[(unsigned char)*p]) p++;
+    return p;
+}
+
+static void copy_span_generic(char *dst, const char *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+static size_t count_byte_generic(const char *p, const char *end, unsigned char c) {
+    size_t count = 0;
+    for (; p < end; p++) {
+        count += ((unsigned char)*p == c);
+    }
+    return count;
+}
+
+static const CpuKernels generic_kernels = {"generic", find_byte_generic, find_first_generic, find_outside_generic, copy_span_generic, count_byte_generic};
+
+#ifdef HAVE_X86_KERNELS
+
+/*
+   The vector variants finish a span of at least one vector with a final load
+   aligned to its end, masking off bytes already scanned, so that short lines
+   do not fall back to a byte loop.
+*/
+
+__attribute__((target("sse2")))
+static const char *find_byte_sse2(const char *p, const char *end, unsigned char c) {
+    if (end - p < 16) return find_byte_generic(p, end, c);
+    const __m128i needle = _mm_set1_epi8((char)c);
+    for (;;) {
+        const char *block = (end - p >= 16) ? p : end - 16;
+        __m128i v = _mm_loadu_si128((const __m128i *)block);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)) >> (p - block);
+        if (mask) return p + __builtin_ctz(mask);
+        if (block != p || p + 16 == end) return end;
+        p += 16;
+    }
+}
+
+__attribute__((target("sse2")))
+static const char *find_first_sse2(const char *p, const char *end, const Prefilter *prefilter) {
+    /* Large sets need a byte shuffle, which SSE2 lacks */
+    if (prefilter->nbytes < 0 || end - p < 16) return find_first_generic(p, end, prefilter);
+    if (prefilter->nbytes == 0) return end;
+
+    /* Case-masked compare: ORing 0x20 into the input matches both cases of a folded letter */
+    __m128i needles[PREFILTER_MAX_BYTES];
+    __m128i masks[PREFILTER_MAX_BYTES];
+    for (int k = 0; k < prefilter->nbytes; k++) {
+        needles[k] = _mm_set1_epi8((char)prefilter->bytes[k]);
+        masks[k] = _mm_set1_epi8((char)prefilter->case_mask[k]);
+    }
+    for (;;) {
+        const char *block = (end - p >= 16) ? p : end - 16;
+        __m128i v = _mm_loadu_si128((const __m128i *)block);
+        __m128i hit = _mm_cmpeq_epi8(_mm_or_si128(v, masks[0]), needles[0]);
+        for (int k = 1; k < prefilter->nbytes; k++) {
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_or_si128(v, masks[k]), needles[k]));
+        }
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit) >> (p - block);
+        if (mask) return p + __builtin_ctz(mask);
+        if (block != p || p + 16 == end) return end;
+        p += 16;
+    }
+}
+
+/* First byte not in a small set: the complement of the compare mask */
+__attribute__((target("sse2")))
+static const char *find_outside_sse2(const char *p, const char *end, const Prefilter *set) {
+    if (set->nbytes <= 0 || end - p < 16) return find_outside_generic(p, end, set);
+    __m128i needles[PREFILTER_MAX_BYTES];
+    __m128i masks[PREFILTER_MAX_BYTES];
+    for (int k = 0; k < set->nbytes; k++) {
+        needles[k] = _mm_set1_epi8((char)set->bytes[k]);
+        masks[k] = _mm_set1_epi8((char)set->case_mask[k]);
+    }
+    for (;;) {
+        const char *block = (end - p >= 16) ? p : end - 16;
+        __m128i v = _mm_loadu_si128((const __m128i *)block);
+        __m128i hit = _mm_cmpeq_epi8(_mm_or_si128(v, masks[0]), needles[0]);
+        for (int k = 1; k < set->nbytes; k++) {
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_or_si128(v, masks[k]), needles[k]));
+        }
+        unsigned mask = (~(unsigned)_mm_movemask_epi8(hit) & 0xffffu) >> (p - block);
+        if (mask) return p + __builtin_ctz(mask);
+        if (block != p || p + 16 == end) return end;
+        p += 16;
+    }
+}
+
+/* Whole vectors are counted with a compare mask; the tail is left to the byte loop */
+__attribute__((target("sse2")))
+static size_t count_byte_sse2(const char *p, const char *end, unsigned char c) {
+    const __m128i needle = _mm_set1_epi8((char)c);
+    size_t count = 0;
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        count += (size_t)__builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+    }
+    return count + count_byte_generic(p, end, c);
+}
+
+/* Short spans are copied inline; long ones are left to the C library */
+__attribute__((target("sse2")))
+static void copy_span_sse2(char *dst, const char *src, size_t n) {
+    if (n < 16 || n > 256) {
+        memcpy(dst, src, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+    }
+    if (i < n) {
+        _mm_storeu_si128((__m128i *)(dst + n - 16), _mm_loadu_si128((const __m128i *)(src + n - 16)));
+    }
+}
+
+__attribute__((target("avx2")))
+static const char *find_byte_avx2(const char *p, const char *end, unsigned char c) {
+    if (end - p < 32) return find_byte_generic(p, end, c);
+    const __m256i needle = _mm256_set1_epi8((char)c);
+    for (;;) {
+        const char *block = (end - p >= 32) ? p : end - 32;
+        __m256i v = _mm256_loadu_si256((const __m256i *)block);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle)) >> (p - block);
+        if (mask) return p + __builtin_ctz(mask);
+        if (block != p || p + 32 == end) return end;
+        p += 32;
+    }
+}
+
+__attribute__((target("avx2")))
+static const char *find_first_avx2(const char *p, const char *end, const Prefilter *prefilter) {
+    if (end - p < 32) return find_first_generic(p, end, prefilter);
+    if (prefilter->nbytes == 0) return end;
+
+    if (prefilter->nbytes > 0) {
+        __m256i needles[PREFILTER_MAX_BYTES];
+        __m256i masks[PREFILTER_MAX_BYTES];
+        for (int k = 0; k < prefilter->nbytes; k++) {
+            needles[k] = _mm256_set1_epi8((char)prefilter->bytes[k]);
+            masks[k] = _mm256_set1_epi8((char)prefilter->case_mask[k]);
+        }
+        for (;;) {
+            const char *block = (end - p >= 32) ? p : end - 32;
+            __m256i v = _mm256_loadu_si256((const __m256i *)block);
+            __m256i hit = _mm256_cmpeq_epi8(_mm256_or_si256(v, masks[0]), needles[0]);
+            for (int k = 1; k < prefilter->nbytes; k++) {
+                hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_or_si256(v, masks[k]), needles[k]));
+            }
+            unsigned mask = (unsigned)_mm256_movemask_epi8(hit) >> (p - block);
+            if (mask) return p + __builtin_ctz(mask);
+            if (block != p || p + 32 == end) return end;
+            p += 32;
+        }
+    }
+
+    /* Nibble lookup: a byte is a candidate when its low and high nibbles share a bucket */
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)prefilter->lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)prefilter->hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    for (;;) {
+        const char *block = (end - p >= 32) ? p : end - 32;
+        __m256i v = _mm256_loadu_si256((const __m256i *)block);
+        __m256i lo_bits = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+        __m256i hi_bits = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(lo_bits, hi_bits), zero);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(miss) >> (p - block);
+        /* Bucket sharing can flag extra bytes; confirm against the exact set */
+        while (mask) {
+            const char *hit = p + __builtin_ctz(mask);
+            if (prefilter->member[(unsigned char)*hit]) return hit;
+            mask &= mask - 1;
+        }
+        if (block != p || p + 32 == end) return end;
+        p += 32;
+    }
+}
+
+/* First byte not in a set; the nibble lookup is only used when it is exact for the set */
+__attribute__((target("avx2")))
+static const char *find_outside_avx2(const char *p, const char *end, const Prefilter *set) {
+    if (end - p < 32 || set->nbytes == 0 || (set->nbytes < 0 && !set->exact)) return find_outside_generic(p, end, set);
+
+    if (set->nbytes > 0) {
+        __m256i needles[PREFILTER_MAX_BYTES];
+        __m256i masks[PREFILTER_MAX_BYTES];
+        for (int k = 0; k < set->nbytes; k++) {
+            needles[k] = _mm256_set1_epi8((char)set->bytes[k]);
+            masks[k] = _mm256_set1_epi8((char)set->case_mask[k]);
+        }
+        for (;;) {
+            const char *block = (end - p >= 32) ? p : end - 32;
+            __m256i v = _mm256_loadu_si256((const __m256i *)block);
+            __m256i hit = _mm256_cmpeq_epi8(_mm256_or_si256(v, masks[0]), needles[0]);
+            for (int k = 1; k < set->nbytes; k++) {
+                hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_or_si256(v, masks[k]), needles[k]));
+            }
+            unsigned mask = ~(unsigned)_mm256_movemask_epi8(hit) >> (p - block);
+            if (mask) return p + __builtin_ctz(mask);
+            if (block != p || p + 32 == end) return end;
+            p += 32;
+        }
+    }
+
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    for (;;) {
+        const char *block = (end - p >= 32) ? p : end - 32;
+        __m256i v = _mm256_loadu_si256((const __m256i *)block);
+        __m256i lo_bits = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+        __m256i hi_bits = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(lo_bits, hi_bits), zero);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(miss) >> (p - block);
+        if (mask) return p + __builtin_ctz(mask);
+        if (block != p || p + 32 == end) return end;
+        p += 32;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t count_byte_avx2(const char *p, const char *end, unsigned char c) {
+    const __m256i needle = _mm256_set1_epi8((char)c);
+    size_t count = 0;
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        count += (size_t)__builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle)));
+    }
+    return count + count_byte_generic(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static void copy_span_avx2(char *dst, const char *src, size_t n) {
+    if (n < 32 || n > 512) {
+        memcpy(dst, src, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+    }
+    if (i < n) {
+        _mm256_storeu_si256((__m256i *)(dst + n - 32), _mm256_loadu_si256((const __m256i *)(src + n - 32)));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const char *find_byte_avx512(const char *p, const char *end, unsigned char c) {
+    if (end - p < 64) return find_byte_generic(p, end, c);
+    const __m512i needle = _mm512_set1_epi8((char)c);
+    for (;;) {
+        const char *block = (end - p >= 64) ? p : end - 64;
+        __mmask64 mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)block), needle) >> (p - block);
+        if (mask) return p + __builtin_ctzll(mask);
+        if (block != p || p + 64 == end) return end;
+        p += 64;
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const char *find_first_avx512(const char *p, const char *end, const Prefilter *prefilter) {
+    if (end - p < 64) return find_first_generic(p, end, prefilter);
+    if (prefilter->nbytes == 0) return end;
+
+    if (prefilter->nbytes > 0) {
+        __m512i needles[PREFILTER_MAX_BYTES];
+        __m512i masks[PREFILTER_MAX_BYTES];
+        for (int k = 0; k < prefilter->nbytes; k++) {
+            needles[k] = _mm512_set1_epi8((char)prefilter->bytes[k]);
+            masks[k] = _mm512_set1_epi8((char)prefilter->case_mask[k]);
+        }
+        for (;;) {
+            const char *block = (end - p >= 64) ? p : end - 64;
+            __m512i v = _mm512_loadu_si512((const void *)block);
+            __mmask64 mask = _mm512_cmpeq_epi8_mask(_mm512_or_si512(v, masks[0]), needles[0]);
+            for (int k = 1; k < prefilter->nbytes; k++) {
+                mask |= _mm512_cmpeq_epi8_mask(_mm512_or_si512(v, masks[k]), needles[k]);
+            }
+            mask >>= (p - block);
+            if (mask) return p + __builtin_ctzll(mask);
+            if (block != p || p + 64 == end) return end;
+            p += 64;
+        }
+    }
+
+    const __m512i lo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)prefilter->lo));
+    const __m512i hi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)prefilter->hi));
+    const __m512i nibble = _mm512_set1_epi8(0x0f);
+    for (;;) {
+        const char *block = (end - p >= 64) ? p : end - 64;
+        __m512i v = _mm512_loadu_si512((const void *)block);
+        __m512i lo_bits = _mm512_shuffle_epi8(lo, _mm512_and_si512(v, nibble));
+        __m512i hi_bits = _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble));
+        __mmask64 mask = _mm512_test_epi8_mask(lo_bits, hi_bits) >> (p - block);
+        while (mask) {
+            const char *hit = p + __builtin_ctzll(mask);
+            if (prefilter->member[(unsigned char)*hit]) return hit;
+            mask &= mask - 1;
+        }
+        if (block != p || p + 64 == end) return end;
+        p += 64;
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const char *find_outside_avx512(const char *p, const char *end, const Prefilter *set) {
+    if (end - p < 64 || set->nbytes == 0 || (set->nbytes < 0 && !set->exact)) return find_outside_generic(p, end, set);
+
+    if (set->nbytes > 0) {
+        __m512i needles[PREFILTER_MAX_BYTES];
+        __m512i masks[PREFILTER_MAX_BYTES];
+        for (int k = 0; k < set->nbytes; k++) {
+            needles[k] = _mm512_set1_epi8((char)set->bytes[k]);
+            masks[k] = _mm512_set1_epi8((char)set->case_mask[k]);
+        }
+        for (;;) {
+            const char *block = (end - p >= 64) ? p : end - 64;
+            __m512i v = _mm512_loadu_si512((const void *)block);
+            __mmask64 hit = _mm512_cmpeq_epi8_mask(_mm512_or_si512(v, masks[0]), needles[0]);
+            for (int k = 1; k < set->nbytes; k++) {
+                hit |= _mm512_cmpeq_epi8_mask(_mm512_or_si512(v, masks[k]), needles[k]);
+            }
+            __mmask64 mask = ~hit >> (p - block);
+            if (mask) return p + __builtin_ctzll(mask);
+            if (block != p || p + 64 == end) return end;
+            p += 64;
+        }
+    }
+
+    const __m512i lo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)set->lo));
+    const __m512i hi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)set->hi));
+    const __m512i nibble = _mm512_set1_epi8(0x0f);
+    for (;;) {
+        const char *block = (end - p >= 64) ? p : end - 64;
+        __m512i v = _mm512_loadu_si512((const void *)block);
+        __m512i lo_bits = _mm512_shuffle_epi8(lo, _mm512_and_si512(v, nibble));
+        __m512i hi_bits = _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble));
+        __mmask64 mask = _mm512_testn_epi8_mask(lo_bits, hi_bits) >> (p - block);
+        if (mask) return p + __builtin_ctzll(mask);
+        if (block != p || p + 64 == end) return end;
+        p += 64;
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t count_byte_avx512(const char *p, const char *end, unsigned char c) {
+    const __m512i needle = _mm512_set1_epi8((char)c);
+    size_t count = 0;
+    for (; end - p >= 64; p += 64) {
+        count += (size_t)__builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)p), needle));
+    }
+    return count + count_byte_generic(p, end, c);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void copy_span_avx512(char *dst, const char *src, size_t n) {
+    if (n < 64 || n > 1024) {
+        memcpy(dst, src, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        _mm512_storeu_si512((void *)(dst + i), _mm512_loadu_si512((const void *)(src + i)));
+    }
+    if (i < n) {
+        _mm512_storeu_si512((void *)(dst + n - 64), _mm512_loadu_si512((const void *)(src + n - 64)));
+    }
+}
+
+static const CpuKernels sse2_kernels = {"sse2", find_byte_sse2, find_first_sse2, find_outside_sse2, copy_span_sse2, count_byte_sse2};
+static const CpuKernels avx2_kernels = {"avx2", find_byte_avx2, find_first_avx2, find_outside_avx2, copy_span_avx2, count_byte_avx2};
+static const CpuKernels avx512_kernels = {"avx512", find_byte_avx512, find_first_avx512, find_outside_avx512, copy_span_avx512, count_byte_avx512};
+
+#endif /* HAVE_X86_KERNELS */
+
+/* Kernel variants in order of preference */
+static const CpuKernels *const all_kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    &avx512_kernels,
+    &avx2_kernels,
+    &sse2_kernels,
+#endif
+    &generic_kernels
+};
+
+/* Check whether this CPU (and OS) can run a kernel variant */
+static int cpu_supports_kernels(const CpuKernels *candidate) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (candidate == &avx512_kernels) {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    }
+    if (candidate == &avx2_kernels) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (candidate == &sse2_kernels) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return candidate == &generic_kernels;
+}
+
+/* Select kernels by name, or the best supported variant when name is NULL or "auto" */
+static int select_cpu_kernels(const char *name) {
+    size_t count = sizeof(all_kernels) / sizeof(all_kernels[0]);
+    int automatic = (name == NULL || strcmp(name, "auto") == 0);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!automatic && strcmp(name, all_kernels[i]->name) != 0) continue;
+        if (!cpu_supports_kernels(all_kernels[i])) {
+            if (automatic) continue;
+            fprintf(stderr, "Error: This CPU does not support the %s kernels.\n", name);
+            return 1;
+        }
+        kernels = all_kernels[i];
+        return 0;
+    }
+
+    fprintf(stderr, "Error: Unknown CPU kernels '%s'.\n", name);
+    return 1;
+}
+
+/* Print the kernel variants, whether each one can run here, and which one is in use */
+static void print_cpu_info(void) {
+    size_t count = sizeof(all_kernels) / sizeof(all_kernels[0]);
+    printf("Kernels:\n");
+    for (size_t i = 0; i < count; i++) {
+        printf("  %-8s %s%s\n", all_kernels[i]->name,
+               cpu_supports_kernels(all_kernels[i]) ? "supported" : "unsupported",
+               all_kernels[i] == kernels ? " (selected)" : "");
+    }
+}
@@ -0,0 +1,109 @@
+#!/bin/sh
+# Checks replace against known-good output. Usage: tests/run.sh [path/to/replace]
+
+REPLACE=${1:-./replace}
+case $REPLACE in /*) ;; *) REPLACE=$(pwd)/$REPLACE ;; esac
+TMP=$(mktemp -d) || exit 2
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 2
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# check NAME INPUT EXPECTED ARGS...: stdin INPUT (printf format) must give EXPECTED (printf format)
+check() {
+    name=$1 input=$2 expected=$3
+    shift 3
+    printf "$input" | "$REPLACE" "$@" > out 2> err || { fail "$name: exit $? $(cat err)"; return; }
+    printf "$expected" > want
+    cmp -s out want || fail "$name: got '$(od -An -c out | tr -s ' ')'"
+}
+
+# rejects NAME ARGS...: the arguments must be refused with an error
+rejects() {
+    name=$1
+    shift
+    if printf 'x\n' | "$REPLACE" "$@" > /dev/null 2> err || [ ! -s err ]; then
+        fail "$name: accepted"
+    fi
+}
+
+# status NAME EXPECTED ARGS...: the exit status of a run on file f
+status() {
+    name=$1 expected=$2
+    shift 2
+    "$REPLACE" "$@" > out 2> /dev/null
+    got=$?
+    [ "$got" = "$expected" ] || fail "$name: exit $got, want $expected"
+}
+
+# Regex matching (user-031)
+check "regex leftmost-longest" 'xabcabd\n' 'xYd\n' -E 'a(bc|b)*a?b?' Y
+check "regex classes" 'v1.2.3 v10\n' 'vN.N.N vN\n' -E '[0-9]+' N
+check "regex alternation" 'cat dog bird\n' 'pet pet bird\n' -E 'cat|dog' pet
+check "regex references" 'John Smith\n' 'Smith, John\n' -E '([A-Z][a-z]+) ([A-Z][a-z]+)' '\2, \1'
+check "regex whole match" 'ab\n' '[ab]\n' -E 'a.' '[\0]'
+check "regex anchors" 'aa\naa\n' 'Xa\nXa\n' -E '^a' X
+check "regex whole words" 'bidb id\n' 'bidb X\n' -E -w 'id' X
+check "regex shorthands" 'a1 \tb\n' 'XXYYX\n' -E '\w' X '\s' Y
+check "regex hex escape" 'ABC\n' 'xBC\n' -E '\x41' x
+check "regex punctuation escape" 'a.b axb\n' 'X axb\n' -E 'a\.b' X
+rejects "regex word boundary" -E '\bid\b' X
+rejects "regex word start" -E '\<id' X
+rejects "regex back-reference" -E '(a)\1' X
+rejects "regex unknown escape" -E '\q' X
+rejects "reference past the groups" -E a '[\1]'
+rejects "reference past the groups of a pair" -E '(a)' '\2'
+
+# Escapes and cross-line patterns (user-037)
+check "NUL in a regex" 'a\000b a0b\n' 'X a0b\n' -E -e 'a\0b' X
+check "NUL in a literal" 'a\000b a0b\n' 'X a0b\n' -e 'a\0b' X
+check "escapes in to-strings" 'a b\n' 'a\tb\n' -e ' ' '\t'
+check "literal across lines" 'key:\n  v\n' 'key: v\n' -e 'key:\n  ' 'key: '
+check "regex across lines" 'foo \n bar foo\nx\n' 'X foo\nx\n' -E -e 'foo\s+bar' X
+check "bounded regex across lines" 'a\nb\nab\n' 'X\nab\n' -E -e 'a\nb' X
+yes "$(printf 'foo\n  bar')" | head -n 400000 > lines
+yes X | head -n 200000 > want
+"$REPLACE" -E -e 'foo\s+bar' X < lines > out && cmp -s out want || fail "unbounded regex across chunks"
+"$REPLACE" -e 'foo\n  bar' X < lines > out && cmp -s out want || fail "literal across chunks"
+
+# Check-only modes (user-040)
+printf 'a foo\n' > f
+status "-q with a change" 0 -q a b -- f
+status "-q with no match" 1 -q z b -- f
+status "-l with identical bytes" 1 -l foo foo -- f
+status "-l with a chain that undoes itself" 1 -l a b --then b a -- f
+[ -z "$("$REPLACE" -l foo foo -- f)" ] || fail "-l listed an unchanged file"
+[ "$("$REPLACE" -n o 0 -- f)" = "f:2" ] || fail "-n count"
+
+# Rewrites in place (user-045)
+printf '#!/bin/sh\necho foo\n' > script
+chmod 750 script
+"$REPLACE" -s foo bar -- script
+[ "$(./script)" = bar ] || fail "rewritten script lost its mode"
+[ "$(ls -l script | cut -c1-10)" = "-rwxr-x---" ] || fail "rewritten file mode $(ls -l script | cut -c1-10)"
+yes abcdef | head -n 400000 > big
+yes abXYef | head -n 400000 > want
+"$REPLACE" -s cd XY -- big && cmp -s big want || fail "same-length rewrite of a large file"
+yes abcdef | head -n 400000 > big
+yes abef | head -n 400000 > want
+"$REPLACE" -s cd '' -- big && cmp -s big want || fail "shrinking rewrite of a large file"
+
+# Journal and undo (user-044)
+printf 'one two\n' > j1
+printf 'two three\n' > j2
+cp j1 j1.orig
+cp j2 j2.orig
+"$REPLACE" -s --journal=journal two 2 --then 2 deux -- j1 j2
+[ "$(cat j1)" = "one deux" ] || fail "journaled rewrite"
+"$REPLACE" -s --undo=journal
+cmp -s j1 j1.orig && cmp -s j2 j2.orig || fail "undo did not restore the files"
+
+if [ "$failures" -gt 0 ]; then
+    echo "$failures test(s) failed"
+    exit 1
+fi
+echo "All tests passed"